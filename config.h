@@ -72,10 +72,15 @@
  *   it is important for high frequencies when ADC(s) is(are) faster
  *   than USB; in this case buffer will be eventually exhausted and
  *   acquisition will be downsampled to the speed of USB transfer.
+ * ADC_ISO_PACKETS_PER_FRAME is amount of USB packets sent in each 1 ms
+ *   frame by isochronous endpoint (interface alternate setting 1);
+ *   both frame buffers must fit into 512 bytes of USB packet memory
+ *   together with buffer table and EP0 buffers, so 2 is the maximum.
  */
 #define ADC_MAX_PACKET_SIZE         64
 #define ADC_SAMPLE_SIZE             60
 #define ADC_SAMPLES_COUNT           272
+#define ADC_ISO_PACKETS_PER_FRAME   2
 
 /***********************************
  * Default device configuration after startup.
@@ -5,6 +5,7 @@
 #include <QCheckBox>
 
 #include <math.h>
+#include <string.h>
 
 static QList<int> bits(uint16_t v)
 {
@@ -15,6 +16,65 @@ static QList<int> bits(uint16_t v)
     return ret;
 }
 
+class BitReader
+{
+    const uint8_t * data;
+    int pos;
+public:
+    BitReader(const uint8_t * data0) : data(data0), pos(0) {}
+    uint32_t get(int n)
+    {
+        uint32_t v = 0;
+        for (; n > 0; n--, pos++)
+            v = (v << 1) | ((data[pos / 8] >> (7 - pos % 8)) & 1);
+        return v;
+    }
+};
+
+// body of delta + Rice coded packet: number of periods, then bitstream
+static void rice_decode(const uint8_t * data, int nchannels, QList<uint16_t> &samples)
+{
+    BitReader reader(data + 1);
+    uint16_t prev[ADC_TOTAL_CHANNELS] = {0};
+    uint32_t acc[ADC_TOTAL_CHANNELS] = {0};
+    for (int period = 0; period < data[0]; period++)
+    {
+        bool raw = reader.get(1);
+        for (int ch = 0; ch < nchannels; ch++)
+        {
+            uint16_t v;
+            uint32_t u;
+            if (raw)
+            {
+                v = reader.get(ADC_RICE_RAW_BITS);
+                int32_t d = (int32_t)v - (int32_t)prev[ch];
+                u = (uint32_t)((d << 1) ^ (d >> 31));
+            }
+            else
+            {
+                int k = 0;
+                for (uint32_t m = acc[ch] >> (ADC_RICE_ACC_SHIFT + 1); m; m >>= 1)
+                    k++;
+                k = qMin(k, ADC_RICE_K_MAX);
+                uint32_t q = 0;
+                while (q < ADC_RICE_ESCAPE && reader.get(1))
+                    q++;
+                if (q == ADC_RICE_ESCAPE)
+                    u = reader.get(ADC_RICE_ESCAPE_BITS);
+                else
+                    u = (q << k) | reader.get(k);
+                v = prev[ch] + (int32_t)((u >> 1) ^ -(u & 1));
+            }
+            if (period == 0)
+                acc[ch] = ADC_RICE_ACC_INIT;
+            else
+                acc[ch] += u - (acc[ch] >> ADC_RICE_ACC_SHIFT);
+            prev[ch] = v;
+            samples.push_back(v);
+        }
+    }
+}
+
 static double round_to(double value, int ndigits)
 {
     double base = 1.0;
@@ -53,9 +113,11 @@ static void transfer_callback(struct libusb_transfer * transfer)
     window->onTransfer(transfer);
 }
 
-double MainWindow::samplePeriod(int frequency_code)
+double MainWindow::samplePeriod(int frequency_code, int oversampling)
 {
     int freq = 0;
+    if (frequency_code == ADC_FREQUENCY_CUSTOM) // device tells period of all channels
+        return (double)use_period / ADC_TIMER_CLOCK * (double)(1 << (2 * oversampling));
     switch (frequency_code)
     {
     default:
@@ -98,9 +160,15 @@ double MainWindow::samplePeriod(int frequency_code)
     else if (channels_in_use == 1 && frequency_code == ADC_FREQUENCY_MAX) // two ADCs in Fast interleave mode
         ret *= 0.5;
     ret *= (double)channels_in_use;
+    ret *= (double)(1 << (2 * oversampling)); // 4^k conversions per sample
     return ret;
 }
 
+int MainWindow::frequencyCode()
+{
+    return (ui->dsbRate->value() > 0) ? ADC_FREQUENCY_CUSTOM : ui->cbFrequency->currentIndex();
+}
+
 void MainWindow::setCurrentADC(libusb_device *device)
 {
     int res;
@@ -156,6 +224,10 @@ void MainWindow::setCurrentADC(libusb_device *device)
     if ((res = libusb_claim_interface(current_adc, 0)) != 0)
         qDebug("Error claiming interface: code = %d", res);
 
+    bool iso = ui->actionIsochronous->isChecked();
+    if ((res = libusb_set_interface_alt_setting(current_adc, 0, iso ? ADC_ALT_SETTING_ISO : ADC_ALT_SETTING_BULK)) != 0)
+        qDebug("Error setting alternate setting: code = %d", res);
+
     int dev_bufs = 0;
     for (int i = 0; i < TRANSFER_COUNT; i++)
     {
@@ -171,15 +243,24 @@ void MainWindow::setCurrentADC(libusb_device *device)
 
     for (int i = 0; i < TRANSFER_COUNT; i++)
     {
-        if (!(transfers[i] = libusb_alloc_transfer(0)))
+        if (!(transfers[i] = libusb_alloc_transfer(iso ? TRANSFER_ISO_FRAMES : 0)))
         {
             qDebug("Can't allocate transfer #%d", i);
             break;
         }
-        libusb_fill_bulk_transfer(transfers[i], current_adc, ADC_SAMPLES_EP | 0x80,
-                                  bufs[i].ptr, bufs[i].length,
-                                  transfer_callback,
-                                  (void*)this, TRANSFER_TIMEOUT_MS);
+        if (iso)
+        {
+            libusb_fill_iso_transfer(transfers[i], current_adc, ADC_SAMPLES_EP | 0x80,
+                                     bufs[i].ptr, bufs[i].length, TRANSFER_ISO_FRAMES,
+                                     transfer_callback,
+                                     (void*)this, TRANSFER_TIMEOUT_MS);
+            libusb_set_iso_packet_lengths(transfers[i], ADC_ISO_FRAME_SIZE);
+        }
+        else
+            libusb_fill_bulk_transfer(transfers[i], current_adc, ADC_SAMPLES_EP | 0x80,
+                                      bufs[i].ptr, bufs[i].length,
+                                      transfer_callback,
+                                      (void*)this, TRANSFER_TIMEOUT_MS);
     }
 
     readConfig();
@@ -299,6 +380,12 @@ void MainWindow::redrawSamples(bool force)
         int y = maxy - (maxy - miny) * (level - Vmin) / (Vmax - Vmin);
         painter.drawLine(margin, y, W - margin, y);
     }
+    if (trig_time >= Tmin && trig_time <= Tmax)
+    {
+        int x = minx + (maxx - minx) * (trig_time - Tmin) / (Tmax - Tmin);
+        painter.setPen(QPen(Qt::lightGray, 3, Qt::DotLine));
+        painter.drawLine(x, margin, x, H - margin);
+    }
 
     QList<QPolygon> polys;
 
@@ -322,6 +409,25 @@ void MainWindow::redrawSamples(bool force)
     for (int j = 0; j < channel_nums.size(); j++)
     {
         int ch = channel_nums[j];
+        if (vs_max_data.contains(ch))
+        {
+            // envelope: min values forward, then max values backward
+            QPolygon envelope = polys[j];
+            const QList<double> &vs_max = vs_max_data[ch];
+            for (int i = qMin(vs_max.size(), ts_data.size()) - 1; i >= 0; i--)
+            {
+                int x = minx + (maxx - minx) * (ts_data[i] - Tmin) / (Tmax - Tmin);
+                int y = maxy - (maxy - miny) * (vs_max[i] - Vmin) / (Vmax - Vmin);
+                envelope.push_back(QPoint(x, y));
+            }
+            QColor fill = channels_color[ch];
+            fill.setAlpha(96);
+            painter.setPen(QPen(channels_color[ch], 1));
+            painter.setBrush(fill);
+            painter.drawPolygon(envelope);
+            painter.setBrush(Qt::NoBrush);
+            continue;
+        }
         painter.setPen(QPen(channels_color[ch], 1));
         painter.drawPolyline(polys[j]);
     }
@@ -341,16 +447,24 @@ void MainWindow::resetStatistics()
     packets_lost = 0;
 }
 
-void MainWindow::updateData(int packet_num, int freq_code, const QList<int> &channels, const QList<uint16_t> &samples)
+void MainWindow::updateData(qulonglong period_num, int freq_code, int oversampling, const QList<int> &channels, const QList<uint16_t> &samples0, bool peak_pairs)
 {
-    double dt = samplePeriod(freq_code);
-    double packet_period = dt / channels.size() * samples.size();
-    double t0 = (double)packet_num * packet_period;
+    // with peak_pairs, each channel is listed twice: min, then max
+    // periods before exact capture start are dropped, see README
+    qulonglong drop = qMin(trig_skip - qMin(trig_skip, period_num), (qulonglong)(samples0.size() / channels.size()));
+    QList<uint16_t> samples = samples0.mid(drop * channels.size());
+    if (samples.isEmpty())
+        return;
+    period_num += drop - trig_skip;
+
+    double dt = samplePeriod(freq_code, oversampling);
+    double t0 = time_base + (double)((qlonglong)period_num - period_base) * dt;
 
     if (ts_data.size() > 0 && t0 < ts_data.last())
     {
         ts_data.clear();
         vs_data.clear();
+        vs_max_data.clear();
         redraw_needed = true;
     }
 
@@ -368,7 +482,8 @@ void MainWindow::updateData(int packet_num, int freq_code, const QList<int> &cha
         {
             int ch_num = channels[ch];
             if (channels_box[ch_num]->isChecked())
-                dump.write(QString("\tCH.%1").arg(ch_num + 1).toLatin1());
+                dump.write(QString("\tCH.%1%2").arg(ch_num + 1)
+                           .arg(peak_pairs ? ((ch & 1) ? " max" : " min") : "").toLatin1());
         }
         dump.write("\n");
     }
@@ -384,10 +499,11 @@ void MainWindow::updateData(int packet_num, int freq_code, const QList<int> &cha
             int ch_num = channels[ch];
             if (!channels_box[ch_num]->isChecked())
                 continue;
-            double v = (double)samples[i * channels.size() + ch] / (double)ADC_MAX_LEVEL * ui->dsbVRef->value();
-            if (!vs_data.contains(ch_num))
-                vs_data[ch_num] = QList<double>();
-            vs_data[ch_num].append(v);
+            double v = (double)samples[i * channels.size() + ch] / (double)(ADC_MAX_LEVEL << (peak_pairs ? 0 : oversampling)) * ui->dsbVRef->value();
+            QMap<int, QList<double> > &data = (peak_pairs && (ch & 1)) ? vs_max_data : vs_data;
+            if (!data.contains(ch_num))
+                data[ch_num] = QList<double>();
+            data[ch_num].append(v);
             if (dump.isOpen())
                 dump.write(QString("\t%1").arg(v * 1e3, 0, 'f', 3).toLatin1());
         }
@@ -405,13 +521,57 @@ void MainWindow::parseADCPacket(const unsigned char *packet)
 
     int lost = 0;
 
+    if (header->channels & ADC_HEADER_SLOW) // slow channel group isn't plotted
+        return;
+    if ((header->channels & ADC_HEADER_CHANNELS_MASK) && (header->mode & ADC_MODE_BITS) == ADC_BITS_SPECTRUM)
+        return; // spectra aren't plotted
+    if ((header->channels & ADC_HEADER_CHANNELS_MASK) && (header->mode & ADC_MODE_BITS) == ADC_BITS_STATS)
+        return; // neither are statistics records
+
+    if ((header->channels & ADC_HEADER_CHANNELS_MASK) == 0) // event packet
+    {
+        if (header->mode == ADC_EVENT_TRIGGER) // goes right before packet with trigger flag
+        {
+            memcpy(&trig_event, data, sizeof(trig_event));
+            trig_event_received = true;
+        }
+        else if (header->mode == ADC_EVENT_GAP) // goes right before the first packet after ring overflow
+        {
+            ADCGapEvent gap;
+            memcpy(&gap, data, sizeof(gap));
+            if (gap_event_received)
+            {
+                gap_event.periods += gap.periods;
+                gap_event.packets += gap.packets;
+            }
+            else
+                gap_event = gap;
+            gap_event_received = true;
+            ts_event_received = false; // it was for a dropped packet
+        }
+        else if (header->mode == ADC_EVENT_TIMESTAMP) // goes right before packet it describes
+        {
+            memcpy(&ts_event, data, sizeof(ts_event));
+            ts_event_received = true;
+        }
+        return;
+    }
+
     int seq_n = (header->sequence & 0x7f);
-    if (last_seq < 0 || (header->sequence & 0x80))
+    bool restarted = (last_seq < 0 || (header->sequence & 0x80));
+    if (restarted)
     {
         if (last_seq >= 0)
             redrawSamples();
         seq_t0 = seq_n;
         last_seq = seq_n;
+        rice_periods = 0;
+        trig_skip = trig_event_received ? trig_event.skip : 0;
+        trig_time = -1.0;
+        gap_event_received = false;
+        period_base = 0;
+        time_base = 0.0;
+        ts_origin_valid = false;
     }
     else
     {
@@ -420,7 +580,7 @@ void MainWindow::parseADCPacket(const unsigned char *packet)
         last_seq += lost + 1;
     }
 
-    QList<int> channels = bits(header->channels);
+    QList<int> channels = bits(header->channels & ADC_HEADER_CHANNELS_MASK);
     int nbits = (header->mode & ADC_MODE_BITS);
     int freq_code = (header->mode & ADC_MODE_FREQUENCY) >> 4;
 
@@ -428,6 +588,7 @@ void MainWindow::parseADCPacket(const unsigned char *packet)
         return;
 
     QList<uint16_t> samples;
+    int oversampling = 0;
     int i;
     switch (nbits)
     {
@@ -460,10 +621,117 @@ void MainWindow::parseADCPacket(const unsigned char *packet)
             samples.push_back(((uint16_t)data[i+2] << 4) | (((uint16_t)data[i+1] >> 0) & 0x0f));
         }
         break;
+    case ADC_BITS_RICE:
+        rice_decode(data, channels.size(), samples);
+        break;
+    case ADC_BITS_HI + 1: // oversampled, (12+k)-bit values in 16-bit words
+    case ADC_BITS_HI + 2:
+    case ADC_BITS_HI + 3:
+        oversampling = nbits - ADC_BITS_HI;
+        for (i = 0; i < length; i += 2)
+            samples.push_back(((uint16_t)data[i+1] << 8) | (uint16_t)data[i+0]);
+        break;
+    case ADC_BITS_PEAK: // min and max of 4^peak conversions in 16-bit words
+        oversampling = peak;
+        for (i = 0; i < length; i += 2)
+            samples.push_back(((uint16_t)data[i+1] << 8) | (uint16_t)data[i+0]);
+        break;
+    case ADC_BITS_RAW & ADC_MODE_BITS:
+        for (i = 0; i < length; i += 2)
+            samples.push_back(((uint16_t)data[i+1] << 8) | (uint16_t)data[i+0]);
+        if (channels.size() == 1 && freq_code == ADC_FREQUENCY_MAX) // Fast interleave mode, ADC2 sample goes second
+            for (i = 0; i + 1 < samples.size(); i += 2)
+                samples.swap(i, i + 1);
+        break;
     }
 
-    updateData(last_seq - seq_t0, freq_code, channels, samples);
-    updateStatistics(ADC_PACKET_SIZE, 1, samples.size(), samples.size() / channels.size(), lost);
+    bool peak_pairs = (nbits == ADC_BITS_PEAK);
+    int offset = header->channels >> ADC_HEADER_OFFSET_SHIFT;
+    if (peak_pairs) // min and max are counted as two channels
+    {
+        QList<int> pairs;
+        foreach (int ch, channels)
+            pairs << ch << ch;
+        channels = pairs;
+        offset *= 2;
+    }
+    int nchannels = channels.size();
+    int packet_samples = samples.size();
+    if (restarted && trig_event_received)
+    {
+        trig_time = (double)trig_event.position * samplePeriod(freq_code, oversampling);
+        trig_event_received = false;
+    }
+    bool gap = gap_event_received;
+    bool resync = gap || (ts_event_received && ts_origin_valid);
+    qulonglong resync_period = 0;
+    if (gap)
+    {
+        // periods are counted from the one being completed when gap started,
+        // at the rate of this packet
+        qlonglong gap_start = (qlonglong)next_period - (qlonglong)trig_skip;
+        time_base += (double)(gap_start - period_base) * last_dt;
+        period_base = gap_start;
+        resync_period = next_period + gap_event.periods;
+        gap_event_received = false;
+    }
+    else if (resync) // device period index doesn't wrap around as sequence number does
+        resync_period = (qulonglong)((qlonglong)ts_event.period - ts_origin);
+    if (resync)
+    {
+        rice_periods = resync_period;
+        seq_t0 = last_seq;
+        stream_offset = offset - (qlonglong)resync_period * nchannels;
+    }
+    double dt = samplePeriod(freq_code, oversampling);
+    if (dt != last_dt) // after SLOWDOWN gap periods are not device ones
+        ts_origin_valid = false;
+    last_dt = dt;
+    qulonglong packet_period; // of the first period started in this packet
+    if (nbits == ADC_BITS_RICE) // variable number of whole periods per packet
+    {
+        packet_period = rice_periods;
+        updateData(rice_periods, freq_code, oversampling, channels, samples);
+        rice_periods += packet_samples / nchannels;
+        next_period = rice_periods;
+    }
+    else
+    {
+        // sample periods may straddle packets: first `offset` samples complete
+        // the period started in previous packet, they are dropped if it is lost
+        qulonglong first_sample = (qulonglong)(last_seq - seq_t0) * packet_samples;
+        bool completed = false; // period started in previous packet
+        if (restarted)
+            stream_offset = offset;
+        if (!restarted && lost == 0 && !gap && partial_samples.size() == (nchannels - offset) % nchannels)
+        {
+            first_sample -= partial_samples.size();
+            samples = partial_samples + samples;
+            completed = !partial_samples.isEmpty();
+        }
+        else
+        {
+            samples = samples.mid(offset);
+            first_sample += offset;
+        }
+        int complete = samples.size() / nchannels * nchannels;
+        partial_samples = samples.mid(complete);
+        samples = samples.mid(0, complete);
+        qulonglong first_period = (first_sample - stream_offset) / nchannels;
+        updateData(first_period, freq_code, oversampling, channels, samples, peak_pairs);
+        next_period = first_period + complete / nchannels;
+        packet_period = first_period + (completed ? 1 : 0);
+    }
+    if (ts_event_received)
+    {
+        if (!ts_origin_valid)
+        {
+            ts_origin = (qlonglong)ts_event.period - (qlonglong)packet_period;
+            ts_origin_valid = true;
+        }
+        ts_event_received = false;
+    }
+    updateStatistics(ADC_PACKET_SIZE, 1, packet_samples, packet_samples / nchannels, lost);
 }
 
 int32_t MainWindow::readRegister(int reg_index0, int nbytes, int tries)
@@ -494,18 +762,17 @@ void MainWindow::writeRegister(int reg_index0, int32_t reg_value, int nbytes, in
 {
     if (!current_adc)
         return;
+    /* all bytes in one transfer, device reconfigures once */
+    unsigned char data[4];
     for (int i = 0; i < nbytes; i++)
+        data[i] = (reg_value >> (i*8)) & 0xff;
+    for (int ntry = 0; ntry < tries; ntry++)
     {
-        int index = reg_index0 + i;
-        uint8_t value = (reg_value >> (i*8)) & 0xff;
-        for (int ntry = 0; ntry < tries; ntry++)
-        {
-            int res = libusb_control_transfer(current_adc, 0x40, ADC_REQUEST_SETUP, value, index, NULL, 0, TRANSFER_TIMEOUT_MS);
-            if (res < 0)
-                qDebug("[%d/%d] [index = %d+%d, value = 0x%02x] libusb_control_transfer() => %d", ntry+1, tries, reg_index0, i, value, res);
-            else
-                break;
-        }
+        int res = libusb_control_transfer(current_adc, 0x40, ADC_REQUEST_WRITE_REGS, 0, reg_index0, data, nbytes, TRANSFER_TIMEOUT_MS);
+        if (res < 0)
+            qDebug("[%d/%d] [index = %d, value = 0x%x] libusb_control_transfer() => %d", ntry+1, tries, reg_index0, reg_value, res);
+        else
+            break;
     }
 }
 
@@ -537,17 +804,33 @@ void MainWindow::readConfig()
     case ADC_BITS_HI:
         ui->cbNBits->setCurrentIndex(3);
         break;
+    case ADC_BITS_RAW:
+        ui->cbNBits->setCurrentIndex(4);
+        break;
+    case ADC_BITS_RICE:
+        ui->cbNBits->setCurrentIndex(5);
+        break;
     }
 
     ui->cbFrequency->setCurrentIndex(readRegister(ADC_INDEX_FREQUENCY));
+    uint32_t period = readRegister(ADC_INDEX_PERIOD, 4);
+    ui->dsbRate->setValue(period ? ADC_TIMER_CLOCK * 0.001 / period : 0.0);
+    use_period = readRegister(ADC_INDEX_USE_PERIOD, 4);
+    ui->cbOversampling->setCurrentIndex(qMin(readRegister(ADC_INDEX_OVERSAMPLING), ADC_OVERSAMPLING_MAX));
+    peak = qMin(readRegister(ADC_INDEX_PEAK), ADC_PEAK_MAX);
+    ui->cbPeak->setCurrentIndex(peak);
     ui->cbSamples->setCurrentIndex(readRegister(ADC_INDEX_SAMPLES));
+    ui->sbSegments->setValue(readRegister(ADC_INDEX_SEGMENTS));
+    ui->cbOverflow->setCurrentIndex(readRegister(ADC_INDEX_OVERFLOW));
+    ui->sbTimestamps->setValue(readRegister(ADC_INDEX_TIMESTAMPS));
     ui->hsOffset->setValue(readRegister(ADC_INDEX_OFFSET, 2));
     ui->hsGain->setValue(readRegister(ADC_INDEX_GAIN));
     ui->cbTrigger->setCurrentIndex(readRegister(ADC_INDEX_TRIGGER));
     ui->cbTrigChannel->setCurrentIndex(readRegister(ADC_INDEX_TRIG_CHANNEL));
     ui->hsTrigLevel->setValue(readRegister(ADC_INDEX_TRIG_LEVEL, 2));
+    ui->sbTrigHysteresis->setValue(readRegister(ADC_INDEX_TRIG_HYSTERESIS, 2));
 
-    double dt = samplePeriod(ui->cbFrequency->currentIndex()) * 1000.0;
+    double dt = samplePeriod(frequencyCode()) * 1000.0;
     ui->dsbTrigOffset->setValue(dt * (double)readRegister(ADC_INDEX_TRIG_OFFSET, 4));
     ui->dsbTrigTMin->setValue(dt * (double)readRegister(ADC_INDEX_TRIG_T_MIN, 4));
     ui->dsbTrigTMax->setValue(dt * (double)readRegister(ADC_INDEX_TRIG_T_MAX, 4));
@@ -559,7 +842,22 @@ MainWindow::MainWindow(libusb_context *ctx0, QWidget *parent) :
     current_adc(NULL),
     restart_transfers(false),
     last_seq(-1),
+    rice_periods(0),
+    stream_offset(0),
+    next_period(0),
+    gap_event_received(false),
+    period_base(0),
+    time_base(0.0),
+    last_dt(0.0),
+    ts_event_received(false),
+    ts_origin_valid(false),
+    ts_origin(0),
+    trig_event_received(false),
+    trig_skip(0),
+    trig_time(-1.0),
     channels_in_use(0),
+    use_period(0),
+    peak(0),
     redraw_needed(true),
     ui(new Ui::MainWindow)
 {
@@ -607,6 +905,20 @@ void MainWindow::onTransfer(libusb_transfer *transfer)
     {
         qDebug("transfer 0x%08llx not completed, status = %d", (qulonglong)transfer, transfer->status);
     }
+    else if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+    {
+        // each frame carries up to ADC_ISO_PACKETS_PER_FRAME packets, failed frames
+        // are skipped and show up as lost packets by sequence numbers
+        for (int n = 0; n < transfer->num_iso_packets; n++)
+        {
+            struct libusb_iso_packet_descriptor * frame = &transfer->iso_packet_desc[n];
+            if (frame->status != LIBUSB_TRANSFER_COMPLETED)
+                continue;
+            unsigned char * buffer = libusb_get_iso_packet_buffer_simple(transfer, n);
+            for (int i = 0; i + (int)ADC_PACKET_SIZE <= (int)frame->actual_length; i += ADC_PACKET_SIZE)
+                parseADCPacket(buffer + i);
+        }
+    }
     else
     {
         for (int i = 0; i + (int)ADC_PACKET_SIZE <= transfer->actual_length; i += ADC_PACKET_SIZE)
@@ -710,6 +1022,12 @@ void MainWindow::on_cbNBits_currentIndexChanged(int index)
     case 3:
         writeRegister(ADC_INDEX_BITS, ADC_BITS_HI);
         break;
+    case 4:
+        writeRegister(ADC_INDEX_BITS, ADC_BITS_RAW);
+        break;
+    case 5:
+        writeRegister(ADC_INDEX_BITS, ADC_BITS_RICE);
+        break;
     default:
         break;
     }
@@ -754,16 +1072,21 @@ void MainWindow::on_hsTrigLevel_valueChanged(int value)
 
 void MainWindow::on_dsbTrigOffset_valueChanged(double arg1)
 {
-    double dt = samplePeriod(ui->cbFrequency->currentIndex());
+    double dt = samplePeriod(frequencyCode());
     if (dt == 0)
         return;
     int offset = int(arg1 * 0.001 / dt);
     writeRegister(ADC_INDEX_TRIG_OFFSET, offset, 4);
 }
 
+void MainWindow::on_sbTrigHysteresis_valueChanged(int arg1)
+{
+    writeRegister(ADC_INDEX_TRIG_HYSTERESIS, arg1, 2);
+}
+
 void MainWindow::on_dsbTrigTMin_valueChanged(double arg1)
 {
-    double dt = samplePeriod(ui->cbFrequency->currentIndex());
+    double dt = samplePeriod(frequencyCode());
     if (dt == 0)
         return;
     int t_min = int(arg1 * 0.001 / dt);
@@ -772,7 +1095,7 @@ void MainWindow::on_dsbTrigTMin_valueChanged(double arg1)
 
 void MainWindow::on_dsbTrigTMax_valueChanged(double arg1)
 {
-    double dt = samplePeriod(ui->cbFrequency->currentIndex());
+    double dt = samplePeriod(frequencyCode());
     if (dt == 0)
         return;
     int t_max = int(arg1 * 0.001 / dt);
@@ -802,8 +1125,12 @@ void MainWindow::on_cbVScale_currentIndexChanged(int)
 void MainWindow::on_pbOnce_clicked()
 {
     ui->pbContinuous->setChecked(false);
-    writeRegister(ADC_INDEX_CMD, ADC_CMD_ONCE);
-
+    writeRegister(ADC_INDEX_CMD,
+                      ui->sbSegments->value() > 1 ?
+                          ADC_CMD_SEGMENTED :
+                          ADC_CMD_ONCE);
+    use_period = readRegister(ADC_INDEX_USE_PERIOD, 4);
+    peak = qMin(readRegister(ADC_INDEX_PEAK), ADC_PEAK_MAX);
 }
 
 void MainWindow::on_pbContinuous_clicked()
@@ -812,4 +1139,50 @@ void MainWindow::on_pbContinuous_clicked()
                       ui->pbContinuous->isChecked() ?
                           ADC_CMD_CONTINUOUS :
                           ADC_CMD_STOP);
+    use_period = readRegister(ADC_INDEX_USE_PERIOD, 4);
+    peak = qMin(readRegister(ADC_INDEX_PEAK), ADC_PEAK_MAX);
+}
+
+void MainWindow::on_cbOversampling_currentIndexChanged(int index)
+{
+    writeRegister(ADC_INDEX_OVERSAMPLING, index);
+}
+
+void MainWindow::on_cbPeak_currentIndexChanged(int index)
+{
+    writeRegister(ADC_INDEX_PEAK, index);
+}
+
+void MainWindow::on_sbSegments_valueChanged(int arg1)
+{
+    writeRegister(ADC_INDEX_SEGMENTS, arg1);
+}
+
+void MainWindow::on_cbOverflow_currentIndexChanged(int index)
+{
+    writeRegister(ADC_INDEX_OVERFLOW, index);
+}
+
+void MainWindow::on_sbTimestamps_valueChanged(int arg1)
+{
+    writeRegister(ADC_INDEX_TIMESTAMPS, arg1);
+}
+
+void MainWindow::on_dsbRate_valueChanged(double arg1)
+{
+    uint32_t period = (arg1 > 0) ? (uint32_t)qRound(ADC_TIMER_CLOCK * 0.001 / arg1) : 0;
+    writeRegister(ADC_INDEX_PERIOD, period, 4);
+    readConfig();
+}
+
+void MainWindow::on_actionIsochronous_toggled(bool checked)
+{
+    Q_UNUSED(checked);
+    if (!current_adc)
+        return;
+    // reopen device to switch alternate setting and transfers type
+    libusb_device * dev = libusb_ref_device(libusb_get_device(current_adc));
+    setCurrentADC(NULL);
+    setCurrentADC(dev);
+    libusb_unref_device(dev);
 }
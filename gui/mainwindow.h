@@ -16,6 +16,7 @@
 #define TRANSFER_COUNT      8
 #define TRANSFER_SIZE       (ADC_SAMPLES_COUNT * ADC_PACKET_SIZE * 1)
 #define TRANSFER_TIMEOUT_MS 300
+#define TRANSFER_ISO_FRAMES (TRANSFER_SIZE / ADC_ISO_FRAME_SIZE)
 
 namespace Ui {
 class MainWindow;
@@ -56,6 +57,21 @@ class MainWindow : public QMainWindow
     struct libusb_transfer* transfers[TRANSFER_COUNT];
 
     int                     last_seq, seq_t0;
+    qulonglong              rice_periods;
+    QList<uint16_t>         partial_samples;
+    qlonglong               stream_offset;
+    qulonglong              next_period;
+    bool                    gap_event_received;
+    ADCGapEvent             gap_event;
+    qlonglong               period_base;
+    double                  time_base, last_dt;
+    bool                    ts_event_received, ts_origin_valid;
+    ADCTimestampEvent       ts_event;
+    qlonglong               ts_origin;
+    bool                    trig_event_received;
+    ADCTriggerEvent         trig_event;
+    qulonglong              trig_skip;
+    double                  trig_time;
     QElapsedTimer           statistic_timer, redraw_timer;
     qulonglong              bytes_received, packets_received,
                             samples_received, periods_received,
@@ -63,18 +79,22 @@ class MainWindow : public QMainWindow
 
     QList<double>           ts_data;
     QMap<int, QList<double> > vs_data;
+    QMap<int, QList<double> > vs_max_data; // upper envelope in peak detection mode
     int                     channels_in_use;
+    uint32_t                use_period;
+    int                     peak; // 4^peak conversions per min/max pair, 0 - off
     bool                    redraw_needed;
 
     QImage                  plot_bgd;
 
     QFile                   dump;
 
-    double samplePeriod(int frequency_code);
+    double samplePeriod(int frequency_code, int oversampling = 0);
+    int frequencyCode();
     void setCurrentADC(libusb_device * device);
     void resetStatistics();
     void updateStatistics(int bytes, int packets, int samples, int periods, int lost);
-    void updateData(int packet_num, int freq_code, const QList<int> &channels, const QList<uint16_t> &samples);
+    void updateData(qulonglong period_num, int freq_code, int oversampling, const QList<int> &channels, const QList<uint16_t> &samples, bool peak_pairs = false);
     void redrawSamples(bool force = false);
 
     void parseADCPacket(const unsigned char * packet);
@@ -107,6 +127,7 @@ private slots:
     void on_cbTrigChannel_currentIndexChanged(int index);
     void on_hsTrigLevel_valueChanged(int value);
     void on_dsbTrigOffset_valueChanged(double arg1);
+    void on_sbTrigHysteresis_valueChanged(int arg1);
     void on_dsbTrigTMin_valueChanged(double arg1);
     void on_dsbTrigTMax_valueChanged(double arg1);
     void on_cbTScale_currentIndexChanged(int index);
@@ -115,6 +136,13 @@ private slots:
     void on_cbVScale_currentIndexChanged(int index);
     void on_pbOnce_clicked();
     void on_pbContinuous_clicked();
+    void on_cbOversampling_currentIndexChanged(int index);
+    void on_cbPeak_currentIndexChanged(int index);
+    void on_sbSegments_valueChanged(int arg1);
+    void on_cbOverflow_currentIndexChanged(int index);
+    void on_sbTimestamps_valueChanged(int arg1);
+    void on_dsbRate_valueChanged(double arg1);
+    void on_actionIsochronous_toggled(bool checked);
 
 private:
     Ui::MainWindow *ui;
@@ -7,21 +7,64 @@
 #include "usbd.h"
 
 #define ADC_PACKET_SIZE             (ADC_SAMPLE_SIZE + sizeof(ADCPacketHeader))
+#define ADC_ISO_FRAME_SIZE          (ADC_ISO_PACKETS_PER_FRAME * ADC_PACKET_SIZE)
 
 #define ADC_TOTAL_CHANNELS          10
 #define ADC_SELECT_ALL_CHANNELS     ((1 << 10) - 1)
 
 #define ADC_SIZ_DEVICE_DESC         18
-#define ADC_SIZ_CONFIG_DESC         25
+#define ADC_SIZ_CONFIG_DESC         41
 
 #define ADC_CMD_STOP                0
 #define ADC_CMD_ONCE                1
 #define ADC_CMD_CONTINUOUS          2
+#define ADC_CMD_SEGMENTED           3
+#define ADC_CMD_SPECTRUM            4
+#define ADC_CMD_STATISTICS          5
 
+#define ADC_STATS_WINDOW_MAX        (1UL << 20)  /* periods, sums of 12-bit samples fit in 32 bits */
+
+#define ADC_SEGMENTS_MAX            16
+
+#define ADC_SLOW_CHANNELS_MAX       8  /* 4 in ADC1 injected sequence, 4 in ADC2's one */
+#define ADC_SLOW_DIVIDER_MAX        256
+
+/* SLOW_CHANNELS bits above external channels, ADC1's internal ones */
+#define ADC_SLOW_TEMPERATURE        0x0400  /* channel 16, temperature sensor */
+#define ADC_SLOW_VREFINT            0x0800  /* channel 17, internal reference */
+#define ADC_VREFINT_MV              1200  /* typical, VDDA = 1200 mV * 0xfff / Vrefint sample */
+
+#define ADC_OVERFLOW_DROP_NEWEST    0
+#define ADC_OVERFLOW_DROP_OLDEST    1
+#define ADC_OVERFLOW_PAUSE          2
+#define ADC_OVERFLOW_SLOWDOWN       3
+
+#define ADC_BITS_RICE               1
 #define ADC_BITS_DIGITAL            2
 #define ADC_BITS_LO                 4
 #define ADC_BITS_MID                8
 #define ADC_BITS_HI                 12
+#define ADC_BITS_RAW                16
+
+#define ADC_OVERSAMPLING_MAX        3
+#define ADC_PEAK_MAX                6
+
+#define ADC_BITS_PEAK               3  /* in headers: min/max pairs of 12-bit values, see PEAK */
+#define ADC_BITS_SPECTRUM           5  /* in headers: FFT magnitudes, see ADC_CMD_SPECTRUM */
+#define ADC_BITS_STATS              6  /* in headers: statistics record, see ADC_CMD_STATISTICS */
+
+/* sample periods may straddle packets: bits 15..12 of header's channels
+ * field tell how many samples at the start of body belong to the period
+ * started in previous packet
+ */
+#define ADC_HEADER_CHANNELS_MASK    0x03FF
+#define ADC_HEADER_OFFSET_SHIFT     12
+#define ADC_HEADER_SLOW             0x0400  /* packet of slow channel group */
+
+/* event packets have no channels in header, `mode` is event code */
+#define ADC_EVENT_TRIGGER           1
+#define ADC_EVENT_GAP               2
+#define ADC_EVENT_TIMESTAMP         3
 
 #define ADC_FREQUENCY_OFF           0
 #define ADC_FREQUENCY_MAX           1
@@ -34,6 +77,9 @@
 #define ADC_FREQUENCY_5KHZ          8
 #define ADC_FREQUENCY_2KHZ          9
 #define ADC_FREQUENCY_1KHZ          10
+#define ADC_FREQUENCY_CUSTOM        15  /* in headers, when PERIOD is set */
+
+#define ADC_TIMER_CLOCK             72000000  /* PERIOD and USE_PERIOD ticks per second */
 
 #define ADC_TRIGGER_NONE            0
 #define ADC_TRIGGER_RISING          1
@@ -41,18 +87,31 @@
 #define ADC_TRIGGER_THRESHOLD       3
 #define ADC_TRIGGER_STROBE_LO       4
 #define ADC_TRIGGER_STROBE_HI       5
+#define ADC_TRIGGER_AWD_HI          6  /* level above TRIG_LEVEL, seen by analog watchdog */
+#define ADC_TRIGGER_AWD_LO          7  /* level below TRIG_LEVEL, the same */
 
 #define adc_get_configuration       NOP_Process
 #define adc_set_configuration       NOP_Process
 #define adc_get_interface           NOP_Process
-#define adc_set_interface           NOP_Process
 #define adc_get_status              NOP_Process
 #define adc_clear_feature           NOP_Process
 #define adc_set_end_point_feature   NOP_Process
 #define adc_set_device_feature      NOP_Process
 #define adc_set_device_address      NOP_Process
 
+#define ADC_ALT_SETTING_BULK        0
+#define ADC_ALT_SETTING_ISO         1
+
 #define ADC_REQUEST_SETUP           1
+#define ADC_REQUEST_WRITE_REGS      2  /* wIndex - first register, data stage - values */
+
+#define ADC_WRITE_STAGE             0x01  /* wValue flag: keep in staging image, do not commit */
+
+/* what commit of registers did, from the lightest to the heaviest */
+#define ADC_UPDATE_TRIGGER          1  /* trigger and timestamps registers, applied on the fly */
+#define ADC_UPDATE_PACKING          2  /* offset and gain, applied on the fly */
+#define ADC_UPDATE_TIMING           3  /* frequency, acquisition restarts */
+#define ADC_UPDATE_RESTART          4  /* anything else, acquisition restarts */
 
 #define ADC_INDEX_CMD               1
 #define ADC_INDEX_CHANNELS          2
@@ -68,6 +127,30 @@
 #define ADC_INDEX_TRIG_T_MIN        18
 #define ADC_INDEX_TRIG_T_MAX        22
 #define ADC_INDEX_USE_CHANNELS      26
+#define ADC_INDEX_OVERSAMPLING      28
+#define ADC_INDEX_TRIG_HYSTERESIS   29
+#define ADC_INDEX_SEGMENTS          31
+#define ADC_INDEX_OVERFLOW          32
+#define ADC_INDEX_OVERFLOWS         33
+#define ADC_INDEX_DROPPED_PACKETS   37
+#define ADC_INDEX_TIMESTAMPS        41
+#define ADC_INDEX_UPDATE_USEC       42
+#define ADC_INDEX_UPDATE_KIND       46
+#define ADC_INDEX_PERIOD            47
+#define ADC_INDEX_USE_PERIOD        51
+#define ADC_INDEX_SLOW_CHANNELS     55
+#define ADC_INDEX_SLOW_DIVIDER      57
+#define ADC_INDEX_VDDA_MV           59
+#define ADC_INDEX_PEAK              61
+#define ADC_INDEX_FFT_BITS          62
+#define ADC_INDEX_FFT_AVERAGE       63
+#define ADC_INDEX_FFT_CYCLES        64
+#define ADC_INDEX_STATS_WINDOW      68
+#define ADC_INDEX_BLOCK_PACKETS     72
+#define ADC_INDEX_DMA_IRQ_RATE      73
+#define ADC_INDEX_PACK_LOAD         77
+#define ADC_INDEX_DIRECT_CYCLES     79
+#define ADC_INDEX_RING_CYCLES       81
 
 
 #pragma pack(1)
@@ -87,22 +170,114 @@ typedef struct {
     uint32_t    trig_t_min;
     uint32_t    trig_t_max;
     uint16_t    use_channels;
+    uint8_t     oversampling;
+    uint16_t    trig_hysteresis;
+    uint8_t     segments;
+    uint8_t     overflow;
+    uint32_t    overflows;  /* read-only counters, since update_mode() */
+    uint32_t    dropped_packets;
+    uint8_t     timestamps;  /* data packets per timestamp event, 0 - none */
+    uint32_t    update_usec;  /* read-only, duration of the last commit ... */
+    uint8_t     update_kind;  /* ... and ADC_UPDATE_* it was */
+    uint32_t    period;  /* of each ADC conversion in system clock ticks, FREQUENCY if 0 */
+    uint32_t    use_period;  /* read-only, actual ticks per period of all channels */
+    uint16_t    slow_channels;  /* bitmask of slow group, converted ... */
+    uint16_t    slow_divider;  /* ... every this number of TIM1 periods */
+    uint16_t    vdda_mv;  /* read-only, supply voltage by the last Vrefint sample, 0 - unknown */
+    uint8_t     peak;  /* min and max over 4^peak periods instead of samples, 0 - off */
+    uint8_t     fft_bits;  /* log2 of SPECTRUM block, FFT_BITS_MIN..FFT_BITS_MAX */
+    uint8_t     fft_average;  /* SPECTRUM blocks per output, 0 and 1 - none */
+    uint32_t    fft_cycles;  /* read-only, CPU cycles of the last block transform of one channel */
+    uint32_t    stats_window;  /* STATISTICS periods per record, 1..ADC_STATS_WINDOW_MAX */
+    uint8_t     block_packets;  /* read-only, packets per DMA interrupt */
+    uint32_t    dma_irq_rate;  /* read-only, DMA interrupts per second ... */
+    uint16_t    pack_load;  /* ... and 1/1000 of CPU time spent packing only, over the last second */
+    uint16_t    direct_cycles;  /* read-only, CPU cycles per packet packed straight into PMA ... */
+    uint16_t    ring_cycles;  /* ... and through ring, with copy to PMA, over the last second */
 } ADCRegs;
 
 typedef struct {
     uint8_t     sequence;
-    uint16_t    channels;
+    uint16_t    channels;  /* bitmask and first-period offset, see below */
     uint8_t     mode;  /* bits per sample and sampling frequency */
 } ADCPacketHeader;
+
+/* body of ADC_EVENT_TRIGGER packet, it goes right before the packet
+ * with trigger flag; both values are in sample periods
+ */
+typedef struct {
+    int32_t     position;  /* of trigger, counted from the first kept period */
+    uint32_t    skip;  /* periods to drop after first complete one of flagged packet */
+    uint32_t    timestamp;  /* microseconds, when trigger was detected */
+    uint16_t    segment;  /* index of capture in ADC_CMD_SEGMENTED mode */
+} ADCTriggerEvent;
+
+/* body of ADC_EVENT_GAP packet, it goes right before the first packet
+ * after overflow of ring
+ */
+typedef struct {
+    uint32_t    periods;  /* to add to the number of period being completed when gap started */
+    uint32_t    packets;  /* dropped */
+} ADCGapEvent;
+
+/* body of ADC_EVENT_TIMESTAMP packet, it goes right before every
+ * TIMESTAMPS-th packet after trigger; periods are counted from
+ * acquisition start and don't wrap around with `sequence`
+ */
+typedef struct {
+    uint32_t    period;  /* index of the first complete period of the next packet */
+    uint32_t    timestamp;  /* microseconds, at DMA interrupt ... */
+    uint32_t    timestamp_period;  /* ... when this period was about to be converted */
+} ADCTimestampEvent;
+
+/* start of body of slow group packet (ADC_HEADER_SLOW in header), it
+ * goes right before a data packet; 16-bit samples follow, period by period
+ */
+typedef struct {
+    int32_t     offset;  /* TIM1 periods from the first complete period of the next packet to the first slow one */
+    uint16_t    divider;  /* TIM1 periods between slow ones */
+    uint8_t     periods;  /* slow periods in packet */
+    uint8_t     internal;  /* ADC_SLOW_* >> 10, their samples go after external ones */
+} ADCSlowHeader;
+
+/* start of body of spectrum packet (ADC_BITS_SPECTRUM in header), 16-bit
+ * magnitudes of consecutive bins of one channel follow
+ */
+typedef struct {
+    uint16_t    first;  /* bin, of 2^(bits-1) ones */
+    uint8_t     bits;  /* log2 of block size */
+    uint8_t     blocks;  /* averaged */
+} ADCSpectrumHeader;
+
+/* body of statistics packet (ADC_BITS_STATS in header), one channel in
+ * header; sums are of raw 12-bit samples
+ */
+typedef struct {
+    uint32_t    window;  /* index, counted from acquisition start */
+    uint32_t    periods;  /* in window */
+    uint32_t    sum;
+    uint64_t    sum_squares;
+    uint16_t    min;
+    uint16_t    max;
+    uint16_t    level;  /* crossings are counted through mean of previous window */
+    uint16_t    crossings;  /* rising ones, with TRIG_HYSTERESIS */
+    uint32_t    first_crossing;  /* periods from window start */
+    uint32_t    last_crossing;
+} ADCStatsRecord;
 #pragma pack()
 
 extern uint32_t adc_rx_total;
 extern uint32_t adc_tx_total;
+extern uint32_t adc_block_overruns;
+extern uint32_t adc_direct_packets;
 extern volatile int is_triggered;
 extern volatile int usb_tx_in_progress;
 
 void adcdma_irq(void);
+void adc_pack_irq(void);
+void adc_irq(void);
 
 void adc_on_packet_transmitted(void);
+void adc_usb_irq(void);
 
 #endif /* __ADC_H */
@@ -0,0 +1,16 @@
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <stdint.h>
+
+#define FFT_BITS_MIN    8
+#define FFT_BITS_MAX    10
+#define FFT_SIZE_MAX    (1 << FFT_BITS_MAX)
+
+/* Hann-windowed real FFT of 2^bits 12-bit samples, in place: buf holds
+ * samples on entry and is scratch afterwards. Adds 2^(bits-1) bin
+ * magnitudes to acc, as sine amplitudes in 1/16 of ADC LSB.
+ */
+void fft_magnitudes(int16_t *buf, int bits, uint32_t *acc);
+
+#endif /* __FFT_H */
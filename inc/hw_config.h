@@ -33,6 +33,8 @@
     GPIO_Pin_0 | GPIO_Pin_1)
 #define ADCDMA_IRQ              DMA1_Channel1_IRQn
 #define ADCDMA_IRQ_HANDLER      DMA1_Channel1_IRQHandler
+#define ADC_IRQ                 ADC1_2_IRQn
+#define ADC_IRQ_HANDLER         ADC1_2_IRQHandler
 
 #define LED_GPIO                GPIOC
 #define LED_1                   GPIO_Pin_13
@@ -41,6 +43,7 @@
 #define ADCDMA_IRQ_PRIO         0
 #define USB_IRQ_PRIO            1
 #define CONSOLE_IRQ_PRIO        2
+#define PACK_IRQ_PRIO           3  /* PendSV, packing of DMA blocks */
 
 /*
  * Another periphery in use:
@@ -76,8 +76,13 @@
 #define ENDP0_TXADDR        (0x80)
 
 /* EP1  */
-/* tx buffer base address */
-#define ENDP1_TXADDR        (0xC0)
+/* double-buffered bulk IN: tx buffer 0 and buffer 1 base addresses */
+#define ENDP1_TXADDR0       (0xC0)
+#define ENDP1_TXADDR1       (0x100)
+#define ENDP1_TX_BUFFERS    (2)
+/* isochronous IN (alternate setting 1): frame buffer 0 and buffer 1 */
+#define ENDP1_ISO_TXADDR0   (0xC0)
+#define ENDP1_ISO_TXADDR1   (0x140)
 
 /*-------------------------------------------------------------*/
 /* -------------------   ISTR events  -------------------------*/
@@ -1,6 +1,7 @@
 #!/usr/bin/python3
 
 import sys
+import time
 import struct
 import argparse
 
@@ -11,9 +12,46 @@ ID_VENDOR, ID_PRODUCT = 0x1A87, 0x5513
 EP_READ  = 1
 
 ADC_REQUEST_SETUP           = 1
+ADC_REQUEST_WRITE_REGS      = 2
+ADC_WRITE_STAGE             = 0x01
+ADC_FREQUENCY_CUSTOM        = 15
+ADC_TIMER_CLOCK             = 72000000
+ADC_UPDATE = {
+    1: "trigger",
+    2: "packing",
+    3: "timing",
+    4: "restart",
+}
 ADC_TOTAL_CHANNELS          = 10
 ADC_MODE_BITS               = 0x0F
 ADC_MODE_FREQUENCY          = 0xF0
+ADC_BITS_RAW                = 16
+ADC_BITS_RICE               = 1
+ADC_BITS_HI                 = 12
+ADC_OVERSAMPLING_MAX        = 3
+ADC_BITS_PEAK               = 3
+ADC_BITS_SPECTRUM           = 5
+ADC_SPECTRUM_BINS           = 28
+ADC_BITS_STATS              = 6
+ADC_STATS_WINDOW_MAX        = 1 << 20
+FFT_BITS_MIN                = 8
+FFT_BITS_MAX                = 10
+ADC_PEAK_MAX                = 6
+ADC_HEADER_CHANNELS_MASK    = 0x03FF
+ADC_HEADER_OFFSET_SHIFT     = 12
+ADC_HEADER_SLOW             = 0x0400
+ADC_SLOW_TEMPERATURE        = 0x0400
+ADC_SLOW_VREFINT            = 0x0800
+ADC_VREFINT_V               = 1.2
+ADC_EVENT_TRIGGER           = 1
+ADC_EVENT_GAP               = 2
+ADC_EVENT_TIMESTAMP         = 3
+
+RICE_ESCAPE                 = 16
+RICE_ESCAPE_BITS            = 13
+RICE_K_MAX                  = 12
+RICE_ACC_SHIFT              = 5
+RICE_ACC_INIT               = (8 << RICE_ACC_SHIFT)
 
 _invdict = lambda d: dict([(v, k) for (k, v) in d.items()])
 
@@ -32,15 +70,50 @@ ADC_INDEX = {  # <mnemonic> : (<index>, <nbytes>)
     "trig_t_min":   (18, 4),
     "trig_t_max":   (22, 4),
     "use_channels": (26, 2),
+    "oversampling": (28, 1),
+    "trig_hysteresis": (29, 2),
+    "segments":     (31, 1),
+    "overflow":     (32, 1),
+    "overflows":    (33, 4),
+    "dropped_packets": (37, 4),
+    "timestamps":   (41, 1),
+    "update_usec":  (42, 4),
+    "update_kind":  (46, 1),
+    "period":       (47, 4),
+    "use_period":   (51, 4),
+    "slow_channels": (55, 2),
+    "slow_divider": (57, 2),
+    "vdda_mv":      (59, 2),
+    "peak":         (61, 1),
+    "fft_bits":     (62, 1),
+    "fft_average":  (63, 1),
+    "fft_cycles":   (64, 4),
+    "stats_window": (68, 4),
+    "block_packets": (72, 1),
+    "dma_irq_rate": (73, 4),
+    "pack_load":    (77, 2),
+    "direct_cycles": (79, 2),
+    "ring_cycles":  (81, 2),
 }
 
 ADC_CMD = {
     0: "stop",
     1: "once",
-    2: "continuous"
+    2: "continuous",
+    3: "segmented",
+    4: "spectrum",
+    5: "statistics"
 }
 ADC_CMD_INV = _invdict(ADC_CMD)
 
+ADC_OVERFLOW = {
+    0: "drop-newest",
+    1: "drop-oldest",
+    2: "pause",
+    3: "slowdown"
+}
+ADC_OVERFLOW_INV = _invdict(ADC_OVERFLOW)
+
 ADC_FREQUENCY = {
     0: 0,
     1: 857143,
@@ -63,6 +136,8 @@ ADC_TRIGGER = {
     3: "threshold",
     4: "strobelo",
     5: "strobehi",
+    6: "awdhi",
+    7: "awdlo",
 }
 ADC_TRIGGER_INV = _invdict(ADC_TRIGGER)
 
@@ -78,12 +153,24 @@ parser.add_argument('-c', '--channels', type=int, dest='channels',
     nargs='*', choices=range(ADC_TOTAL_CHANNELS), default=None,
     help="List of channel numbers to be captured")
 parser.add_argument('-b', '--bits', type=int, dest='bits',
-    choices=[2, 4, 8, 12], default=None,
-    help="Sample resolution in bits-per-sample")
+    choices=[1, 2, 4, 8, 12, 16], default=None,
+    help="Sample resolution in bits-per-sample (16 - raw 12-bit ADC values, "
+    "1 - lossless delta+Rice coded 12-bit values)")
 parser.add_argument('-f', '--frequency', type=int, dest='frequency',
     choices=sorted(ADC_FREQUENCY.values()), default=None,
     help="Frequency of each of two ADC, actual samplerate is "
     "2 * Frequency / NumberOfChannels")
+parser.add_argument('-r', '--rate', type=float, dest='rate', default=None,
+    help="Any frequency of each of two ADC in Hz instead of --frequency, "
+    "it is rounded to 1/{} s".format(ADC_TIMER_CLOCK))
+parser.add_argument('-x', '--oversampling', type=int, dest='oversampling',
+    choices=range(ADC_OVERSAMPLING_MAX + 1), default=None,
+    help="Sum up 4^<oversampling> conversions per sample, output is "
+    "(12 + <oversampling>)-bit samples at 4^<oversampling> times lower rate")
+parser.add_argument('--peak', type=int, dest='peak',
+    choices=range(ADC_PEAK_MAX + 1), default=None,
+    help="Output min and max of 4^<peak> conversions per sample instead of "
+    "their sum, 0 - off, --oversampling is ignored if set")
 parser.add_argument('-o', '--offset', type=int, dest='offset',
     default=None,
     help="Zero-level for samples")
@@ -93,6 +180,38 @@ parser.add_argument('-g', '--gain', type=int, dest='gain',
 parser.add_argument('-s', '--samples', type=int, dest='samples',
     default=None,
     help="Number of samples to be captured after trigger (1024 * 2^<samples>)")
+parser.add_argument('--overflow', type=str, dest='overflow',
+    choices=sorted(ADC_OVERFLOW.values()), default=None,
+    help="What device does when host doesn't read samples fast enough, "
+    "dropped periods are reported anyway")
+parser.add_argument('--segments', type=int, dest='segments',
+    default=None,
+    help="Number of captures in segmented mode, each is sent after all "
+    "of them are taken")
+parser.add_argument('--timestamps', type=int, dest='timestamps',
+    default=None,
+    help="Send absolute period index and device time every <timestamps> "
+    "packets, so timeline survives any loss (0 - never)")
+parser.add_argument('--slow-channels', type=int, dest='slow_channels',
+    nargs='*', choices=range(ADC_TOTAL_CHANNELS), default=None,
+    help="List of channel numbers to be captured once per <slow-divider> "
+    "periods (4 with one channel in --channels, 8 otherwise)")
+parser.add_argument('--slow-divider', type=int, dest='slow_divider',
+    default=None,
+    help="Periods between samples of slow channels (1..256)")
+parser.add_argument('--fft-bits', type=int, dest='fft_bits',
+    choices=range(FFT_BITS_MIN, FFT_BITS_MAX + 1), default=None,
+    help="Log2 of block size in spectrum mode, it may be reduced to fit "
+    "device memory with many channels")
+parser.add_argument('--fft-average', type=int, dest='fft_average', default=None,
+    help="Blocks averaged per spectrum (1..255)")
+parser.add_argument('--stats-window', type=int, dest='stats_window', default=None,
+    help="Periods per record in statistics mode (1..{})".format(ADC_STATS_WINDOW_MAX))
+parser.add_argument('--temperature', action='store_true', dest='temperature',
+    help="Add internal temperature sensor to slow channels")
+parser.add_argument('--vrefint', action='store_true', dest='vrefint',
+    help="Add internal reference to slow channels, voltages are corrected "
+    "by it then instead of taking <v-ref> as it is")
 parser.add_argument('-t', '--trigger', type=str, dest='trigger',
     choices=sorted(ADC_TRIGGER.values()), default=None,
     help="Type of trigger event to be monitored")
@@ -106,6 +225,10 @@ parser.add_argument('--trig-offset', type=int, dest='trig_offset',
     default=None,
     help="Time before (<0) or after (>0) trigger event to start capture, "
     "in samples per channel")
+parser.add_argument('--trig-hysteresis', type=int, dest='trig_hysteresis',
+    default=None,
+    help="Level must go beyond <trig-level> -/+ <trig-hysteresis> to arm "
+    "rising/falling trigger again")
 parser.add_argument('--trig-t-min', type=int, dest='trig_t_min',
     default=None,
     help="Minimum strobe length in samples for trigger")
@@ -124,6 +247,14 @@ parser.add_argument('--v-scale', type=float, dest='vscale', default=1.0,
 parser.add_argument('--max-samples', type=int, dest='max_samples', default=None,
     help="Maximum number of samples to be read (default - until timeout)")
 
+parser.add_argument('--config-latency', action='store_true', dest='config_latency',
+    help="Run acquisition in given mode and measure how long writing "
+    "registers of each kind blacks it out, then exit")
+
+parser.add_argument('--profile', action='store_true', dest='profile',
+    help="Run acquisition for each bits, number of channels and frequency "
+    "and report packets sent and dropped and CPU time of packing, then exit")
+
 parser.add_argument('--output', type=str, dest='output', default=None,
     help="Output file for tabular data (default - stdout if --plot not given, "
     "or no output otherwise")
@@ -147,17 +278,141 @@ def indicies_to_bits(indicies):
     return ret
 
 
-def configure(dev, var, value):
+def configure(dev, var, value, stage=False):
+    index, nbytes = ADC_INDEX[var]
+    data = [(value >> (i*8)) & 0xff for i in range(nbytes)]
+    dev.ctrl_transfer(0x40, ADC_REQUEST_WRITE_REGS,
+        ADC_WRITE_STAGE if stage else 0, index, data)
+
+
+def configure_bytewise(dev, var, value):
     index, nbytes = ADC_INDEX[var]
     for i in range(nbytes):
         bval = (value >> (i*8)) & 0xff
         dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, bval, index + i)
 
 
-def unpack_data(data, bits):
+def commit(dev):
+    dev.ctrl_transfer(0x40, ADC_REQUEST_WRITE_REGS, 0, 0)
+
+
+def read_register(dev, var):
+    index, nbytes = ADC_INDEX[var]
+    value = 0
+    for i in range(0, nbytes, 2):
+        data = dev.ctrl_transfer(0xc0, ADC_REQUEST_SETUP, 0,
+            (index + i) | ((index + i + 1) << 8), 2)
+        value |= (data[0] | (data[1] << 8)) << (i*8)
+    return value & ((1 << (nbytes*8)) - 1)
+
+
+def config_latency(dev):
+    # registers are written with their current values, so nothing changes
+    for var, write in (("trig_offset", configure_bytewise),
+                       ("trig_offset", configure),
+                       ("trig_level", configure),
+                       ("offset", configure),
+                       ("frequency", configure),
+                       ("channels", configure)):
+        value = read_register(dev, var)
+        t0 = time.perf_counter()
+        write(dev, var, value)
+        t1 = time.perf_counter()
+        print("{:<12} {:<7} {:>6.0f} us on host, {:>5} us on device{}".format(
+            var, ADC_UPDATE.get(read_register(dev, "update_kind"), "?"),
+            (t1 - t0) * 1e6, read_register(dev, "update_usec"),
+            " (last of byte-by-byte writes)" if write is configure_bytewise else ""))
+
+
+PROFILE_SECONDS = 2.0  # PACK_LOAD (packing only) and DMA_IRQ_RATE are updated each second
+PROFILE_CHANNELS = (1, 2, 3)  # first ones; 3 takes dummy conversions in dual mode
+
+
+def profile(dev, bits_list, channels_list):
+    print("bits chans  frequency  pkt/DMA  DMA irq/s    sent/s  dropped/s  pack  ns/packet  direct  ring")
+    for bits in bits_list:
+        for channels in channels_list:
+            nchans = len(channels)
+            for code in sorted(k for k in ADC_FREQUENCY if ADC_FREQUENCY[k]):
+                configure(dev, "bits", bits, stage=True)
+                configure(dev, "channels", indicies_to_bits(channels), stage=True)
+                configure(dev, "frequency", code, stage=True)
+                configure(dev, "period", 0, stage=True)
+                configure(dev, "trigger", ADC_TRIGGER_INV["none"], stage=True)
+                commit(dev)
+                configure(dev, "cmd", ADC_CMD_INV["continuous"])
+                t0 = time.perf_counter()
+                nbytes = 0
+                while time.perf_counter() - t0 < PROFILE_SECONDS:
+                    try:
+                        nbytes += len(dev.read(EP_READ, 64 * 64, int(args.timeout*1000.0)))
+                    except usb.core.USBError:
+                        break
+                dt = time.perf_counter() - t0
+                block_packets = read_register(dev, "block_packets")
+                irq_rate = read_register(dev, "dma_irq_rate")
+                load = read_register(dev, "pack_load")
+                dropped = read_register(dev, "dropped_packets")
+                direct = read_register(dev, "direct_cycles")
+                ring = read_register(dev, "ring_cycles")
+                configure(dev, "cmd", ADC_CMD_INV["stop"])
+                while True:  # the rest of buffer
+                    try:
+                        dev.read(EP_READ, 64 * 64, int(args.timeout*1000.0))
+                    except usb.core.USBError:
+                        break
+                sent = nbytes // 64
+                produced = (sent + dropped) / dt
+                print("{:>4} {:>5} {:>10} {:>8} {:>10} {:>9.0f} {:>10.0f} {:>4.1f}% {:>10} {:>7} {:>5}".format(
+                    bits, nchans, ADC_FREQUENCY[code], block_packets, irq_rate,
+                    sent / dt, dropped / dt, load / 10.0,
+                    "{:.0f}".format(load * 1e6 / produced) if produced else "-",
+                    direct or "-", ring or "-"))
+
+
+def rice_decode(data, nchans):
+    """Decode body of delta+Rice coded packet into list of 12-bit values"""
+    pos = 0
+    def get(n):
+        nonlocal pos
+        v = 0
+        for i in range(pos, pos + n):
+            v = (v << 1) | ((data[1 + i // 8] >> (7 - i % 8)) & 1)
+        pos += n
+        return v
+
+    ret = []
+    prev = [0] * nchans
+    acc = [0] * nchans
+    for period in range(data[0]):
+        raw = get(1)
+        for ch in range(nchans):
+            if raw:
+                v = get(12)
+                d = v - prev[ch]
+                u = (d << 1) if d >= 0 else ((-d << 1) - 1)
+            else:
+                k = min((acc[ch] >> (RICE_ACC_SHIFT + 1)).bit_length(), RICE_K_MAX)
+                q = 0
+                while q < RICE_ESCAPE and get(1):
+                    q += 1
+                u = get(RICE_ESCAPE_BITS) if q == RICE_ESCAPE else (q << k) | get(k)
+                v = prev[ch] + ((u >> 1) ^ -(u & 1))
+            if period == 0:
+                acc[ch] = RICE_ACC_INIT
+            else:
+                acc[ch] += u - (acc[ch] >> RICE_ACC_SHIFT)
+            prev[ch] = v
+            ret.append(v)
+    return ret
+
+
+def unpack_data(data, bits, swapped=False, nchans=1):
     ret = []
     scale = args.v_ref / float(0xfff)
-    if bits == 2:
+    if bits == ADC_BITS_RICE:
+        ret = rice_decode(data, nchans)
+    elif bits == 2:
         for b in data:
             ret.append((b & 0xc0) <<  4)
             ret.append((b & 0x30) <<  6)
@@ -175,23 +430,131 @@ def unpack_data(data, bits):
             b1, b2, b3 = data[i], data[i+1], data[i+2]
             ret.append((b1 << 4) | (b2 >> 4))
             ret.append((b3 << 4) | (b2 & 0xf))
+    elif ADC_BITS_HI < bits <= ADC_BITS_HI + ADC_OVERSAMPLING_MAX:
+        for i in range(0, len(data), 2):
+            ret.append(data[i] | (data[i+1] << 8))
+        scale /= float(1 << (bits - ADC_BITS_HI))
+    elif bits == ADC_BITS_PEAK:  # (min, max) pairs count as single samples
+        for i in range(0, len(data), 4):
+            ret.append((data[i] | (data[i+1] << 8), data[i+2] | (data[i+3] << 8)))
+        return [(lo * scale, hi * scale) for lo, hi in ret]
+    elif bits == (ADC_BITS_RAW & ADC_MODE_BITS):
+        for i in range(0, len(data), 2):
+            ret.append(data[i] | (data[i+1] << 8))
+        if swapped:  # fast interleaved mode, ADC2 sample goes second
+            for i in range(0, len(ret) - 1, 2):
+                ret[i], ret[i+1] = ret[i+1], ret[i]
     return [float(x) * scale for x in ret]
 
 
 
+def read_spectrum(dev, nchans):
+    # the first complete spectrum of each channel, as sine amplitudes
+    spectra, freq, bits = {}, 0, 0
+    while len(spectra) < nchans or any(None in bins for bins in spectra.values()):
+        try:
+            data = dev.read(EP_READ, 64, int(args.timeout*1000.0))
+        except usb.core.USBError as ex:
+            break
+        seq, chans, mode = struct.unpack("<BHB", data[:4])
+        if (mode & ADC_MODE_BITS) != ADC_BITS_SPECTRUM or not (chans & ADC_HEADER_CHANNELS_MASK):
+            continue
+        first, bits, blocks = struct.unpack("<HBB", data[4:8])
+        freq = (mode & ADC_MODE_FREQUENCY) >> 4
+        ch = "CH.{}".format(bits_to_indicies(chans & ADC_HEADER_CHANNELS_MASK)[0])
+        bins = spectra.setdefault(ch, [None] * (1 << (bits - 1)))
+        values = struct.unpack("<{}H".format(ADC_SPECTRUM_BINS), data[8:8 + 2*ADC_SPECTRUM_BINS])
+        for i, v in enumerate(values):  # 1/16 of ADC LSB
+            if first + i < len(bins) and bins[first + i] is None:
+                bins[first + i] = v / 16.0 * args.v_ref / float(0xfff) / args.vscale
+    return freq, bits, spectra
+
+
+def read_stats(dev):
+    # records of one window, until all channels of it are received
+    window, records, freq = None, {}, 0
+    while True:
+        try:
+            data = dev.read(EP_READ, 64, int(args.timeout*1000.0))
+        except usb.core.USBError as ex:
+            return freq, window, records
+        seq, chans, mode = struct.unpack("<BHB", data[:4])
+        if (mode & ADC_MODE_BITS) != ADC_BITS_STATS or not (chans & ADC_HEADER_CHANNELS_MASK):
+            continue
+        rec = struct.unpack("<IIIQHHHHII", data[4:40])
+        if window is not None and rec[0] != window:
+            # the rest of previous window was dropped
+            records = {}
+        window, freq = rec[0], (mode & ADC_MODE_FREQUENCY) >> 4
+        ch = "CH.{}".format(bits_to_indicies(chans & ADC_HEADER_CHANNELS_MASK)[0])
+        records[ch] = rec
+        if len(records) == len(stats_chans):
+            return freq, window, records
+
+
+def period_dt(freq, nchans):
+    # seconds between samples of the same channel
+    if freq == ADC_FREQUENCY_CUSTOM:
+        return float(use_period) / ADC_TIMER_CLOCK
+    dt = nchans / float(ADC_FREQUENCY[freq])
+    if nchans > 1 or freq == 1:  # two ADCs in use
+        dt *= 0.5
+    return dt
+
+
 last_seq = seq_offset = None
+rice_periods = 0
+partial, stream_offset = [], 0
+trig_event, trig_skip, trig_ts = None, 0, []
+seg_t0, first_trigger = 0.0, None
+gap, next_period, period_base, time_base, last_dt = None, 0, 0, 0.0, 0.0
+ts_event, ts_origin = None, None
+slow_packets, slow_xs, slow_vs = [], [], {}
+vref_scale = 1.0
+use_period = 0
+peak_k = 0
 def read_adc(dev):
-    global last_seq, seq_offset
-    try:
-        data = dev.read(EP_READ, 64, int(args.timeout*1000.0))
-    except usb.core.USBError as ex:
-        return [], {}
-    seq, chans, mode = struct.unpack("<BHB", data[:4])
+    global last_seq, seq_offset, rice_periods, partial, stream_offset
+    global trig_event, trig_skip, seg_t0, first_trigger
+    global gap, next_period, period_base, time_base, last_dt
+    global ts_event, ts_origin, slow_packets, vref_scale
+    while True:
+        try:
+            data = dev.read(EP_READ, 64, int(args.timeout*1000.0))
+        except usb.core.USBError as ex:
+            return [], {}
+        seq, chans, mode = struct.unpack("<BHB", data[:4])
+        if chans & ADC_HEADER_SLOW:  # goes right before packet its offset is counted from
+            slow_packets.append(data)
+            continue
+        if chans & ADC_HEADER_CHANNELS_MASK:
+            break
+        if mode == ADC_EVENT_TRIGGER:  # goes right before packet with trigger flag
+            trig_event = struct.unpack("<iIIH", data[4:18])
+            gap = None  # of the previous capture
+        elif mode == ADC_EVENT_GAP:  # goes right before the first packet after ring overflow
+            periods, packets = struct.unpack("<II", data[4:12])
+            gap = (gap[0] + periods, gap[1] + packets) if gap else (periods, packets)
+            ts_event = None  # it was for a dropped packet
+        elif mode == ADC_EVENT_TIMESTAMP:  # goes right before packet it describes
+            ts_event = struct.unpack("<III", data[4:16])
     seq_n = seq & 0x7f
-    if last_seq is None or (seq & 0x80):
+    restarted = last_seq is None or (seq & 0x80)
+    if restarted:
         last_seq = seq_offset = seq_n - 1
+        rice_periods = 0
+        # drop periods before exact capture start, see README
+        trig_position, trig_skip, timestamp, segment = trig_event if trig_event else (None, 0, 0, 0)
+        trig_event = None
+        next_period = 0  # a gap before the first packet counts from capture start
+        ts_origin = None
+    else:
+        trig_position = None
     new_seq = last_seq + (seq_n - last_seq + 0x80) % 0x80
-    if new_seq != last_seq + 1:
+    lost = (new_seq != last_seq + 1)
+    if gap:
+        print("(dropped {} chunk(s), {} period(s))".format(gap[1], gap[0]))
+    elif lost:
         print("(lost {} chunk(s)) [seq = 0x{:02x}, n = {}, offset = {}, last = {}, new = {}]".format(
             new_seq - 1 - last_seq, seq, seq_n, seq_offset, last_seq, new_seq))
     last_seq = new_seq
@@ -199,20 +562,115 @@ def read_adc(dev):
     
     bits = (mode & ADC_MODE_BITS)
     freq = (mode & ADC_MODE_FREQUENCY) >> 4
-    chans = bits_to_indicies(chans)
-    samples = unpack_data(data, bits)
-
+    offset = chans >> ADC_HEADER_OFFSET_SHIFT
+    chans = bits_to_indicies(chans & ADC_HEADER_CHANNELS_MASK)
+    samples = unpack_data(data, bits, len(chans) == 1 and freq == 1, len(chans))
+
+    if gap:
+        # periods are counted from the one being completed when gap started,
+        # at the rate of this packet
+        time_base += (next_period - trig_skip - period_base) * last_dt
+        period_base = next_period - trig_skip
+        resync = next_period + gap[0]
+    elif ts_event and ts_origin is not None:
+        # device period index doesn't wrap around as sequence number does
+        resync = ts_event[0] - ts_origin
+    else:
+        resync = None
+    if resync is not None:
+        if bits == ADC_BITS_RICE:
+            rice_periods = resync
+        else:
+            seq_offset = new_seq - 1
+            stream_offset = offset - resync * len(chans)
+    completed = 0  # period started in previous packet
+    if bits == ADC_BITS_RICE:  # variable number of whole periods per packet
+        first_period = rice_periods
+        rice_periods += len(samples) // len(chans)
+    else:
+        # sample periods may straddle packets: first `offset` samples complete
+        # the period started in previous packet, they are dropped if it is lost
+        first_sample = len(samples) * (new_seq - seq_offset - 1)
+        if restarted and resync is None:
+            stream_offset = offset
+        if not restarted and not lost and not gap and len(partial) == (len(chans) - offset) % len(chans):
+            first_sample -= len(partial)
+            samples = partial + samples
+            completed = 1 if partial else 0
+        else:
+            samples = samples[offset:]
+            first_sample += offset
+        complete = len(samples) // len(chans) * len(chans)
+        partial, samples = samples[complete:], samples[:complete]
+        first_period = (first_sample - stream_offset) // len(chans)
+    next_period = first_period + len(samples) // len(chans)
+    gap = None
+    if ts_event:
+        if ts_origin is None:
+            ts_origin = ts_event[0] - first_period - completed
+        ts_event = None
+    slow_base = first_period + completed
+
+    drop = min(max(trig_skip - first_period, 0), len(samples) // len(chans))
+    samples = samples[drop * len(chans):]
+    first_period += drop - trig_skip
     samples_per_chan = len(samples) // len(chans)
-    samples = samples[:samples_per_chan * len(chans)]
     
-    sample_period = 1.0 / float(ADC_FREQUENCY[freq])
-    if len(chans) > 1 or (len(chans) == 1 and freq == 1):  # two ADCs in use, double frequency
-        sample_period *= 0.5
-    dt = sample_period * len(chans)
-     
-    T_per_seq = samples_per_chan * dt
+    if freq == ADC_FREQUENCY_CUSTOM:  # device tells exact period of all channels
+        dt = float(use_period) / ADC_TIMER_CLOCK
+    else:
+        sample_period = 1.0 / float(ADC_FREQUENCY[freq])
+        if len(chans) > 1 or (len(chans) == 1 and freq == 1):  # two ADCs in use, double frequency
+            sample_period *= 0.5
+        dt = sample_period * len(chans)
+    if ADC_BITS_HI < bits <= ADC_BITS_HI + ADC_OVERSAMPLING_MAX:  # 4^k conversions per sample
+        dt *= float(1 << (2 * (bits - ADC_BITS_HI)))
+    elif bits == ADC_BITS_PEAK:  # k is not in header, PEAK register is read at start
+        dt *= float(1 << (2 * peak_k))
+    if trig_position is not None:
+        # segments (ADC_CMD_SEGMENTED) are placed by trigger timestamps
+        trig_t = dt * trig_position
+        if first_trigger is None:
+            first_trigger = (timestamp, trig_t)
+        else:
+            trig_t = first_trigger[1] + ((timestamp - first_trigger[0]) & 0xffffffff) * 1e-6
+        seg_t0 = trig_t - dt * trig_position
+        trig_ts.append(trig_t / args.timescale)
+        if segment > 0:
+            print("segment {}: trigger at T = {}".format(segment, trig_ts[-1]))
     
-    T0 = T_per_seq * (new_seq - seq_offset)
+    if restarted:
+        time_base, period_base = seg_t0, 0
+    if dt != last_dt:  # after SLOWDOWN gap periods are not device ones
+        ts_origin = None
+    last_dt = dt
+    
+    # slow offsets and divider are in conversion periods, 4^k per sample
+    conversions = float(1 << (2 * (bits - ADC_BITS_HI))) if ADC_BITS_HI < bits <= ADC_BITS_HI + ADC_OVERSAMPLING_MAX else 1.0
+    if bits == ADC_BITS_PEAK:
+        conversions = float(1 << (2 * peak_k))
+    for packet in slow_packets:
+        slow_offset, divider, periods, internal = struct.unpack("<iHBB", packet[4:12])
+        slow_chans = ["CH.{}".format(nch) for nch in
+            bits_to_indicies(struct.unpack("<H", packet[1:3])[0] & ADC_HEADER_CHANNELS_MASK)]
+        if internal & (ADC_SLOW_TEMPERATURE >> 10):
+            slow_chans.append("TEMP")
+        if internal & (ADC_SLOW_VREFINT >> 10):
+            slow_chans.append("VREFINT")
+        values = unpack_data(packet[12:12 + 2*periods*len(slow_chans)], ADC_BITS_RAW & ADC_MODE_BITS)
+        if "VREFINT" in slow_chans and periods > 0:
+            # ratiometric correction: the last reference sample tells real supply
+            vrefint = values[(periods - 1)*len(slow_chans) + slow_chans.index("VREFINT")]
+            vref_scale = ADC_VREFINT_V / vrefint if vrefint else 1.0
+        for j in range(periods):
+            period = slow_base - trig_skip + (slow_offset + j*divider) / conversions
+            slow_xs.append((time_base + dt * (period - period_base)) / args.timescale)
+            for i, ch in enumerate(slow_chans):
+                slow_vs.setdefault(ch, []).append(
+                    values[j*len(slow_chans) + i] * vref_scale / args.vscale)
+    slow_packets = []
+
+    T0 = time_base + dt * (first_period - period_base)
     ts = [
         (T0 + k*dt) / args.timescale
         for k in range(samples_per_chan)
@@ -221,8 +679,15 @@ def read_adc(dev):
 
     for i, nch in enumerate(chans):
         ch = "CH.{}".format(nch)
+        if bits == ADC_BITS_PEAK:  # envelope as two columns
+            for j, name in enumerate(("min", "max")):
+                vs["{} {}".format(ch, name)] = [
+                    samples[k*len(chans) + i][j] * vref_scale / args.vscale
+                    for k in range(samples_per_chan)
+                ]
+            continue
         vs[ch] = [
-            samples[k*len(chans) + i] / args.vscale
+            samples[k*len(chans) + i] * vref_scale / args.vscale
             for k in range(samples_per_chan)
         ]
     return ts, vs
@@ -239,29 +704,70 @@ if dev.is_kernel_driver_active(0):
 configure(dev, "cmd", ADC_CMD_INV["stop"])
 
 if args.trig_t_max is not None:
-    configure(dev, "trig_t_max", args.trig_t_max)
+    configure(dev, "trig_t_max", args.trig_t_max, stage=True)
 if args.trig_t_min is not None:
-    configure(dev, "trig_t_min", args.trig_t_min)
+    configure(dev, "trig_t_min", args.trig_t_min, stage=True)
 if args.trig_level is not None:
-    configure(dev, "trig_level", args.trig_level)
+    configure(dev, "trig_level", args.trig_level, stage=True)
 if args.trig_channel is not None:
-    configure(dev, "trig_channel", args.trig_channel)
+    configure(dev, "trig_channel", args.trig_channel, stage=True)
 if args.trig_offset is not None:
-    configure(dev, "trig_offset", args.trig_offset)
+    configure(dev, "trig_offset", args.trig_offset, stage=True)
+if args.trig_hysteresis is not None:
+    configure(dev, "trig_hysteresis", args.trig_hysteresis, stage=True)
 if args.trigger is not None:
-    configure(dev, "trigger", ADC_TRIGGER_INV[args.trigger])
+    configure(dev, "trigger", ADC_TRIGGER_INV[args.trigger], stage=True)
 if args.samples is not None:
-    configure(dev, "samples", args.samples)
+    configure(dev, "samples", args.samples, stage=True)
+if args.overflow is not None:
+    configure(dev, "overflow", ADC_OVERFLOW_INV[args.overflow], stage=True)
+if args.segments is not None:
+    configure(dev, "segments", args.segments, stage=True)
+if args.timestamps is not None:
+    configure(dev, "timestamps", args.timestamps, stage=True)
 if args.gain is not None:
-    configure(dev, "gain", args.gain)
+    configure(dev, "gain", args.gain, stage=True)
 if args.offset is not None:
-    configure(dev, "offset", args.offset)
+    configure(dev, "offset", args.offset, stage=True)
+if args.oversampling is not None:
+    configure(dev, "oversampling", args.oversampling, stage=True)
+if args.peak is not None:
+    configure(dev, "peak", args.peak, stage=True)
+if args.fft_bits is not None:
+    configure(dev, "fft_bits", args.fft_bits, stage=True)
+if args.fft_average is not None:
+    configure(dev, "fft_average", args.fft_average, stage=True)
+if args.stats_window is not None:
+    configure(dev, "stats_window", args.stats_window, stage=True)
 if args.frequency is not None:
-    configure(dev, "frequency", ADC_FREQUENCY_INV[args.frequency])
+    configure(dev, "frequency", ADC_FREQUENCY_INV[args.frequency], stage=True)
+if args.rate is not None:
+    configure(dev, "period", int(round(ADC_TIMER_CLOCK / args.rate)), stage=True)
+elif args.frequency is not None:
+    configure(dev, "period", 0, stage=True)
 if args.bits is not None:
-    configure(dev, "bits", args.bits)
+    configure(dev, "bits", args.bits, stage=True)
 if args.channels is not None:
-    configure(dev, "channels", indicies_to_bits(args.channels))
+    configure(dev, "channels", indicies_to_bits(args.channels), stage=True)
+if args.slow_channels is not None or args.temperature or args.vrefint:
+    configure(dev, "slow_channels", indicies_to_bits(args.slow_channels or []) |
+        (ADC_SLOW_TEMPERATURE if args.temperature else 0) |
+        (ADC_SLOW_VREFINT if args.vrefint else 0), stage=True)
+if args.slow_divider is not None:
+    configure(dev, "slow_divider", args.slow_divider, stage=True)
+
+commit(dev)
+
+if args.config_latency:
+    configure(dev, "cmd", ADC_CMD_INV[args.command])
+    config_latency(dev)
+    configure(dev, "cmd", ADC_CMD_INV["stop"])
+    sys.exit(0)
+
+if args.profile:
+    profile(dev, [args.bits] if args.bits is not None else [1, 2, 4, 8, 12, 16],
+            [args.channels] if args.channels else [range(n) for n in PROFILE_CHANNELS])
+    sys.exit(0)
 
 
 print("clearing buffer ...")
@@ -271,6 +777,86 @@ while True:
         break
 
 configure(dev, "cmd", ADC_CMD_INV[args.command])
+use_period = read_register(dev, "use_period")
+peak_k = min(read_register(dev, "peak"), ADC_PEAK_MAX)
+slow_packets, slow_xs, slow_vs = [], [], {}
+vref_scale = 1.0
+
+if args.command == "spectrum":
+    nchans = len(bits_to_indicies(read_register(dev, "use_channels")))
+    freq, bits, spectra = read_spectrum(dev, nchans)
+    configure(dev, "cmd", ADC_CMD_INV["stop"])
+    if not spectra:
+        raise Exception("No spectrum received")
+    print("{}-point blocks, {} cycles per transform".format(1 << bits, read_register(dev, "fft_cycles")))
+    # bins are 1 / (2^bits * period of all channels) apart
+    dt = period_dt(freq, nchans)
+    fs = [k / (dt * (1 << bits)) for k in range(1 << (bits - 1))]
+    chans = sorted(spectra.keys())
+    if args.plot:
+        from matplotlib import pyplot as plt
+        for ch in chans:
+            plt.semilogy(fs, [v if v else float('nan') for v in spectra[ch]], label=ch)
+        plt.legend(loc='upper right')
+        plt.xlabel('F [Hz]')
+        plt.ylabel('Amplitude [{:.03f} V]'.format(args.vscale))
+        plt.grid(True)
+        plt.show()
+    if not args.plot or args.output is not None:
+        out = sys.stdout if args.output is None else open(args.output, 'w')
+        out.write("\t".join(["F [Hz]"] + ["{} [{:.03f} V]".format(ch, args.vscale) for ch in chans]))
+        out.write('\n')
+        for k in range(len(fs)):
+            out.write("\t".join([str(fs[k])] + [str(spectra[ch][k]) for ch in chans]))
+            out.write('\n')
+        if out != sys.stdout:
+            out.close()
+    sys.exit(0)
+
+if args.command == "statistics":
+    stats_chans = ["CH.{}".format(i) for i in bits_to_indicies(read_register(dev, "use_channels"))]
+    scale = args.v_ref / float(0xfff) / args.vscale
+    ts, rows = [], []
+    while args.max_samples is None or len(rows) < args.max_samples:
+        freq, window, records = read_stats(dev)
+        if len(records) < len(stats_chans):
+            break
+        dt = period_dt(freq, len(stats_chans))
+        row = []
+        for ch in stats_chans:
+            _, periods, s, s2, lo, hi, level, crossings, first, last = records[ch]
+            hz = (crossings - 1) / ((last - first) * dt) if crossings > 1 and last > first else 0.0
+            row += [s * scale / periods, (s2 / float(periods)) ** 0.5 * scale,
+                    lo * scale, hi * scale, hz]
+        ts.append(window * periods * dt / args.timescale)
+        rows.append(row)
+    configure(dev, "cmd", ADC_CMD_INV["stop"])
+    if not rows:
+        raise Exception("No statistics received")
+    cols = ["{} {}".format(ch, q) for ch in stats_chans for q in ("mean", "rms", "min", "max", "F [Hz]")]
+    if args.plot:
+        from matplotlib import pyplot as plt
+        fig, (av, af) = plt.subplots(2, sharex=True)
+        for i, col in enumerate(cols):
+            (af if col.endswith("F [Hz]") else av).plot(ts, [r[i] for r in rows], label=col)
+        av.legend(loc='upper right')
+        av.set_ylabel('V [{:.03f} V]'.format(args.vscale))
+        av.grid(True)
+        af.legend(loc='upper right')
+        af.set_ylabel('F [Hz]')
+        af.set_xlabel('T [{:.03f} s]'.format(args.timescale))
+        af.grid(True)
+        plt.show()
+    if not args.plot or args.output is not None:
+        out = sys.stdout if args.output is None else open(args.output, 'w')
+        out.write("\t".join(["T [{:.03f} s]".format(args.timescale)] + cols))
+        out.write('\n')
+        for t, row in zip(ts, rows):
+            out.write("\t".join([str(t)] + [str(v) for v in row]))
+            out.write('\n')
+        if out != sys.stdout:
+            out.close()
+    sys.exit(0)
 
 print("waiting for trigger ...")
 while True:
@@ -279,6 +865,9 @@ while True:
         break
 
 
+if trig_ts:
+    print("trigger at T = {}".format(trig_ts[0]))
+
 while args.max_samples is None or len(xs) < args.max_samples:
     print("{} sample(s) read...\r".format(len(xs)), end='')
     new_xs, new_vs = read_adc(dev)
@@ -288,11 +877,26 @@ while args.max_samples is None or len(xs) < args.max_samples:
     for ch in new_vs.keys():
         vs[ch].extend(new_vs[ch])
 
+print("{} packet(s) per DMA interrupt, {} interrupts/s, packing takes {:.1f}% of CPU".format(
+    read_register(dev, "block_packets"), read_register(dev, "dma_irq_rate"),
+    read_register(dev, "pack_load") / 10.0))
+print("cycles per packet: direct {}, ring {} (0 - path not taken)".format(
+    read_register(dev, "direct_cycles"), read_register(dev, "ring_cycles")))
+
 if args.plot:
     from matplotlib import pyplot as plt
     fig, ax = plt.subplots()
     for ch, ys in sorted(vs.items()):
+        if ch.endswith(" max"):  # envelope is drawn with its min
+            continue
+        if ch.endswith(" min"):
+            plt.fill_between(xs, ys, vs[ch[:-4] + " max"], label=ch[:-4], alpha=0.5)
+            continue
         plt.plot(xs, ys, label=ch)
+    for ch, ys in sorted(slow_vs.items()):
+        plt.plot(slow_xs, ys, label=ch, marker='.')
+    for trig_t in trig_ts:
+        plt.axvline(trig_t, color='gray', linestyle=':')
     legend = ax.legend(loc='upper right', shadow=True, fontsize='x-large')
     legend.get_frame().set_facecolor('#00FFCC')
     plt.xlabel('T [{:.03f} s]'.format(args.timescale))
@@ -315,5 +919,16 @@ if not args.plot or args.output is not None:
         out.write("\t".join([str(v) for v in cols]))
         out.write('\n')
     
+    if slow_xs:  # separate table, slow channels have own time points
+        chans = sorted(slow_vs.keys())
+        out.write('\n')
+        out.write("\t".join(["T [{:.03f} s]".format(args.timescale)] + 
+            ["{} [{:.03f} V]".format(k, args.vscale) for k in chans]))
+        out.write('\n')
+        for i in range(len(slow_xs)):
+            cols = [slow_xs[i]] + [slow_vs[k][i] for k in chans]
+            out.write("\t".join([str(v) for v in cols]))
+            out.write('\n')
+    
     if out != sys.stdout:
         out.close()
@@ -25,7 +25,7 @@ DEV_DESCR = "0x{:04x}:0x{:04x}".format(ID_VENDOR, ID_PRODUCT)
 
 
 last_seq = None
-def read_adc(dev, timeout=1.5):
+def read_adc(dev, bits, timeout=1.5):
     global last_seq
     data = dev.read(EP_READ, 64, int(timeout*1000.0))
     bytes_recv = len(data)
@@ -62,40 +62,38 @@ if dev.is_kernel_driver_active(0):
 print("set_configuration()")
 dev.set_configuration()
 
-freq, bits, chans = 1, 8, 0b1
-if len(sys.argv) > 1:
-    freq = int(sys.argv[1])
-if len(sys.argv) > 2:
-    bits = int(sys.argv[2])
-if len(sys.argv) > 3:
-    chans = int(sys.argv[3], 2)
-
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 0, ADC_INDEX_CMD)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 0, ADC_INDEX_TRIGGER)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 5, ADC_INDEX_SAMPLES)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, chans & 0xff, ADC_INDEX_CHANNELS)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, chans >> 8, ADC_INDEX_CHANNELS+1)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, bits, ADC_INDEX_BITS)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, freq, ADC_INDEX_FREQUENCY)
-dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 2, ADC_INDEX_CMD)
-
-
-total_pkt = total_bytes = total_samples = total_intervals = total_lost = 0
-all_bytes = all_samples = all_intervals = 0
-t0 = time.time()
-while True:
-    nbytes, samples, intervals, lost = read_adc(dev)
-    total_pkt += 1
-    total_bytes += nbytes
-    total_samples += samples
-    total_intervals += intervals
-    total_lost += lost
-    all_bytes += nbytes * (lost + 1)
-    all_samples += samples * (lost + 1)
-    all_intervals += intervals * (lost + 1)
-    elapsed = time.time() - t0
-    if elapsed > 10.0:
-        break
+def configure(dev, freq, bits, chans):
+    global last_seq
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 0, ADC_INDEX_CMD)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 0, ADC_INDEX_TRIGGER)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 5, ADC_INDEX_SAMPLES)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, chans & 0xff, ADC_INDEX_CHANNELS)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, chans >> 8, ADC_INDEX_CHANNELS+1)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, bits, ADC_INDEX_BITS)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, freq, ADC_INDEX_FREQUENCY)
+    dev.ctrl_transfer(0x40, ADC_REQUEST_SETUP, 2, ADC_INDEX_CMD)
+    last_seq = None
+
+
+def measure(dev, bits, duration=10.0):
+    total_pkt = total_bytes = total_samples = total_intervals = total_lost = 0
+    all_bytes = all_samples = all_intervals = 0
+    t0 = time.time()
+    while True:
+        nbytes, samples, intervals, lost = read_adc(dev, bits)
+        total_pkt += 1
+        total_bytes += nbytes
+        total_samples += samples
+        total_intervals += intervals
+        total_lost += lost
+        all_bytes += nbytes * (lost + 1)
+        all_samples += samples * (lost + 1)
+        all_intervals += intervals * (lost + 1)
+        elapsed = time.time() - t0
+        if elapsed > duration:
+            break
+    return (elapsed, total_pkt, total_bytes, total_samples, total_intervals,
+            total_lost, all_bytes, all_samples, all_intervals)
 
 
 def report(prefix, cnt, dt, unit="", base=1000):
@@ -112,6 +110,31 @@ def report(prefix, cnt, dt, unit="", base=1000):
         prefix, cnt, dt, freq, funit))
 
 
+if len(sys.argv) > 1 and sys.argv[1] == "table":
+    # rows of "Examples of achievable sampling rates" table from README
+    print("Number of channels | Bits per sample | Rate - USB")
+    print("-------------------|-----------------|-----------")
+    for nchans in (1, 2, 4, 10):
+        for bits in (12, 8, 4, 2):
+            configure(dev, 1, bits, (1 << nchans) - 1)
+            elapsed, _, _, total_samples, _, _, _, _, _ = measure(dev, bits)
+            print("{:<19}|{:^17}| {:6.0f} kS/s".format(
+                nchans, bits, total_samples / elapsed / 1000.0))
+    sys.exit(0)
+
+freq, bits, chans = 1, 8, 0b1
+if len(sys.argv) > 1:
+    freq = int(sys.argv[1])
+if len(sys.argv) > 2:
+    bits = int(sys.argv[2])
+if len(sys.argv) > 3:
+    chans = int(sys.argv[3], 2)
+
+configure(dev, freq, bits, chans)
+
+(elapsed, total_pkt, total_bytes, total_samples, total_intervals,
+ total_lost, all_bytes, all_samples, all_intervals) = measure(dev, bits)
+
 report("Packets", total_pkt, elapsed, "p", 1000)
 report("Bytes", total_bytes, elapsed, "b", 1024)
 report("Bits", total_bytes*8, elapsed, "bit", 1024)
@@ -1,7 +1,9 @@
 #include <string.h>
 #include "adc.h"
 #include "console.h"
+#include "fft.h"
 #include "led.h"
+#include "timer.h"
 
 /* USB Standard Device Descriptor */
 const uint8_t ADC_DeviceDescriptor[] = {
@@ -58,7 +60,25 @@ const uint8_t ADC_ConfigDescriptor[] = {
     0x02,   /* bmAttributes: Bulk */
     ADC_PACKET_SIZE,      /* wMaxPacketSize: */
     0x00,
-    0x0
+    0x0,
+    /*Interface Descriptor, alternate setting with isochronous endpoint*/
+    0x09,   /* bLength: Interface Descriptor size */
+    USB_INTERFACE_DESCRIPTOR_TYPE,  /* bDescriptorType: Interface */
+    0x00,   /* bInterfaceNumber: Number of Interface */
+    ADC_ALT_SETTING_ISO,   /* bAlternateSetting: Alternate setting */
+    0x01,   /* bNumEndpoints: One endpoints used */
+    0xff,   /* bInterfaceClass: Vendor Specific */
+    0x01,   /* bInterfaceSubClass */
+    0x02,   /* bInterfaceProtocol */
+    0x00,   /* iInterface: */
+    /*Endpoint 1 Descriptor*/
+    0x07,   /* bLength: Endpoint Descriptor size */
+    USB_ENDPOINT_DESCRIPTOR_TYPE,   /* bDescriptorType: Endpoint */
+    0x81,   /* bEndpointAddress: EP 1 IN */
+    0x05,   /* bmAttributes: Isochronous, Asynchronous */
+    (ADC_ISO_FRAME_SIZE & 0xFF),    /* wMaxPacketSize: */
+    (ADC_ISO_FRAME_SIZE >> 8),
+    0x01    /* bInterval: every frame */
 };
 ONE_DESCRIPTOR Config_Descriptor = {
     (uint8_t*)ADC_ConfigDescriptor,
@@ -77,6 +97,7 @@ static void adc_status_out(void);
 static RESULT adc_data_setup(uint8_t RequestNo);
 static RESULT adc_nodata_setup(uint8_t RequestNo);
 static RESULT adc_get_interface_setting(uint8_t Interface, uint8_t AlternateSetting);
+static void adc_set_interface(void);
 static uint8_t *adc_get_device_descriptor(uint16_t Length);
 static uint8_t *adc_get_config_descriptor(uint16_t Length);
 static uint8_t *adc_get_string_descriptor(uint16_t Length);
@@ -110,12 +131,44 @@ USER_STANDARD_REQUESTS User_Standard_Requests = {
 uint32_t adc_tx_total = 0;
 uint32_t adc_rx_total = 0;
 volatile int usb_tx_in_progress = 0;
+static int iso_mode = 0;
+static uint8_t iso_frame_packets[2] = {0, 0};
 
 typedef uint8_t USBPacket[ADC_PACKET_SIZE];
 
-static USBPacket usb_packets[ADC_SAMPLES_COUNT];
+/* Ring of packets with one producer and one consumer. Producer (packing
+ * in PendSV, or raw DMA interrupt) fills usb_packets[usb_last_packet] and
+ * publishes it by moving usb_last_packet, then calls kick_transmission().
+ * Only USB interrupt sends packets, moves usb_first_packet forward and
+ * counts usb_tx_in_progress. While packets are sent, send_direct() is
+ * the only producer-side writer of these two: with ring empty and USB
+ * interrupt masked, it sends a packet that skips the ring. Producer sets
+ * usb_first_packet only while nothing is sent (trigger rewind, segments),
+ * and DROP_OLDEST keeps the packet at it. Before trigger, ring_packets
+ * back from usb_last_packet is the pretrigger window; one slot is kept
+ * free to tell full from empty.
+ */
+static USBPacket usb_packets[ADC_SAMPLES_COUNT] __attribute__((aligned(4)));
 static volatile int usb_first_packet = 0;
 static volatile int usb_last_packet = 0;
+static int ring_start = 0;  /* bounds of ring in usb_packets[], it is a segment in SEGMENTED mode */
+static int ring_end = ADC_SAMPLES_COUNT;
+static int ring_packets = 0;  /* filled packets before usb_last_packet, since ring start */
+
+/* SEGMENTED mode: each trigger fills one segment of usb_packets[],
+ * they are sent after the last one is filled; spare packet at the end
+ * of usb_packets[] takes samples while segments are being sent
+ */
+static int segments = 0;
+static int segment = 0;  /* being filled, `segments` when all are filled */
+static int segment_packets = 0;
+#define SPARE_PACKET (ADC_SAMPLES_COUNT - 1)
+static int drain_segment = 0;  /* being sent */
+static int drain_packets = 0;  /* left in it */
+static struct {
+    uint16_t first;
+    ADCTriggerEvent event;
+} segment_info[ADC_SEGMENTS_MAX];
 
 static ADCRegs regs = {
     .cmd            = ADC_DEFAULT_COMMAND,
@@ -130,15 +183,113 @@ static ADCRegs regs = {
     .trig_level     = 0x7ff,
     .trig_offset    = 0,
     .trig_t_min     = 0,
-    .trig_t_max     = 0
+    .trig_t_max     = 0,
+    .oversampling   = 0,
+    .trig_hysteresis= 0,
+    .segments       = 0,
+    .overflow       = ADC_OVERFLOW_DROP_NEWEST,
+    .overflows      = 0,
+    .dropped_packets= 0,
+    .timestamps     = 0,
+    .update_usec    = 0,
+    .update_kind    = ADC_UPDATE_RESTART,
+    .period         = 0,
+    .use_period     = 0,
+    .slow_channels  = 0,
+    .slow_divider   = 0,
+    .vdda_mv        = 0,
+    .peak           = 0,
+    .fft_bits       = FFT_BITS_MAX,
+    .fft_average    = 1,
+    .fft_cycles     = 0,
+    .stats_window   = 0x10000,
+    .block_packets  = 0,
+    .dma_irq_rate   = 0,
+    .pack_load      = 0,
+    .direct_cycles  = 0,
+    .ring_cycles    = 0
 };
+static ADCRegs regs_staged;  /* host writes land here, copied to `regs` on commit */
+static int regs_write_pending = 0;  /* ADC_REQUEST_WRITE_REGS data stage is in progress */
+static int regs_write_commit = 0;
+static int regs_staged_kind = 0;  /* ADC_UPDATE_* needed to apply staged writes, 0 - none */
 static uint8_t reg_requested_value[2] = {0x00, 0x00};
 
 static ADCPacketHeader header;
 static int nchannels = 0;
 static int samples_per_packet = 0;
 static int samples_in_reversed_order = 0;
+static int raw_mode = 0;
+static int rice_mode = 0;
+static int oversampling = 0;
+static int peak_mode = 0;  /* `oversampling` periods give min/max pair instead of sum */
+static int dummy_mode = 0;  /* odd channels in dual mode, ADC2 ends each period with dummy conversion */
+static int dma_block_samples = 0;  /* samples in each half of DMA buffer */
+static int block_samples = 0;  /* the same without dummy samples */
+static int block_phase = 0;  /* channel slot of the first sample of next block */
+static int sample_bits = 0;
+static uint32_t packet_first_sample = 0;  /* `adc_rx_total` at the first sample of packet at usb_last_packet */
+static uint32_t packet_period = 0;  /* index of period holding the same sample, from acquisition start */
+static uint32_t block_usec = 0;  /* timer_usec() at the DMA interrupt of block being packed */
+
+/* DMA interrupt only queues completed half of adcdma_rx_buf[] and pends
+ * PendSV, which packs it below USB priority (except raw mode, which
+ * re-arms DMA and doesn't pack); queue has one producer and one consumer,
+ * each index is written by one side only. Only the newest queued half is
+ * intact: DMA refills the one before it, so PendSV drops older entries
+ * as a gap.
+ */
+#define BLOCK_QUEUE_SIZE    2  /* one entry per half */
+typedef struct {
+    uint16_t offset;  /* of half in adcdma_rx_buf[] */
+    uint32_t usec;  /* timer_usec() at DMA interrupt */
+} DMABlock;
+static DMABlock block_queue[BLOCK_QUEUE_SIZE];
+/* free-running, 8-bit ones would wrap while PendSV is held off for 256 halves */
+static volatile uint32_t block_queue_head = 0;  /* written by DMA interrupt */
+static volatile uint32_t block_queue_tail = 0;  /* written by PendSV, before block is packed */
+uint32_t adc_block_overruns = 0;  /* halves overwritten by DMA before they were packed */
+static int resync_samples = 0;  /* skipped at the start of next blocks after a drop */
+
+/* Plain packing takes several packets per DMA block at high rates, so
+ * interrupt costs less per sample; a block is no longer than USB frame
+ */
+#define DMA_BLOCK_USEC_MAX  1000
+static int block_packets = 1;
+
+/* DMA_IRQ_RATE and PACK_LOAD are published once a second; PACK_LOAD is
+ * packing only (PendSV, or DMA interrupt in raw mode), not all interrupt
+ * time, USB interrupt and the rest of ADC interrupts are not in it
+ */
+static volatile uint32_t dma_irqs = 0;  /* free-running */
+static uint32_t load_dma_irqs = 0;  /* dma_irqs at the start of second */
+static uint32_t load_cycles = 0;  /* spent packing since then */
+static uint32_t load_usec = 0;  /* timer_usec() at the start of second */
+
+/* DIRECT_CYCLES and RING_CYCLES are published with them: cycles and
+ * packets of each path since the start of second, ring path is packing
+ * in PendSV plus copy to PMA in USB interrupt
+ */
+static uint32_t direct_cycles = 0, direct_packets = 0;
+static uint32_t ring_pack_cycles = 0, ring_pack_packets = 0;
+static volatile uint32_t ring_copy_cycles = 0, ring_copy_packets = 0;  /* USB interrupt */
+
+/* update_mode() and commit_regs() requested in USB interrupt run in
+ * PendSV too, so packing never sees them halfway
+ */
+static volatile int restart_pending = 0;
+static volatile int commit_pending = 0;
+static int timestamp_countdown = 0;  /* data packets before the next timestamp event */
+static int timer_period_scale = 0;  /* TIM1 period is this times frequency_period_us[], 0 if ADC runs continuously */
+static uint32_t adc_sample_time_set = 0;  /* ADC_SampleTime_* of regular channels */
+static uint8_t retime_mode = 0;  /* header.mode from packet starting at retime_sample on, 0 - none */
+static uint32_t retime_sample = 0;  /* the first one at new FREQUENCY or PERIOD */
+static uint16_t dma_transfers = 0;  /* size of circular DMA buffer */
+static int dma_transfer_samples = 0;  /* samples (conversions) per DMA transfer */
+static uint16_t raw_dma_transfers = 0;
 static int trigger_chan_index = -1;
+static uint8_t period_channels[ADC_TOTAL_CHANNELS];  /* channel of each sample of period */
+static uint8_t adc_calibrated = 0;  /* bit per ADC, it keeps calibration until reset */
 static uint32_t samples_per_trigger = 0;
 
 volatile int is_triggered = 0;
@@ -147,28 +298,201 @@ static int trig_wait = 1;
 static int trig_event = 0;
 static int trig_strobe_started = 0;
 static uint32_t trig_holded = 0;
-static uint32_t trig_rx_cnt0 = 0;
 static uint32_t trig_tx_cnt0 = 0;
+static int trig_armed = 0;
+static uint32_t trig_sample = 0;  /* `adc_rx_total` at the trigger sample */
+static uint32_t trig_start = 0;  /* the same at the first sample of capture */
+static uint32_t trig_timestamp = 0;
+static volatile int trig_event_pending = 0;
+static USBPacket trig_event_packet __attribute__((aligned(4)));
+
+/* Slow channel group: injected sequences of ADC1 (and of ADC2 in dual
+ * mode) are triggered by TIM1 update, which comes every `slow_divider`
+ * periods thanks to repetition counter; results are collected into
+ * `slow_packet` and put into ring between data packets
+ */
+#define SLOW_SAMPLES    ((ADC_SAMPLE_SIZE - sizeof(ADCSlowHeader)) / 2)
+static int slow_nchannels = 0;  /* 0 if there is no slow group */
+static int slow_internal = 0;  /* temperature and Vrefint, they go last */
+static int slow_vrefint = -1;  /* index of Vrefint in slow period */
+static int slow_dual = 0;  /* ADC2 converts odd external ones */
+static uint8_t slow_ranks[ADC_SLOW_CHANNELS_MAX];  /* injected rank of each channel */
+#define SLOW_RANK_ADC2  0x80
+static uint16_t slow_divider = 0;
+static int slow_packet_periods = 0;
+static uint32_t slow_next_period = 0;  /* TIM1 period of the next injected conversion, from acquisition start */
+static volatile int slow_pending = 0;  /* slow_packet is complete, waiting for a slot */
+static USBPacket slow_packet __attribute__((aligned(4)));
+
+/* SPECTRUM: blocks of 2^fft_bits sample periods are captured at full
+ * rate into the head of usb_packets[], the ring is the rest of it.
+ * Conversions are dropped while channels are transformed, one per DMA
+ * interrupt; magnitudes summed over `fft_average` blocks are sent.
+ */
+#define SPECTRUM_BINS   ((ADC_SAMPLE_SIZE - sizeof(ADCSpectrumHeader)) / 2)
+static int fft_bits = 0;  /* 0 if spectrum is off */
+static int fft_average = 1;
+static int fft_channel = 0;  /* to be transformed, nchannels while capturing */
+static int fft_synced = 0;  /* capture of block started with a period */
+static int fft_fill = 0;  /* sample periods captured */
+static int fft_blocks = 0;  /* summed up in fft_acc */
+static uint32_t *fft_acc;  /* 2^(fft_bits-1) bins of each channel */
+static int16_t *fft_buf;  /* 2^fft_bits samples of each channel */
+
+/* STATISTICS: sums and crossings of each channel are accumulated over
+ * `stats_window` sample periods, in the head of usb_packets[] as for
+ * SPECTRUM; a record of each channel goes to the ring after each window
+ */
+struct stats_acc {
+    uint32_t sum;
+    uint64_t sum_squares;
+    uint16_t min, max;
+    uint16_t level, crossings;
+    uint32_t first_crossing, last_crossing;
+    int armed;  /* was below level - TRIG_HYSTERESIS */
+};
+static int stats_mode = 0;
+static uint32_t stats_window = 0;
+static uint32_t stats_index = 0;  /* of window */
+static uint32_t stats_period = 0;  /* in window */
+static struct stats_acc *stats;
+
+static void stats_reset(struct stats_acc *acc) {
+    acc->sum = 0;
+    acc->sum_squares = 0;
+    acc->min = 0xffff;
+    acc->max = 0;
+    acc->crossings = 0;
+    acc->first_crossing = acc->last_crossing = 0;
+    acc->armed = 0;
+}
+
+#define TRIG_ARMED_LO   1  /* level was below TRIG_LEVEL - TRIG_HYSTERESIS */
+#define TRIG_ARMED_HI   2  /* level was above TRIG_LEVEL + TRIG_HYSTERESIS */
 
 /* we need double buffer:
  *     - one half is filling with ADC values via DMA
  *     - other half is being processed for transfering via USB
  * also for 2-bit mode we need 4 samples per 1 byte
  */
-static uint16_t adcdma_rx_buf[ADC_SAMPLE_SIZE * 2 * 4];
+static uint16_t adcdma_rx_buf[ADC_SAMPLE_SIZE * 2 * 4] __attribute__((aligned(4)));
+
+/* TIM1 period (microseconds) of one conversion, by FREQUENCY */
+static const uint16_t frequency_period_us[ADC_FREQUENCY_1KHZ + 1] = {
+    1, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000
+};
+
+#define ADC_CYCLE_TICKS         6  /* ADCCLK is PCLK2 / 6, see hw_config.c */
+#define ADC_CONVERSION_MIN_TICKS (14 * ADC_CYCLE_TICKS)
+#define ADC_INTERNAL_CONVERSION_TICKS (252 * ADC_CYCLE_TICKS)  /* temperature sensor needs 17.1 us sampling */
+
+/* Longest sampling time first, conversion takes 12.5 more ADC cycles */
+static const struct {
+    uint8_t sample_time;
+    uint16_t cycles;
+} adc_conversion_cycles[] = {
+    { ADC_SampleTime_239Cycles5,  252 },
+    { ADC_SampleTime_71Cycles5,    84 },
+    { ADC_SampleTime_55Cycles5,    68 },
+    { ADC_SampleTime_41Cycles5,    54 },
+    { ADC_SampleTime_28Cycles5,    41 },
+    { ADC_SampleTime_13Cycles5,    26 },
+    { ADC_SampleTime_7Cycles5,     20 },
+    { ADC_SampleTime_1Cycles5,     14 },
+};
+
+/* Ring overflow: packets are dropped at usb_last_packet (or next to
+ * usb_first_packet for DROP_OLDEST) and a gap event is put into the ring
+ * in place of the last dropped one, so host can count missing periods.
+ */
+#define OVERFLOW_RESUME_PACKETS (ADC_SAMPLES_COUNT / 8)  /* free packets to end the gap */
+static int gap_active = 0;  /* packet at usb_last_packet is being dropped */
+static int gap_event_slot = -1;  /* gap event is to be written here */
+static uint32_t gap_first_sample = 0;  /* `adc_rx_total` at the first dropped sample */
+static uint32_t gap_next_sample = 0;  /* the same at the first sample after gap */
+static int gap_phase = 0;  /* channel slot of the first dropped sample */
+static int32_t gap_periods = 0;  /* correction to periods counted from samples */
+static uint32_t gap_packets = 0;
+static uint32_t gap_split_sample = 0;  /* SLOWDOWN: samples before it are at the old rate */
+static uint32_t gap_split_end = 0;  /* SLOWDOWN: samples from it on are at the new rate */
+static uint32_t gap_old_period = 0;  /* SLOWDOWN: TIM1 periods before and after the gap, */
+static uint32_t gap_new_period = 0;  /* old one is 0 if unchanged */
+static int32_t slowdown_residue = 0;  /* TIM1 ticks lost rounding to new periods */
+static int paused = 0;  /* PAUSE: TIM1 is stopped */
+static uint32_t pause_usec = 0;
+
+/* AWD_HI/AWD_LO triggers: analog watchdog of the ADC converting trigger
+ * channel interrupts at the first conversion beyond TRIG_LEVEL, only
+ * then check_trigger() looks for it in samples; watchdog interrupt is
+ * one-shot, so level staying beyond doesn't flood CPU
+ */
+#define AWD_MISSED_BLOCKS   2  /* blocks looked through after interrupt, it may come late */
+static uint8_t awd_adcs = 0;  /* bit per ADC watching trigger channel */
+static volatile int trig_awd_hit = 0;  /* blocks looked through since interrupt + 1, 0 - none */
+
+static inline int awd_trigger(void) {
+    return regs.trigger == ADC_TRIGGER_AWD_HI || regs.trigger == ADC_TRIGGER_AWD_LO;
+}
+
+static void awd_arm(int enable) {
+    trig_awd_hit = 0;
+    if (awd_adcs & (1 << 0)) {
+        ADC_ClearITPendingBit(ADC1, ADC_IT_AWD);
+        ADC_ITConfig(ADC1, ADC_IT_AWD, enable ? ENABLE : DISABLE);
+    }
+    if (awd_adcs & (1 << 1)) {
+        ADC_ClearITPendingBit(ADC2, ADC_IT_AWD);
+        ADC_ITConfig(ADC2, ADC_IT_AWD, enable ? ENABLE : DISABLE);
+    }
+}
+
+/* Selects watchdog(s) for trigger channel, `trigger_chan_index` is set */
+static void awd_setup(void) {
+    uint16_t hi = (regs.trigger == ADC_TRIGGER_AWD_HI) ? regs.trig_level : 0xfff;
+    uint16_t lo = (regs.trigger == ADC_TRIGGER_AWD_HI) ? 0 : regs.trig_level;
+    
+    ADC_ITConfig(ADC1, ADC_IT_AWD, DISABLE);
+    ADC_ITConfig(ADC2, ADC_IT_AWD, DISABLE);
+    ADC_AnalogWatchdogCmd(ADC1, ADC_AnalogWatchdog_None);
+    ADC_AnalogWatchdogCmd(ADC2, ADC_AnalogWatchdog_None);
+    awd_adcs = 0;
+    trig_awd_hit = 0;
+    if (!awd_trigger() || trigger_chan_index < 0)
+        return;
+    if (samples_in_reversed_order) /* fast interleaved mode, both convert it */
+        awd_adcs = (1 << 0) | (1 << 1);
+    else if (nchannels > 1)
+        awd_adcs = (trigger_chan_index & 1) ? (1 << 1) : (1 << 0);
+    else
+        awd_adcs = (1 << 0);
+    if (awd_adcs & (1 << 0)) {
+        ADC_AnalogWatchdogThresholdsConfig(ADC1, hi, lo);
+        ADC_AnalogWatchdogSingleChannelConfig(ADC1, period_channels[trigger_chan_index]);
+        ADC_AnalogWatchdogCmd(ADC1, ADC_AnalogWatchdog_SingleRegEnable);
+    }
+    if (awd_adcs & (1 << 1)) {
+        ADC_AnalogWatchdogThresholdsConfig(ADC2, hi, lo);
+        ADC_AnalogWatchdogSingleChannelConfig(ADC2, period_channels[trigger_chan_index]);
+        ADC_AnalogWatchdogCmd(ADC2, ADC_AnalogWatchdog_SingleRegEnable);
+    }
+    awd_arm(trig_wait && !trig_event);
+}
 
 static void trigger_reset(int restart) {
     is_triggered = 0;
     trig_event = 0;
-    trig_rx_cnt0 = 0;
     trig_tx_cnt0 = 0;
     trig_strobe_started = 0;
     trig_holded = 0;
+    trig_armed = 0;
+    trig_event_pending = 0;
+    timestamp_countdown = 1;
     switch (regs.cmd) {
     case ADC_CMD_STOP:
         trig_wait = 0;
         break;
     case ADC_CMD_ONCE:
+    case ADC_CMD_SEGMENTED:
         trig_wait = restart;
         break;
     default:
@@ -176,69 +500,165 @@ static void trigger_reset(int restart) {
         trig_wait = 1;
         break;
     }
+    if (awd_adcs)
+        awd_arm(trig_wait);
+}
+
+static inline int ring_next(int id) {
+    return (id + 1 == ring_end) ? ring_start : id + 1;
+}
+
+static inline int ring_prev(int id) {
+    return (id == ring_start) ? ring_end - 1 : id - 1;
+}
+
+static inline int packet_is_event(const uint8_t *packet) {
+    uint16_t channels = ((const ADCPacketHeader*)packet)->channels;
+    return !(channels & ADC_HEADER_CHANNELS_MASK) || (channels & ADC_HEADER_SLOW); /* no data samples */
+}
+
+static inline int packet_is_gap(const uint8_t *packet) {
+    return packet_is_event(packet) && ((const ADCPacketHeader*)packet)->mode == ADC_EVENT_GAP;
+}
+
+static inline int packet_samples(const uint8_t *packet) {
+    if (packet_is_event(packet))
+        return 0;
+    if (rice_mode)
+        return packet[sizeof(ADCPacketHeader)] * nchannels;
+    return samples_per_packet;
+}
+
+/* number of samples at the start of body that complete previous period */
+static inline int packet_offset(const uint8_t *packet) {
+    return ((const ADCPacketHeader*)packet)->channels >> ADC_HEADER_OFFSET_SHIFT;
+}
+
+/* channel slot of the first sample in body */
+static inline int packet_phase(const uint8_t *packet) {
+    int offset = packet_offset(packet);
+    return offset ? nchannels - offset : 0;
 }
 
 static void set_first_packet(int id) {
-    ADCPacketHeader * hdr;
-    if (id < 0)
-        id = 0;
-    else
-        id = id % ADC_SAMPLES_COUNT;
-    hdr = (ADCPacketHeader*)usb_packets[id];
+    ADCPacketHeader * hdr = (ADCPacketHeader*)usb_packets[id];
     hdr->sequence |= 0x80;
     usb_first_packet = id;
 }
 
-static int check_trigger(uint16_t *levels) {
+/* Flags the packet that holds the first sample period of capture
+ * (`trig_start`), walking back through the ring for negative TRIG_OFFSET,
+ * and prepares trigger event to be sent right before it.
+ * Positions are in `adc_rx_total` units, i.e. ADC samples; packets carry
+ * 4^OVERSAMPLING times less samples in oversampling mode.
+ */
+static void mark_capture_start(void) {
+    int shift = 2 * oversampling;
+    int id = usb_last_packet;
+    uint32_t first = packet_first_sample + (packet_offset(usb_packets[id]) << shift);
+    int32_t periods;
+    int n;
+    ADCPacketHeader *hdr;
+    ADCTriggerEvent *event;
+    
+    for (n = 0; n < ring_packets && n < ring_end - ring_start - 2 &&
+                (int32_t)(first - trig_start) > 0; n++) {
+        int prev = ring_prev(id);
+        if (packet_is_event(usb_packets[prev])) /* samples are missing before it */
+            break;
+        first -= (packet_offset(usb_packets[id]) + packet_samples(usb_packets[prev]) - packet_offset(usb_packets[prev])) << shift;
+        id = prev;
+    }
+    set_first_packet(id);
+    
+    hdr = (ADCPacketHeader*)trig_event_packet;
+    hdr->sequence = ((ADCPacketHeader*)usb_packets[id])->sequence;
+    hdr->channels = 0;
+    hdr->mode = ADC_EVENT_TRIGGER;
+    event = (ADCTriggerEvent*)(trig_event_packet + sizeof(ADCPacketHeader));
+    periods = ((int32_t)(trig_start - first) / nchannels) >> shift;
+    event->skip = (periods > 0) ? periods : 0;
+    periods = (int32_t)(trig_sample - trigger_chan_index - first) / nchannels;
+    event->position = (periods >> shift) - (int32_t)event->skip;
+    event->timestamp = trig_timestamp;
+    event->segment = segment;
+    trig_event_pending = 1;
+}
+
+/* `phase` is channel slot of levels[0], periods may straddle blocks;
+ * levels[0] is sample number `adc_rx_total - nsamples`
+ */
+static int check_trigger(uint16_t *levels, int nsamples, int phase) {
     int i;
+    int swap = samples_in_reversed_order;
+    int first = trigger_chan_index - phase;
+    int lo = (int)regs.trig_level - (int)regs.trig_hysteresis;
+    int hi = (int)regs.trig_level + (int)regs.trig_hysteresis;
+    int above = (regs.trigger == ADC_TRIGGER_AWD_HI);
+    uint32_t block_start = adc_rx_total - nsamples;
     uint16_t prev_level;
     
+    if (first < 0)
+        first += nchannels;
+    
     if (!trig_event) {
         if (!trig_wait)
             return 0;
         
-        prev_level = levels[trigger_chan_index];
+        prev_level = levels[first ^ swap];
+        i = first;
         
+        /* level must leave hysteresis band before crossing TRIG_LEVEL */
         switch (regs.trigger) {
         default:
         case ADC_TRIGGER_NONE:
             trig_event = 1;
             break;
         case ADC_TRIGGER_RISING:
-            for (i = trigger_chan_index + nchannels; i < samples_per_packet; i += nchannels) {
-                if (prev_level < regs.trig_level && levels[i] > regs.trig_level) {
+            for (i = first; i < nsamples; i += nchannels) {
+                if (levels[i ^ swap] < lo) {
+                    trig_armed = TRIG_ARMED_LO;
+                }
+                else if (trig_armed && levels[i ^ swap] > regs.trig_level) {
                     trig_event = 1;
                     break;
                 }
-                prev_level = levels[i];
             }
             break;
         case ADC_TRIGGER_FALLING:
-            for (i = trigger_chan_index + nchannels; i < samples_per_packet; i += nchannels) {
-                if (prev_level > regs.trig_level && levels[i] < regs.trig_level) {
+            for (i = first; i < nsamples; i += nchannels) {
+                if (levels[i ^ swap] > hi) {
+                    trig_armed = TRIG_ARMED_HI;
+                }
+                else if (trig_armed && levels[i ^ swap] < regs.trig_level) {
                     trig_event = 1;
                     break;
                 }
-                prev_level = levels[i];
             }
             break;
         case ADC_TRIGGER_THRESHOLD:
-            for (i = trigger_chan_index + nchannels; i < samples_per_packet; i += nchannels) {
-                if ((prev_level < regs.trig_level && levels[i] > regs.trig_level) ||
-                    (prev_level > regs.trig_level && levels[i] < regs.trig_level)) {
+            /* crossing is checked first, a step over the whole band is one */
+            for (i = first; i < nsamples; i += nchannels) {
+                if ((trig_armed == TRIG_ARMED_LO && levels[i ^ swap] > regs.trig_level) ||
+                    (trig_armed == TRIG_ARMED_HI && levels[i ^ swap] < regs.trig_level)) {
                     trig_event = 1;
                     break;
                 }
-                prev_level = levels[i];
+                if (levels[i ^ swap] < lo) {
+                    trig_armed = TRIG_ARMED_LO;
+                }
+                else if (levels[i ^ swap] > hi) {
+                    trig_armed = TRIG_ARMED_HI;
+                }
             }
             break;
         case ADC_TRIGGER_STROBE_LO:
-            for (i = trigger_chan_index; i < samples_per_packet; i += nchannels) {
-                if (!trig_strobe_started && prev_level > regs.trig_level && levels[i] < regs.trig_level) {
+            for (i = first; i < nsamples; i += nchannels) {
+                if (!trig_strobe_started && prev_level > regs.trig_level && levels[i ^ swap] < regs.trig_level) {
                     trig_strobe_started = 1;
                     trig_holded = 0;
                 }
-                else if (trig_strobe_started && levels[i] < regs.trig_level) {
+                else if (trig_strobe_started && levels[i ^ swap] < regs.trig_level) {
                     trig_holded++;
                 }
                 else if (trig_strobe_started && regs.trig_t_min <= trig_holded &&
@@ -249,16 +669,16 @@ static int check_trigger(uint16_t *levels) {
                 else {
                     trig_strobe_started = 0;
                 }
-                prev_level = levels[i];
+                prev_level = levels[i ^ swap];
             }
             break;
         case ADC_TRIGGER_STROBE_HI:
-            for (i = trigger_chan_index; i < samples_per_packet; i += nchannels) {
-                if (!trig_strobe_started && prev_level < regs.trig_level && levels[i] > regs.trig_level) {
+            for (i = first; i < nsamples; i += nchannels) {
+                if (!trig_strobe_started && prev_level < regs.trig_level && levels[i ^ swap] > regs.trig_level) {
                     trig_strobe_started = 1;
                     trig_holded = 0;
                 }
-                else if (trig_strobe_started && levels[i] > regs.trig_level) {
+                else if (trig_strobe_started && levels[i ^ swap] > regs.trig_level) {
                     trig_holded++;
                 }
                 else if (trig_strobe_started && regs.trig_t_min <= trig_holded &&
@@ -269,34 +689,48 @@ static int check_trigger(uint16_t *levels) {
                 else {
                     trig_strobe_started = 0;
                 }
-                prev_level = levels[i];
+                prev_level = levels[i ^ swap];
+            }
+            break;
+        case ADC_TRIGGER_AWD_HI:
+        case ADC_TRIGGER_AWD_LO:
+            if (!trig_awd_hit)
+                return 0;
+            for (i = first; i < nsamples; i += nchannels) {
+                if (above ? levels[i ^ swap] > regs.trig_level : levels[i ^ swap] < regs.trig_level) {
+                    trig_event = 1;
+                    break;
+                }
             }
+            /* interrupt may come before DMA one of the block with that
+             * sample or after it; short spike at block end is missed then
+             */
+            if (!trig_event && ++trig_awd_hit > AWD_MISSED_BLOCKS)
+                awd_arm(1);
             break;
         }
         
         if (trig_event) {
             int32_t trigger_offset_signed = (int32_t)regs.trig_offset;
-            int offset = (trigger_offset_signed < 0 ? -trigger_offset_signed : 0);
-            int periods_per_packet = samples_per_packet / nchannels;
-            int packets_offset = offset / periods_per_packet;
-            set_first_packet(usb_last_packet - packets_offset + ADC_SAMPLES_COUNT);
-            trig_rx_cnt0 = adc_rx_total;
+            trig_armed = 0;
+            trig_sample = block_start + i;
+            trig_timestamp = block_usec;
+            trig_start = trig_sample - trigger_chan_index + trigger_offset_signed * nchannels;
             trig_tx_cnt0 = 0;
-            if (!usb_tx_in_progress) {
-                
-            }
+            mark_capture_start();
         }
     }
     
     if (trig_event) {
-        int32_t trigger_offset_signed = (int32_t)regs.trig_offset;
-        int offset = (trigger_offset_signed > 0 ? +trigger_offset_signed : 0);
         uint32_t samples_sent;
-        uint32_t samples_received = adc_rx_total - trig_rx_cnt0;
-        if (samples_received < offset * nchannels) {
-            set_first_packet(usb_last_packet);
-            return 0;
+        if ((int32_t)(trig_start - block_start) >= 0) {
+            /* capture starts in this block or later, flag moves with it */
+            mark_capture_start();
+            if ((int32_t)(trig_start - block_start) >= nsamples)
+                return 0;
         }
+        if (segments) /* capture ends when segment is full */
+            return 1;
         if (trig_tx_cnt0 == 0)
             trig_tx_cnt0 = adc_tx_total;
         samples_sent = adc_tx_total - trig_tx_cnt0;
@@ -310,19 +744,62 @@ static int check_trigger(uint16_t *levels) {
     return 0;
 }
 
+/* How much of acquisition is to be redone when register at `index` is written */
+static int reg_update_kind(int index) {
+    if (index >= ADC_INDEX_TRIGGER && index < ADC_INDEX_USE_CHANNELS)
+        return ADC_UPDATE_TRIGGER;
+    switch (index) {
+    case ADC_INDEX_TRIG_HYSTERESIS:
+    case ADC_INDEX_TRIG_HYSTERESIS + 1:
+    case ADC_INDEX_TIMESTAMPS:
+        return ADC_UPDATE_TRIGGER;
+    case ADC_INDEX_OFFSET:
+    case ADC_INDEX_OFFSET + 1:
+    case ADC_INDEX_GAIN:
+        return ADC_UPDATE_PACKING;
+    case ADC_INDEX_FREQUENCY:
+    case ADC_INDEX_PERIOD:
+    case ADC_INDEX_PERIOD + 1:
+    case ADC_INDEX_PERIOD + 2:
+    case ADC_INDEX_PERIOD + 3:
+        return ADC_UPDATE_TIMING;
+    default:
+        return ADC_UPDATE_RESTART;
+    }
+}
+
+static void stage_reg(int index) {
+    int kind = reg_update_kind(index);
+    
+    if (kind > regs_staged_kind)
+        regs_staged_kind = kind;
+}
+
 static int write_reg(uint8_t index, uint8_t value) {
     DBG_VAL("write_reg(index = 0x", index, 10, ")");
     DBG_VAL("  value = 0x", value, 16, "");
     
-    if (index < sizeof(regs)) {
-        uint8_t * pregs = (uint8_t*)&regs;
+    if (index < sizeof(regs_staged)) {
+        uint8_t * pregs = (uint8_t*)&regs_staged;
         pregs[index] = value;
+        stage_reg(index);
         return 1;
     }
     
     return 0;
 }
 
+static uint8_t *write_regs(uint16_t length) {
+    DBG_VAL("write_regs(length = ", length, 10, ")");
+    
+    if (length == 0) {
+        pInformation->Ctrl_Info.Usb_wLength = pInformation->USBwLengths.w;
+        pInformation->Ctrl_Info.PacketSize = Device_Property.MaxPacketSize;
+        return NULL;
+    }
+    return (uint8_t*)&regs_staged + pInformation->USBwIndexs.w + pInformation->Ctrl_Info.Usb_rOffset;
+}
+
 static uint8_t *read_reg(uint16_t length) {
     uint8_t * pregs = (uint8_t*)&regs;
     int wlength = 0;
@@ -355,130 +832,812 @@ static int bitmask_to_array(uint16_t bitmask, uint8_t indicies[ADC_TOTAL_CHANNEL
     return ret;
 }
 
-static void update_mode(void) {
-    uint8_t channels[ADC_TOTAL_CHANNELS], unselected, chan;
-    uint32_t adc_sample_period_us = 1;
-    uint32_t adc_sample_time = ADC_SampleTime_1Cycles5;
-    int continuous_mode = 0;
-    int interleave_mode = 0;
-    int i;
-    
-    console_flush_from_it();
-    DBG_STR("update_mode()");
-    
-    TIM_Cmd(TIM1, DISABLE);
-    while (DMA_GetITStatus(DMA1_IT_TC1) != RESET)
-        ;
-    while (DMA_GetITStatus(DMA1_IT_HT1) != RESET)
-        ;
-    
-    DMA_DeInit(DMA1_Channel1);
-    ADC_DeInit(ADC1);
-    ADC_DeInit(ADC2);
-    TIM_DeInit(TIM1);
-    
-    SetEPTxCount(ENDP1, 0);
+/* In alternate setting 0 EP1 is double-buffered bulk IN: hardware sends
+ * the buffer selected by DTOG_TX while application fills the one selected
+ * by SW_BUF (DTOG_RX bit); when they are equal there is nothing to send and
+ * host is NAKed, so endpoint is left VALID all the time.
+ * In alternate setting 1 EP1 is isochronous IN: hardware sends the buffer
+ * selected by DTOG_TX once per frame, application fills the other one.
+ */
+static void ep1_init(void) {
     SetEPTxStatus(ENDP1, EP_TX_NAK);
-    
-    usb_first_packet = usb_last_packet = 0;
-    usb_tx_in_progress = 0;
-    
-    INF_VAL("current_command: ", regs.cmd, 10, "");
-    INF_VAL("channels requested: 0b", regs.channels, 2, "");
-    INF_VAL("frequency requested: ", regs.frequency, 10, "");
-    INF_VAL("bits per sample requested: ", regs.bits, 10, "");
-    console_flush_from_it();
-    
-    regs.use_channels = regs.channels;
-    nchannels = bitmask_to_array(regs.use_channels, channels, &unselected);
-    
-    if (nchannels == 0 || regs.cmd == ADC_CMD_STOP || regs.frequency == ADC_FREQUENCY_OFF) {
-        led_set_period(BLINK_MODE_NONE);
-        return;
+    if (iso_mode) {
+        SetEPType(ENDP1, EP_ISOCHRONOUS);
+        ClearEPDoubleBuff(ENDP1);
+        SetEPDblBuffAddr(ENDP1, ENDP1_ISO_TXADDR0, ENDP1_ISO_TXADDR1);
     }
-    switch (regs.bits) {
+    else {
+        SetEPType(ENDP1, EP_BULK);
+        SetEPDoubleBuff(ENDP1);
+        SetEPDblBuffAddr(ENDP1, ENDP1_TXADDR0, ENDP1_TXADDR1);
+    }
+    SetEPDblBuffCount(ENDP1, EP_DBUF_IN, 0);
+    iso_frame_packets[0] = iso_frame_packets[1] = 0;
+    ClearDTOG_TX(ENDP1);
+    ClearDTOG_RX(ENDP1);
+    SetEPRxStatus(ENDP1, EP_RX_DIS);
+    SetEPTxStatus(ENDP1, EP_TX_VALID);
+}
+
+/* isochronous stream is drained every frame regardless of ring state */
+static inline int usb_is_draining(void) {
+    return usb_tx_in_progress || iso_mode;
+}
+
+/* Packing kernels: one per (bits, scaling, order) combination, selected
+ * once in `update_mode()`, so the DMA handler does not branch on mode.
+ * Source is read by 32-bit words, each word holds two samples; in fast
+ * interleaved mode (ADC2 sampled first in upper halfword) the order
+ * of the pair is swapped on the fly.
+ * Output is bit-identical to `(ADC - OFFSET) << GAIN` packed as described
+ * in README.
+ */
+typedef void (*PackKernel)(const uint32_t *src, uint8_t *dst, int nsamples);
+
+static PackKernel pack_kernel = NULL;
+static uint32_t pack_offset = 0;
+static uint32_t pack_gain = 0;
+
+#define PACK_INLINE static inline __attribute__((always_inline))
+
+PACK_INLINE void unpack_pair(uint32_t w, int scaled, int swapped,
+                             uint32_t offset, uint32_t gain,
+                             uint32_t *v1, uint32_t *v2) {
+    if (swapped) {
+        *v1 = w >> 16;
+        *v2 = w & 0xffff;
+    }
+    else {
+        *v1 = w & 0xffff;
+        *v2 = w >> 16;
+    }
+    if (scaled) {
+        *v1 = (*v1 - offset) << gain;
+        *v2 = (*v2 - offset) << gain;
+    }
+}
+
+/* Output bytes of 2 and 4-bit packing */
+PACK_INLINE uint32_t byte_2bit(uint32_t v1, uint32_t v2, uint32_t v3, uint32_t v4) {
+    return ((v1 >>  4) & 0xc0) |
+           ((v2 >>  6) & 0x30) |
+           ((v3 >>  8) & 0x0c) |
+           ((v4 >> 10) & 0x03);
+}
+
+PACK_INLINE uint32_t byte_4bit(uint32_t v1, uint32_t v2) {
+    return ((v1 >> 4) & 0xf0) | ((v2 >> 8) & 0x0f);
+}
+
+PACK_INLINE void pack_2bit(const uint32_t *src, uint8_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2, v3, v4;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v3, &v4);
+        *(dst++) = (uint8_t)byte_2bit(v1, v2, v3, v4);
+    }
+}
+
+PACK_INLINE void pack_4bit(const uint32_t *src, uint8_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        *(dst++) = (uint8_t)byte_4bit(v1, v2);
+    }
+}
+
+PACK_INLINE void pack_8bit(const uint32_t *src, uint8_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        *(dst++) = (uint8_t)(v1 >> 4);
+        *(dst++) = (uint8_t)(v2 >> 4);
+    }
+}
+
+PACK_INLINE void pack_12bit(const uint32_t *src, uint8_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        *(dst++) = (uint8_t)(v1 >> 4);
+        *(dst++) = (uint8_t)(((v1 << 4) & 0xf0) | (v2 & 0x0f));
+        *(dst++) = (uint8_t)(v2 >> 4);
+    }
+}
+
+#define PACK_KERNEL(name, packer, scaled, swapped) \
+    static void name(const uint32_t *src, uint8_t *dst, int nsamples) { \
+        packer(src, dst, nsamples, (scaled), (swapped)); \
+    }
+
+PACK_KERNEL(pack_2bit_raw,             pack_2bit,  0, 0)
+PACK_KERNEL(pack_2bit_raw_swapped,     pack_2bit,  0, 1)
+PACK_KERNEL(pack_2bit_scaled,          pack_2bit,  1, 0)
+PACK_KERNEL(pack_2bit_scaled_swapped,  pack_2bit,  1, 1)
+PACK_KERNEL(pack_4bit_raw,             pack_4bit,  0, 0)
+PACK_KERNEL(pack_4bit_raw_swapped,     pack_4bit,  0, 1)
+PACK_KERNEL(pack_4bit_scaled,          pack_4bit,  1, 0)
+PACK_KERNEL(pack_4bit_scaled_swapped,  pack_4bit,  1, 1)
+PACK_KERNEL(pack_8bit_raw,             pack_8bit,  0, 0)
+PACK_KERNEL(pack_8bit_raw_swapped,     pack_8bit,  0, 1)
+PACK_KERNEL(pack_8bit_scaled,          pack_8bit,  1, 0)
+PACK_KERNEL(pack_8bit_scaled_swapped,  pack_8bit,  1, 1)
+PACK_KERNEL(pack_12bit_raw,            pack_12bit, 0, 0)
+PACK_KERNEL(pack_12bit_raw_swapped,    pack_12bit, 0, 1)
+PACK_KERNEL(pack_12bit_scaled,         pack_12bit, 1, 0)
+PACK_KERNEL(pack_12bit_scaled_swapped, pack_12bit, 1, 1)
+
+/* [bits][scaled][swapped] */
+static const PackKernel pack_kernels[4][2][2] = {
+    {{pack_2bit_raw,  pack_2bit_raw_swapped},  {pack_2bit_scaled,  pack_2bit_scaled_swapped}},
+    {{pack_4bit_raw,  pack_4bit_raw_swapped},  {pack_4bit_scaled,  pack_4bit_scaled_swapped}},
+    {{pack_8bit_raw,  pack_8bit_raw_swapped},  {pack_8bit_scaled,  pack_8bit_scaled_swapped}},
+    {{pack_12bit_raw, pack_12bit_raw_swapped}, {pack_12bit_scaled, pack_12bit_scaled_swapped}}
+};
+
+/* The same into USB packet memory (PMA), where each 16-bit word takes
+ * 32 bits of address space and must be written whole: halfwords are
+ * assembled in registers. `nsamples` gives whole halfwords, as in a
+ * full packet of any width.
+ */
+typedef void (*PMAPackKernel)(const uint32_t *src, volatile uint32_t *dst, int nsamples);
+
+static PMAPackKernel pma_pack_kernel = NULL;
+
+PACK_INLINE void pma_pack_2bit(const uint32_t *src, volatile uint32_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2, v3, v4, lo;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v3, &v4);
+        lo = byte_2bit(v1, v2, v3, v4);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v3, &v4);
+        *(dst++) = lo | (byte_2bit(v1, v2, v3, v4) << 8);
+    }
+}
+
+PACK_INLINE void pma_pack_4bit(const uint32_t *src, volatile uint32_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2, v3, v4;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v3, &v4);
+        *(dst++) = byte_4bit(v1, v2) | (byte_4bit(v3, v4) << 8);
+    }
+}
+
+PACK_INLINE void pma_pack_8bit(const uint32_t *src, volatile uint32_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        *(dst++) = ((v1 >> 4) & 0xff) | ((v2 << 4) & 0xff00);
+    }
+}
+
+PACK_INLINE void pma_pack_12bit(const uint32_t *src, volatile uint32_t *dst, int nsamples, int scaled, int swapped) {
+    uint32_t offset = pack_offset, gain = pack_gain;
+    uint32_t v1, v2, v3, v4;
+    const uint32_t *end = src + nsamples / 2;
+    while (src < end) {
+        /* six bytes of two pairs, as pack_12bit() gives them */
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v1, &v2);
+        unpack_pair(*(src++), scaled, swapped, offset, gain, &v3, &v4);
+        *(dst++) = ((v1 >> 4) & 0xff) | ((v1 << 12) & 0xf000) | ((v2 << 8) & 0x0f00);
+        *(dst++) = ((v2 >> 4) & 0xff) | ((v3 << 4) & 0xff00);
+        *(dst++) = ((v3 << 4) & 0xf0) | (v4 & 0x0f) | ((v4 << 4) & 0xff00);
+    }
+}
+
+#define PMA_PACK_KERNEL(name, packer, scaled, swapped) \
+    static void name(const uint32_t *src, volatile uint32_t *dst, int nsamples) { \
+        packer(src, dst, nsamples, (scaled), (swapped)); \
+    }
+
+PMA_PACK_KERNEL(pma_pack_2bit_raw,             pma_pack_2bit,  0, 0)
+PMA_PACK_KERNEL(pma_pack_2bit_raw_swapped,     pma_pack_2bit,  0, 1)
+PMA_PACK_KERNEL(pma_pack_2bit_scaled,          pma_pack_2bit,  1, 0)
+PMA_PACK_KERNEL(pma_pack_2bit_scaled_swapped,  pma_pack_2bit,  1, 1)
+PMA_PACK_KERNEL(pma_pack_4bit_raw,             pma_pack_4bit,  0, 0)
+PMA_PACK_KERNEL(pma_pack_4bit_raw_swapped,     pma_pack_4bit,  0, 1)
+PMA_PACK_KERNEL(pma_pack_4bit_scaled,          pma_pack_4bit,  1, 0)
+PMA_PACK_KERNEL(pma_pack_4bit_scaled_swapped,  pma_pack_4bit,  1, 1)
+PMA_PACK_KERNEL(pma_pack_8bit_raw,             pma_pack_8bit,  0, 0)
+PMA_PACK_KERNEL(pma_pack_8bit_raw_swapped,     pma_pack_8bit,  0, 1)
+PMA_PACK_KERNEL(pma_pack_8bit_scaled,          pma_pack_8bit,  1, 0)
+PMA_PACK_KERNEL(pma_pack_8bit_scaled_swapped,  pma_pack_8bit,  1, 1)
+PMA_PACK_KERNEL(pma_pack_12bit_raw,            pma_pack_12bit, 0, 0)
+PMA_PACK_KERNEL(pma_pack_12bit_raw_swapped,    pma_pack_12bit, 0, 1)
+PMA_PACK_KERNEL(pma_pack_12bit_scaled,         pma_pack_12bit, 1, 0)
+PMA_PACK_KERNEL(pma_pack_12bit_scaled_swapped, pma_pack_12bit, 1, 1)
+
+/* [bits][scaled][swapped] */
+static const PMAPackKernel pma_pack_kernels[4][2][2] = {
+    {{pma_pack_2bit_raw,  pma_pack_2bit_raw_swapped},  {pma_pack_2bit_scaled,  pma_pack_2bit_scaled_swapped}},
+    {{pma_pack_4bit_raw,  pma_pack_4bit_raw_swapped},  {pma_pack_4bit_scaled,  pma_pack_4bit_scaled_swapped}},
+    {{pma_pack_8bit_raw,  pma_pack_8bit_raw_swapped},  {pma_pack_8bit_scaled,  pma_pack_8bit_scaled_swapped}},
+    {{pma_pack_12bit_raw, pma_pack_12bit_raw_swapped}, {pma_pack_12bit_scaled, pma_pack_12bit_scaled_swapped}}
+};
+
+/* Sets `pack_kernel` and `pma_pack_kernel` */
+static void select_pack_kernels(uint8_t bits, int scaled, int swapped) {
+    int nbits;
+    switch (bits) {
     default:
     case ADC_BITS_DIGITAL:
+        nbits = 0;
+        break;
     case ADC_BITS_LO:
-        led_set_period(BLINK_MODE_LORES);
+        nbits = 1;
         break;
     case ADC_BITS_MID:
-        led_set_period(BLINK_MODE_MIDRES);
+        nbits = 2;
         break;
     case ADC_BITS_HI:
-        led_set_period(BLINK_MODE_HIRES);
+        nbits = 3;
         break;
     }
-    
-    if ((nchannels > 1) && (nchannels % 2 != 0)) { /* select additional channel so ADC1 and ADC2 will be synced */
-        WRN_VAL("forcing selection of channel #", unselected, 10, "");
-        channels[nchannels++] = unselected;
-        regs.use_channels |= (1 << unselected);
+    pack_kernel = pack_kernels[nbits][scaled ? 1 : 0][swapped ? 1 : 0];
+    pma_pack_kernel = pma_pack_kernels[nbits][scaled ? 1 : 0][swapped ? 1 : 0];
+}
+
+/* Delta + adaptive Rice coder (BITS = 1), lossless for 12-bit values.
+ * Packet body starts with number of sample periods in this packet, then
+ * goes MSB-first bitstream, one record per sample period:
+ *   - 1 bit: 1 if the period is stored as raw 12-bit values,
+ *            0 if it is stored as Rice-coded deltas;
+ *   - for each channel: 12-bit value, or zigzagged delta to previous
+ *     value of this channel coded with Rice parameter k: unary quotient
+ *     (`u >> k` ones and zero), then `k` low bits; quotient of
+ *     RICE_ESCAPE ones is followed by 13-bit `u` without terminator.
+ * The first period of every packet is raw, so each packet is decoded on
+ * its own. A period is stored raw when Rice code is not shorter, so the
+ * worst case is 1 + 12 bits per sample per period.
+ * Parameter k of each channel is recalculated from running mean of `u`.
+ * Encoding time is bounded: there are no data-dependent loops except
+ * byte flushing in `rice_put()` (at most 3 stores per call), so the
+ * worst case is ~2 passes of ~30 cycles per sample.
+ */
+#define RICE_BODY_BITS      ((ADC_SAMPLE_SIZE - 1) * 8)
+#define RICE_RAW_BITS       12
+#define RICE_ESCAPE         16
+#define RICE_ESCAPE_BITS    13
+#define RICE_K_MAX          12
+#define RICE_ACC_SHIFT      5
+#define RICE_ACC_INIT       (8 << RICE_ACC_SHIFT)
+
+static struct {
+    uint8_t *count;     /* first byte of body: sample periods in packet */
+    uint8_t *dst;       /* next byte of bitstream */
+    uint32_t bits;      /* bits not yet stored, `nbits` lowest ones are valid */
+    int nbits;
+    int used;           /* bits used in packet body */
+    uint16_t prev[ADC_TOTAL_CHANNELS];
+    uint32_t acc[ADC_TOTAL_CHANNELS];
+    uint16_t period[ADC_TOTAL_CHANNELS];  /* sample period being collected */
+    int slot;
+} rice;
+
+PACK_INLINE int rice_k(uint32_t acc) {
+    uint32_t m = acc >> (RICE_ACC_SHIFT + 1);
+    int k = m ? 32 - __builtin_clz(m) : 0;
+    return k > RICE_K_MAX ? RICE_K_MAX : k;
+}
+
+PACK_INLINE int rice_cost(uint32_t u, int k) {
+    uint32_t q = u >> k;
+    return q < RICE_ESCAPE ? (int)q + 1 + k : RICE_ESCAPE + RICE_ESCAPE_BITS;
+}
+
+/* n <= 24 */
+PACK_INLINE void rice_put(uint32_t value, int n) {
+    rice.bits = (rice.bits << n) | value;
+    rice.nbits += n;
+    while (rice.nbits >= 8) {
+        rice.nbits -= 8;
+        *(rice.dst++) = (uint8_t)(rice.bits >> rice.nbits);
+    }
+}
+
+PACK_INLINE void rice_put_value(uint32_t u, int k) {
+    uint32_t q = u >> k;
+    if (q < RICE_ESCAPE) {
+        rice_put(((1 << q) - 1) << 1, q + 1);
+        if (k)
+            rice_put(u & ((1 << k) - 1), k);
+    }
+    else {
+        rice_put((1 << RICE_ESCAPE) - 1, RICE_ESCAPE);
+        rice_put(u, RICE_ESCAPE_BITS);
     }
+}
+
+static void rice_begin(uint8_t *body) {
+    rice.count = body;
+    rice.dst = body + 1;
+    *rice.count = 0;
+    rice.bits = 0;
+    rice.nbits = 0;
+    rice.used = 0;
+}
+
+static void rice_end(void) {
+    if (rice.nbits)
+        *(rice.dst++) = (uint8_t)(rice.bits << (8 - rice.nbits));
+}
+
+/* Returns 0 (and stores nothing) if period does not fit into packet */
+static int rice_encode_period(const uint16_t *v) {
+    uint32_t u[ADC_TOTAL_CHANNELS];
+    int k[ADC_TOTAL_CHANNELS];
+    int first = (*rice.count == 0);
+    int raw = first;
+    int cost = 0;
+    int ch;
     
-    if ((regs.bits == ADC_BITS_HI  && nchannels == 6) ||
-        (regs.bits == ADC_BITS_MID && nchannels == 8) ) {
-        WRN_VAL("wrong mode, bits=", regs.bits, 10, "");
-        WRN_VAL("  nchans=", nchannels, 10, "");
-        WRN_STR("  selecting another two channels");
-        for (i = 0; i < 2; i++) {
-            nchannels = bitmask_to_array(regs.use_channels, channels, &unselected);
-            channels[nchannels++] = unselected;
-            regs.use_channels |= (1 << unselected);
+    if (!first) {
+        for (ch = 0; ch < nchannels; ch++) {
+            int32_t d = (int32_t)v[ch] - (int32_t)rice.prev[ch];
+            u[ch] = (uint32_t)((d << 1) ^ (d >> 31));
+            k[ch] = rice_k(rice.acc[ch]);
+            cost += rice_cost(u[ch], k[ch]);
         }
+        raw = (cost >= RICE_RAW_BITS * nchannels);
     }
-    INF_VAL("channels selected: 0b", regs.use_channels, 2, "");
-
-    samples_per_trigger = (1 << (regs.samples + 10));
-    samples_per_packet = (ADC_SAMPLE_SIZE * 8) / regs.bits;
-    INF_VAL("samples per trigger: ", samples_per_trigger, 10, "");
-    INF_VAL("samples per packet: ", samples_per_packet, 10, "");
-    console_flush_from_it();
+    if (raw)
+        cost = RICE_RAW_BITS * nchannels;
+    if (rice.used + 1 + cost > RICE_BODY_BITS)
+        return 0;
+    rice.used += 1 + cost;
     
-    header.sequence = 0;
-    header.channels = regs.use_channels;
-    header.mode = ((regs.bits & 0x0F) | 
-                   ((regs.frequency & 0x0F) << 4));
+    rice_put(raw, 1);
+    for (ch = 0; ch < nchannels; ch++) {
+        if (raw)
+            rice_put(v[ch] & 0xfff, RICE_RAW_BITS);
+        else
+            rice_put_value(u[ch], k[ch]);
+        if (first)
+            rice.acc[ch] = RICE_ACC_INIT;
+        else
+            rice.acc[ch] += u[ch] - (rice.acc[ch] >> RICE_ACC_SHIFT);
+        rice.prev[ch] = v[ch];
+    }
+    (*rice.count)++;
+    return 1;
+}
+
+/* Oversampling: 4^k conversions of each channel are summed up and
+ * emitted as one (12+k)-bit value in 16-bit LE word; output packet is
+ * filled across several DMA blocks.
+ * Peak detection works the same way, but min and max of conversions are
+ * emitted as a pair of 16-bit LE words.
+ */
+static struct {
+    uint32_t sum[ADC_TOTAL_CHANNELS];  /* max << 16 | min in peak mode */
+    int slot;           /* channel slot of the next sample */
+    int count;          /* sample periods accumulated in `sum` */
+    uint16_t *dst;      /* next word of packet body */
+    uint16_t *end;
+} ovs;
+
+/* Packet filled across DMA blocks in dummy mode, blocks are not packet-sized */
+static struct {
+    uint8_t *dst;       /* body of packet */
+    int filled;         /* samples packed */
+    int phase;          /* channel slot of the first sample */
+} stream;
+
+static void ovs_begin(uint8_t *body) {
+    ovs.dst = (uint16_t*)body;
+    ovs.end = (uint16_t*)(body + ADC_SAMPLE_SIZE);
+}
+
+/* `phase` is channel slot of the first sample in packet */
+static void stamp_header(uint8_t *packet, int phase) {
+    ADCPacketHeader *hdr = (ADCPacketHeader*)packet;
+    if (retime_mode && (int32_t)(packet_first_sample - retime_sample) >= 0) {
+        header.mode = retime_mode;
+        retime_mode = 0;
+    }
+    header.sequence = (header.sequence + 1) & 0x7f;
+    *hdr = header;
+    if (phase)
+        hdr->channels |= (uint16_t)((nchannels - phase) << ADC_HEADER_OFFSET_SHIFT);
+}
+
+/* Stamps header of packet at the end of ring, returns its body */
+static uint8_t *open_packet(int phase) {
+    uint8_t *dst = (uint8_t*)usb_packets[usb_last_packet];
+    stamp_header(dst, phase);
+    return dst + sizeof(ADCPacketHeader);
+}
+
+/* Index of trigger channel's sample in period */
+static int trigger_index(void) {
+    int i;
     
-    {
-        DMA_InitTypeDef s;
-        s.DMA_PeripheralBaseAddr = (uint32_t)(&ADC1->DR);
-        s.DMA_MemoryBaseAddr = (uint32_t)(&adcdma_rx_buf[0]);
-        s.DMA_DIR = DMA_DIR_PeripheralSRC;
-        s.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
-        s.DMA_MemoryInc = DMA_MemoryInc_Enable;
-        if (nchannels > 1 || (nchannels == 1 && regs.frequency == ADC_FREQUENCY_MAX)) {
-            /* there are two (ADC1&ADC2) values (samples) in each transfer,
-             * but we need double buffer for half-transfer handling:
-             *   first half:  (*uint32_t)[0:samples_per_packet/2]
-             *   second half: (*uint32_t)[sampler_per_packet/2:samples_per_packet]
-             */
-            s.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
-            s.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
-            s.DMA_BufferSize = samples_per_packet;
+    for (i = 0; i < nchannels; i++) {
+        if (period_channels[i] == regs.trig_channel)
+            return i;
+    }
+    WRN_STR("Channel for trigger is not enabled, set to first one");
+    return 0;
+}
+
+/* Stops conversions, ADC_DeInit() would also reset calibration */
+static void adc_stop(void) {
+    ADC_ITConfig(ADC1, ADC_IT_JEOC | ADC_IT_AWD, DISABLE);
+    ADC_ITConfig(ADC2, ADC_IT_AWD, DISABLE);
+    ADC_AnalogWatchdogCmd(ADC1, ADC_AnalogWatchdog_None);
+    ADC_AnalogWatchdogCmd(ADC2, ADC_AnalogWatchdog_None);
+    awd_adcs = 0;
+    ADC_ExternalTrigInjectedConvCmd(ADC1, DISABLE);
+    ADC_ExternalTrigInjectedConvCmd(ADC2, DISABLE);
+    ADC_Cmd(ADC1, DISABLE);
+    ADC_Cmd(ADC2, DISABLE);
+    /* reading data register drops DMA request of the last conversion */
+    ADC_GetConversionValue(ADC1);
+    ADC_GetConversionValue(ADC2);
+    ADC_ClearFlag(ADC1, ADC_FLAG_EOC | ADC_FLAG_STRT | ADC_FLAG_JEOC | ADC_FLAG_JSTRT | ADC_FLAG_AWD);
+    ADC_ClearFlag(ADC2, ADC_FLAG_EOC | ADC_FLAG_STRT | ADC_FLAG_JEOC | ADC_FLAG_JSTRT | ADC_FLAG_AWD);
+    NVIC_ClearPendingIRQ(ADC_IRQ);
+}
+
+/* Powers ADC up, calibrating it only for the first time after reset */
+static void adc_power_up(ADC_TypeDef *adc, uint8_t mask) {
+    ADC_Cmd(adc, ENABLE);
+    if (adc_calibrated & mask) {
+        timer_delay_usec(2); /* tSTAB */
+        return;
+    }
+    ADC_ResetCalibration(adc);
+    while (ADC_GetResetCalibrationStatus(adc) == SET)
+        ;
+    ADC_StartCalibration(adc);
+    while (ADC_GetCalibrationStatus(adc) == SET)
+        ;
+    adc_calibrated |= mask;
+    INF_VAL("ADC calibration done, code ", ADC_GetConversionValue(adc), 10, "");
+}
+
+/* Applies trigger and packing registers to running acquisition,
+ * the rest of registers is applied by update_mode()
+ */
+static void update_live(void) {
+    regs.offset = regs_staged.offset;
+    regs.gain = regs_staged.gain;
+    regs.trigger = regs_staged.trigger;
+    regs.trig_channel = regs_staged.trig_channel;
+    regs.trig_level = regs_staged.trig_level;
+    regs.trig_offset = regs_staged.trig_offset;
+    regs.trig_t_min = regs_staged.trig_t_min;
+    regs.trig_t_max = regs_staged.trig_t_max;
+    regs.trig_hysteresis = regs_staged.trig_hysteresis;
+    regs.timestamps = regs_staged.timestamps;
+    
+    if (nchannels == 0)
+        return;
+    
+    pack_offset = regs.offset;
+    pack_gain = regs.gain;
+    select_pack_kernels(regs.bits,
+                        pack_offset != 0 || pack_gain != 0,
+                        samples_in_reversed_order);
+    
+    trigger_chan_index = trigger_index();
+    if (trig_wait && !trig_event) {
+        /* arm again for new level or type */
+        trig_armed = 0;
+        trig_strobe_started = 0;
+        trig_holded = 0;
+    }
+    awd_setup();
+    if (timestamp_countdown > regs.timestamps)
+        timestamp_countdown = regs.timestamps;
+}
+
+/* The longest sampling time that lets conversion fit `ticks` of system clock */
+static uint32_t select_sample_time(uint32_t ticks) {
+    unsigned i;
+    
+    for (i = 0; i < sizeof(adc_conversion_cycles) / sizeof(adc_conversion_cycles[0]) - 1; i++) {
+        if (adc_conversion_cycles[i].cycles * ADC_CYCLE_TICKS <= ticks)
+            break;
+    }
+    return adc_conversion_cycles[i].sample_time;
+}
+
+/* TIM1 prescaler and period for `ticks` of system clock, exact if `ticks`
+ * has a divisor a few steps above the smallest prescaler
+ */
+static void split_timer_ticks(uint32_t ticks, TIM_TimeBaseInitTypeDef *s) {
+    uint32_t prescaler = (ticks + 0xFFFF) >> 16;
+    uint32_t p;
+    
+    for (p = prescaler; p < prescaler + 256 && p <= 0x10000; p++) {
+        if (ticks % p == 0) {
+            s->TIM_Prescaler = p - 1;
+            s->TIM_Period = ticks / p - 1;
+            return;
         }
-        else {
-            /* there is one (ADC1) value (sample) in each transfer,
-             * and we need double buffer for half-transfer handling:
-             *   first half:  (*uint16_t)[0:samples_per_packet]
-             *   second half: (*uint16_t)[sampler_per_packet:samples_per_packet*2]
-             */
-            s.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
-            s.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
-            s.DMA_BufferSize = samples_per_packet * 2;
+    }
+    s->TIM_Prescaler = prescaler - 1;
+    s->TIM_Period = (ticks + prescaler / 2) / prescaler - 1;
+}
+
+/* System clock ticks for conversion of each channel at FREQUENCY or
+ * PERIOD, except FREQUENCY = MAX
+ */
+static uint32_t select_conversion_ticks(uint8_t frequency, uint32_t period) {
+    if (period) {
+        if (period < ADC_CONVERSION_MIN_TICKS)
+            return ADC_CONVERSION_MIN_TICKS;
+        return (period > SystemCoreClock) ? SystemCoreClock : period;
+    }
+    return SystemCoreClock / 1000000 *
+        (frequency <= ADC_FREQUENCY_1KHZ ? frequency_period_us[frequency] : 1);
+}
+
+/* TIM1 time base for a period of `timer_period_scale` conversions */
+static void select_time_base(uint32_t conversion_ticks, int custom_period, TIM_TimeBaseInitTypeDef *s) {
+    uint32_t ticks_per_us = SystemCoreClock / 1000000;
+    if (custom_period) {
+        split_timer_ticks(conversion_ticks * timer_period_scale, s);
+    }
+    else { /* microsecond ticks, SLOWDOWN and PAUSE count on it */
+        s->TIM_Period = conversion_ticks / ticks_per_us * timer_period_scale - 1;
+        s->TIM_Prescaler = ticks_per_us - 1;
+    }
+}
+
+/* Whole packets of `samples` in each half of adcdma_rx_buf[], sized by rate */
+static int select_block_packets(uint32_t use_period, uint32_t samples) {
+    uint32_t nslots = nchannels + dummy_mode;
+    uint32_t block_max = ADC_SAMPLE_SIZE * 4 / samples;
+    uint64_t block_ticks = (uint64_t)use_period * samples / nslots;
+    uint64_t frame_ticks = (uint64_t)SystemCoreClock / 1000000 * DMA_BLOCK_USEC_MAX;
+    return (block_ticks * block_max <= frame_ticks) ? block_max :
+           (block_ticks < frame_ticks) ? frame_ticks / block_ticks : 1;
+}
+
+static void update_mode(void) {
+    uint8_t channels[ADC_TOTAL_CHANNELS], unselected, chan;
+    uint8_t slow_channels[ADC_TOTAL_CHANNELS], slow_per_adc = 0, slow_external = 0;
+    uint32_t adc_sample_time = ADC_SampleTime_1Cycles5;
+    int max_frequency = (!regs.period && regs.frequency == ADC_FREQUENCY_MAX);
+    int continuous_mode = 0;
+    int interleave_mode = 0;
+    int block_bits;
+    
+    console_flush_from_it();
+    DBG_STR("update_mode()");
+    
+    TIM_Cmd(TIM1, DISABLE);
+    while (DMA_GetITStatus(DMA1_IT_TC1) != RESET)
+        ;
+    while (!raw_mode && DMA_GetITStatus(DMA1_IT_HT1) != RESET) /* HT not used in raw mode */
+        ;
+    
+    DMA_DeInit(DMA1_Channel1);
+    adc_stop();
+    TIM_DeInit(TIM1);
+    block_queue_tail = block_queue_head;
+    resync_samples = 0;
+    
+    ep1_init();
+    
+    if (regs.cmd == ADC_CMD_SEGMENTED) {
+        segments = regs.segments ? regs.segments : 1;
+        if (segments > ADC_SEGMENTS_MAX)
+            segments = ADC_SEGMENTS_MAX;
+        segment_packets = (ADC_SAMPLES_COUNT - 1) / segments; /* spare packet is the last one */
+    }
+    else {
+        segments = 0;
+        segment_packets = ADC_SAMPLES_COUNT;
+    }
+    segment = drain_segment = drain_packets = 0;
+    gap_active = paused = 0;
+    slowdown_residue = 0;
+    retime_mode = 0;
+    gap_event_slot = -1;
+    regs.overflows = regs.dropped_packets = 0;
+    ring_start = ring_packets = 0;
+    ring_end = segment_packets;
+    usb_first_packet = usb_last_packet = 0;
+    usb_tx_in_progress = 0;
+    
+    INF_VAL("current_command: ", regs.cmd, 10, "");
+    INF_VAL("channels requested: 0b", regs.channels, 2, "");
+    INF_VAL("frequency requested: ", regs.frequency, 10, "");
+    INF_VAL("period requested: ", regs.period, 10, " ticks");
+    INF_VAL("bits per sample requested: ", regs.bits, 10, "");
+    INF_VAL("oversampling requested: ", regs.oversampling, 10, "");
+    INF_VAL("peak detection requested: ", regs.peak, 10, "");
+    console_flush_from_it();
+    
+    regs.use_channels = regs.channels;
+    nchannels = bitmask_to_array(regs.use_channels, channels, &unselected);
+    
+    if (nchannels == 0 || regs.cmd == ADC_CMD_STOP || (regs.frequency == ADC_FREQUENCY_OFF && !regs.period)) {
+        led_set_period(BLINK_MODE_NONE);
+        return;
+    }
+    switch (regs.bits) {
+    default:
+    case ADC_BITS_DIGITAL:
+    case ADC_BITS_LO:
+        led_set_period(BLINK_MODE_LORES);
+        break;
+    case ADC_BITS_MID:
+        led_set_period(BLINK_MODE_MIDRES);
+        break;
+    case ADC_BITS_HI:
+    case ADC_BITS_RAW:
+    case ADC_BITS_RICE:
+        led_set_period(BLINK_MODE_HIRES);
+        break;
+    }
+    fft_bits = 0;
+    stats_mode = (regs.cmd == ADC_CMD_STATISTICS);
+    if (regs.cmd == ADC_CMD_SPECTRUM)
+        fft_bits = (regs.fft_bits < FFT_BITS_MIN) ? FFT_BITS_MIN :
+                   (regs.fft_bits > FFT_BITS_MAX) ? FFT_BITS_MAX : regs.fft_bits;
+    peak_mode = (regs.peak != 0 && !fft_bits && !stats_mode);
+    if (fft_bits || stats_mode)
+        oversampling = 0;
+    else if (peak_mode)
+        oversampling = (regs.peak > ADC_PEAK_MAX) ? ADC_PEAK_MAX : regs.peak;
+    else
+        oversampling = (regs.oversampling > ADC_OVERSAMPLING_MAX) ? ADC_OVERSAMPLING_MAX : regs.oversampling;
+    raw_mode = (regs.bits == ADC_BITS_RAW && !oversampling && !fft_bits && !stats_mode);
+    rice_mode = (regs.bits == ADC_BITS_RICE && !oversampling && !fft_bits && !stats_mode);
+    if (oversampling || fft_bits || stats_mode)
+        block_bits = ADC_BITS_RAW; /* output is in 16-bit words, or DMA blocks are sized as for them */
+    else if (rice_mode)
+        block_bits = ADC_BITS_HI; /* DMA block is sized as for 12-bit packet */
+    else
+        block_bits = regs.bits;
+    
+    dummy_mode = 0;
+    if ((nchannels > 1) && (nchannels % 2 != 0)) {
+        if (raw_mode) { /* select additional channel so ADC1 and ADC2 will be synced */
+            WRN_VAL("forcing selection of channel #", unselected, 10, "");
+            channels[nchannels++] = unselected;
+            regs.use_channels |= (1 << unselected);
+        }
+        else { /* ADC2 converts unselected channel at the end of each period, it is dropped */
+            dummy_mode = 1;
+            channels[nchannels] = unselected;
         }
-        s.DMA_Mode = DMA_Mode_Circular;
-        s.DMA_Priority = DMA_Priority_High;
-        s.DMA_M2M = DMA_M2M_Disable;
-        DMA_Init(DMA1_Channel1, &s);
-        DMA_Cmd(DMA1_Channel1, ENABLE);
+    }
+    INF_VAL("channels selected: 0b", regs.use_channels, 2, "");
+    memcpy(period_channels, channels, nchannels);
+    
+    slow_nchannels = slow_internal = 0;
+    slow_dual = (nchannels > 1);
+    regs.vdda_mv = 0;
+    if (regs.slow_channels && !max_frequency && regs.cmd != ADC_CMD_SEGMENTED && !fft_bits && !stats_mode) {
+        /* internal channels are of ADC1 only, each takes injected rank of its own */
+        int ranks;
+        slow_internal = ((regs.slow_channels & ADC_SLOW_TEMPERATURE) ? 1 : 0) +
+                        ((regs.slow_channels & ADC_SLOW_VREFINT) ? 1 : 0);
+        ranks = ADC_SLOW_CHANNELS_MAX / 2 - slow_internal;
+        slow_external = bitmask_to_array(regs.slow_channels & ADC_SELECT_ALL_CHANNELS & ~regs.use_channels,
+                                         slow_channels, &chan);
+        if (slow_external > (slow_dual ? 2 * ranks : ranks))
+            slow_external = slow_dual ? 2 * ranks : ranks;
+        slow_nchannels = slow_external + slow_internal;
+        slow_per_adc = (slow_dual ? (slow_external + 1) / 2 : slow_external) + slow_internal;
+        slow_divider = regs.slow_divider ? regs.slow_divider : 1;
+        if (slow_divider > ADC_SLOW_DIVIDER_MAX)
+            slow_divider = ADC_SLOW_DIVIDER_MAX;
+        slow_next_period = slow_divider; /* the first update event comes after this number of periods */
+        slow_pending = 0;
+        INF_VAL("slow channels divider: ", slow_divider, 10, "");
+    }
+
+    samples_per_trigger = (1 << (regs.samples + 10));
+    samples_per_packet = (ADC_SAMPLE_SIZE * 8) / block_bits;
+    sample_bits = block_bits;
+    dma_block_samples = block_samples = samples_per_packet;
+    if (dummy_mode) {
+        /* whole periods with dummy samples in each DMA block, and multiple
+         * of 4 samples left, so packing is aligned to bytes
+         */
+        int periods = ((samples_per_packet / nchannels) + 3) & ~3;
+        while (periods * (nchannels + 1) > ADC_SAMPLE_SIZE * 4)
+            periods -= 4;
+        dma_block_samples = periods * (nchannels + 1);
+        block_samples = periods * nchannels;
+    }
+    if (peak_mode) /* DMA blocks are as for oversampling, packet takes half of pairs */
+        samples_per_packet /= 2;
+    if (fft_bits) {
+        /* samples and sums take 4 bytes per bin, ring must hold a spectrum of each channel */
+        int scratch_packets;
+        for (;; fft_bits--) {
+            int bins = 1 << (fft_bits - 1);
+            scratch_packets = ((nchannels << (fft_bits + 2)) + sizeof(USBPacket) - 1) / sizeof(USBPacket);
+            if (fft_bits == FFT_BITS_MIN || scratch_packets + nchannels *
+                ((bins + SPECTRUM_BINS - 1) / SPECTRUM_BINS) < ADC_SAMPLES_COUNT)
+                break;
+        }
+        fft_acc = (uint32_t*)usb_packets[0];
+        fft_buf = (int16_t*)(fft_acc + (nchannels << (fft_bits - 1)));
+        memset(fft_acc, 0, nchannels << (fft_bits + 1));
+        fft_average = regs.fft_average ? regs.fft_average : 1;
+        fft_channel = nchannels;
+        fft_synced = fft_fill = fft_blocks = 0;
+        ring_start = usb_first_packet = usb_last_packet = scratch_packets;
+        ring_end = ADC_SAMPLES_COUNT;
+        regs.fft_cycles = 0;
+        INF_VAL("spectrum block bits: ", fft_bits, 10, "");
+    }
+    if (stats_mode) {
+        int scratch_packets = (nchannels * sizeof(struct stats_acc) + sizeof(USBPacket) - 1) / sizeof(USBPacket);
+        stats = (struct stats_acc*)usb_packets[0];
+        for (chan = 0; chan < nchannels; chan++) {
+            stats[chan].level = 0x800;
+            stats_reset(&stats[chan]);
+        }
+        stats_window = regs.stats_window ? regs.stats_window : 1;
+        if (stats_window > ADC_STATS_WINDOW_MAX)
+            stats_window = ADC_STATS_WINDOW_MAX;
+        stats_index = stats_period = 0;
+        ring_start = usb_first_packet = usb_last_packet = scratch_packets;
+        ring_end = ADC_SAMPLES_COUNT;
+        INF_VAL("statistics window: ", stats_window, 10, " periods");
+    }
+    block_phase = 0;
+    INF_VAL("samples per trigger: ", samples_per_trigger, 10, "");
+    INF_VAL("samples per packet: ", samples_per_packet, 10, "");
+    console_flush_from_it();
+    
+    header.sequence = 0;
+    header.channels = regs.use_channels;
+    packet_first_sample = adc_rx_total;
+    packet_period = 0;
+    header.mode = (((fft_bits ? ADC_BITS_SPECTRUM : stats_mode ? ADC_BITS_STATS : peak_mode ? ADC_BITS_PEAK :
+                     oversampling ? ADC_BITS_HI + oversampling : regs.bits) & 0x0F) | 
+                   (((regs.period ? ADC_FREQUENCY_CUSTOM : regs.frequency) & 0x0F) << 4));
+    if (fft_bits || stats_mode) {
+        /* packets are put by put_spectrum() and put_stats() */
+    }
+    else if (rice_mode) {
+        memset(&rice, 0, sizeof(rice));
+        rice_begin(open_packet(0));
+    }
+    else if (oversampling) {
+        memset(&ovs, 0, sizeof(ovs));
+        if (peak_mode)
+            for (chan = 0; chan < nchannels; chan++)
+                ovs.sum[chan] = 0xffff;
+        ovs_begin(open_packet(0));
+    }
+    else if (dummy_mode) {
+        stream.dst = open_packet(0);
+        stream.filled = stream.phase = 0;
     }
     
     {
         TIM_TimeBaseInitTypeDef s;
+        uint32_t conversion_ticks;  /* available for conversion of each channel */
         samples_in_reversed_order = continuous_mode = interleave_mode = 0;
-        switch (regs.frequency) {
-        case ADC_FREQUENCY_MAX:
+        timer_period_scale = (nchannels > 1) ? (nchannels + dummy_mode) / 2 : 1;
+        if (max_frequency) {
             continuous_mode = 1;
             if (nchannels == 1)  
                 /* Fast interleaved mode: 
@@ -486,52 +1645,36 @@ static void update_mode(void) {
                      ADC1 value (sampled second) in lower halfword 
                 */
                 samples_in_reversed_order = interleave_mode = 1;
-            adc_sample_time = ADC_SampleTime_1Cycles5;
-            break;
-        case ADC_FREQUENCY_500KHZ:
-            adc_sample_time = ADC_SampleTime_7Cycles5;
-            adc_sample_period_us = 2;
-            break;
-        case ADC_FREQUENCY_200KHZ:
-            adc_sample_time = ADC_SampleTime_41Cycles5;
-            adc_sample_period_us = 5;
-            break;
-        case ADC_FREQUENCY_100KHZ:
-            adc_sample_time = ADC_SampleTime_71Cycles5;
-            adc_sample_period_us = 10;
-            break;
-        case ADC_FREQUENCY_50KHZ:
-            adc_sample_time = ADC_SampleTime_71Cycles5;
-            adc_sample_period_us = 20;
-            break;
-        case ADC_FREQUENCY_20KHZ:
-            adc_sample_time = ADC_SampleTime_239Cycles5;
-            adc_sample_period_us = 50;
-            break;
-        case ADC_FREQUENCY_10KHZ:
-            adc_sample_time = ADC_SampleTime_239Cycles5;
-            adc_sample_period_us = 100;
-            break;
-        case ADC_FREQUENCY_5KHZ:
-            adc_sample_time = ADC_SampleTime_239Cycles5;
-            adc_sample_period_us = 200;
-            break;
-        case ADC_FREQUENCY_2KHZ:
-            adc_sample_time = ADC_SampleTime_239Cycles5;
-            adc_sample_period_us = 500;
-            break;
-        case ADC_FREQUENCY_1KHZ:
-            adc_sample_time = ADC_SampleTime_239Cycles5;
-            adc_sample_period_us = 1000;
-            break;
+            conversion_ticks = ADC_CONVERSION_MIN_TICKS;
+        }
+        else
+            conversion_ticks = select_conversion_ticks(regs.frequency, regs.period);
+        if (slow_internal && conversion_ticks * timer_period_scale <
+            slow_internal * ADC_INTERNAL_CONVERSION_TICKS +
+            (timer_period_scale + slow_per_adc - slow_internal) * ADC_CONVERSION_MIN_TICKS) {
+            INF_VAL("no time for internal slow channels: ", slow_internal, 10, "");
+            slow_nchannels -= slow_internal;
+            slow_per_adc -= slow_internal;
+            slow_internal = 0;
         }
-        if (nchannels > 1)
-            adc_sample_period_us *= (nchannels / 2);
-        s.TIM_Period = adc_sample_period_us - 1;
-        s.TIM_Prescaler = (SystemCoreClock / 1000000) - 1;
+        /* injected sequence takes time of its conversions from periods it is in */
+        adc_sample_time = select_sample_time((conversion_ticks * timer_period_scale -
+                                              slow_internal * ADC_INTERNAL_CONVERSION_TICKS) /
+                                             (timer_period_scale + slow_per_adc - slow_internal));
+        adc_sample_time_set = adc_sample_time;
+        select_time_base(conversion_ticks, regs.period != 0, &s);
+        regs.use_period = interleave_mode ? conversion_ticks / 2 :
+            continuous_mode ? conversion_ticks * timer_period_scale :
+            (uint32_t)(s.TIM_Period + 1) * (s.TIM_Prescaler + 1);
+        INF_VAL("period of conversions: ", regs.use_period, 10, " ticks");
+        if (continuous_mode)
+            timer_period_scale = 0;
         s.TIM_ClockDivision = 0;
         s.TIM_CounterMode = TIM_CounterMode_Up;
+        s.TIM_RepetitionCounter = slow_nchannels ? slow_divider - 1 : 0;
         TIM_TimeBaseInit(TIM1, &s);
+        if (slow_nchannels)
+            TIM_SelectOutputTrigger(TIM1, TIM_TRGOSource_Update);
     }
     {
         TIM_OCInitTypeDef s;
@@ -542,12 +1685,82 @@ static void update_mode(void) {
         TIM_OC1Init(TIM1, &s);
     }
     
+    /* whole packets in each half of adcdma_rx_buf[], sized by rate */
+    block_packets = 1;
+    if (!raw_mode && !fft_bits) {
+        block_packets = select_block_packets(regs.use_period, dma_block_samples);
+        dma_block_samples *= block_packets;
+        block_samples *= block_packets;
+    }
+    regs.block_packets = block_packets;
+    regs.dma_irq_rate = regs.pack_load = 0;
+    regs.direct_cycles = regs.ring_cycles = 0;
+    load_dma_irqs = dma_irqs;
+    load_cycles = 0;
+    load_usec = timer_usec();
+    direct_cycles = direct_packets = ring_pack_cycles = ring_pack_packets = 0;
+    ring_copy_cycles = ring_copy_packets = 0;
+    INF_VAL("packets per DMA block: ", block_packets, 10, "");
+    
+    {
+        DMA_InitTypeDef s;
+        s.DMA_PeripheralBaseAddr = (uint32_t)(&ADC1->DR);
+        s.DMA_MemoryBaseAddr = (uint32_t)(&adcdma_rx_buf[0]);
+        s.DMA_DIR = DMA_DIR_PeripheralSRC;
+        s.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+        s.DMA_MemoryInc = DMA_MemoryInc_Enable;
+        if (nchannels > 1 || (nchannels == 1 && max_frequency)) {
+            /* there are two (ADC1&ADC2) values (samples) in each transfer,
+             * but we need double buffer for half-transfer handling:
+             *   first half:  (*uint32_t)[0:dma_block_samples/2]
+             *   second half: (*uint32_t)[dma_block_samples/2:dma_block_samples]
+             */
+            s.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Word;
+            s.DMA_MemoryDataSize = DMA_MemoryDataSize_Word;
+            s.DMA_BufferSize = dma_block_samples;
+            dma_transfer_samples = 2;
+        }
+        else {
+            /* there is one (ADC1) value (sample) in each transfer,
+             * and we need double buffer for half-transfer handling:
+             *   first half:  (*uint16_t)[0:dma_block_samples]
+             *   second half: (*uint16_t)[dma_block_samples:dma_block_samples*2]
+             */
+            s.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+            s.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+            s.DMA_BufferSize = dma_block_samples * 2;
+            dma_transfer_samples = 1;
+        }
+        dma_transfers = s.DMA_BufferSize;
+        s.DMA_Mode = DMA_Mode_Circular;
+        if (raw_mode) {
+            /* samples go untouched straight into body of packet being
+             * filled, one packet per transfer; channel is re-armed to
+             * the next packet of ring on each transfer complete
+             */
+            s.DMA_MemoryBaseAddr = (uint32_t)(usb_packets[0] + sizeof(ADCPacketHeader));
+            s.DMA_BufferSize /= 2;
+            s.DMA_Mode = DMA_Mode_Normal;
+            raw_dma_transfers = s.DMA_BufferSize;
+        }
+        s.DMA_Priority = DMA_Priority_High;
+        s.DMA_M2M = DMA_M2M_Disable;
+        DMA_Init(DMA1_Channel1, &s);
+        DMA_Cmd(DMA1_Channel1, ENABLE);
+    }
+    
+    pack_offset = regs.offset;
+    pack_gain = regs.gain;
+    select_pack_kernels(regs.bits,
+                        pack_offset != 0 || pack_gain != 0,
+                        samples_in_reversed_order);
+    
     {
         ADC_InitTypeDef s;
         
         if (nchannels > 1) {
-            s.ADC_Mode = ADC_Mode_RegSimult;
-            s.ADC_NbrOfChannel = nchannels / 2;
+            s.ADC_Mode = slow_nchannels ? ADC_Mode_RegInjecSimult : ADC_Mode_RegSimult;
+            s.ADC_NbrOfChannel = (nchannels + dummy_mode) / 2;
         }
         else if (interleave_mode) {
             s.ADC_Mode = ADC_Mode_FastInterl;
@@ -577,20 +1790,14 @@ static void update_mode(void) {
         }
     }
     
-    trigger_chan_index = -1;
-    
     if (nchannels > 1) {
-        for (chan = 0; chan < nchannels / 2; chan++) {
+        for (chan = 0; chan < (nchannels + dummy_mode) / 2; chan++) {
             int chan_adc1 = channels[2 * chan + 0];
             int chan_adc2 = channels[2 * chan + 1];
             ADC_RegularChannelConfig(ADC1, chan_adc1, chan + 1, adc_sample_time);
             ADC_RegularChannelConfig(ADC2, chan_adc2, chan + 1, adc_sample_time);
             INF_VAL("Channel ", chan_adc1, 10, " set for ADC1");
-            INF_VAL("Channel ", chan_adc2, 10, " set for ADC2");
-            if (regs.trig_channel == chan_adc1)
-                trigger_chan_index = 2 * chan + 0;
-            else if (regs.trig_channel == chan_adc2)
-                trigger_chan_index = 2 * chan + 1;
+            INF_VAL("Channel ", chan_adc2, 10, (2 * chan + 1 < nchannels) ? " set for ADC2" : " set for ADC2 (dummy)");
         }
     }
     else {
@@ -602,48 +1809,85 @@ static void update_mode(void) {
                 ADC_RegularChannelConfig(ADC2, chan_adc1, chan + 1, adc_sample_time);
                 INF_VAL("Channel ", chan_adc1, 10, " set for ADC2 (interleave)");
             }
-            if (regs.trig_channel == chan_adc1)
-                trigger_chan_index = chan;
         }
     }
+    
+    slow_vrefint = -1;
+    if (slow_nchannels) {
+        ADCSlowHeader *slow = (ADCSlowHeader*)(slow_packet + sizeof(ADCPacketHeader));
+        int external_ranks = slow_per_adc - slow_internal;
+        uint16_t mask = 0;
+        /* injected sequence length must be set before ranks are configured */
+        ADC_InjectedSequencerLengthConfig(ADC1, slow_per_adc);
+        if (slow_dual)
+            ADC_InjectedSequencerLengthConfig(ADC2, slow_per_adc);
+        for (chan = 0; chan < external_ranks; chan++) {
+            if (slow_dual) {
+                int chan_adc1 = slow_channels[2 * chan + 0];
+                /* channel of ADC1 regular sequence is free while injected one runs */
+                int chan_adc2 = (2 * chan + 1 < slow_external) ? slow_channels[2 * chan + 1] : period_channels[0];
+                ADC_InjectedChannelConfig(ADC1, chan_adc1, chan + 1, adc_sample_time);
+                ADC_InjectedChannelConfig(ADC2, chan_adc2, chan + 1, adc_sample_time);
+                INF_VAL("Slow channel ", chan_adc1, 10, " set for ADC1");
+                INF_VAL("Slow channel ", chan_adc2, 10, (2 * chan + 1 < slow_external) ? " set for ADC2" : " set for ADC2 (dummy)");
+            }
+            else {
+                ADC_InjectedChannelConfig(ADC1, slow_channels[chan], chan + 1, adc_sample_time);
+                INF_VAL("Slow channel ", slow_channels[chan], 10, " set for ADC1");
+            }
+        }
+        for (chan = 0; chan < slow_external; chan++) {
+            mask |= 1 << slow_channels[chan];
+            slow_ranks[chan] = slow_dual ? ((chan / 2) | ((chan & 1) ? SLOW_RANK_ADC2 : 0)) : chan;
+        }
+        memset(slow_packet, 0, sizeof(slow_packet));
+        for (chan = 0; chan < slow_internal; chan++) {
+            int internal = (chan == 0 && (regs.slow_channels & ADC_SLOW_TEMPERATURE)) ?
+                ADC_Channel_TempSensor : ADC_Channel_Vrefint;
+            ADC_InjectedChannelConfig(ADC1, internal, external_ranks + chan + 1, ADC_SampleTime_239Cycles5);
+            if (slow_dual) /* ADC2's channels 16 and 17 are connected to Vss */
+                ADC_InjectedChannelConfig(ADC2, internal, external_ranks + chan + 1, ADC_SampleTime_239Cycles5);
+            slow_ranks[slow_external + chan] = external_ranks + chan;
+            if (internal == ADC_Channel_Vrefint) {
+                slow_vrefint = slow_external + chan;
+                slow->internal |= ADC_SLOW_VREFINT >> 10;
+            }
+            else
+                slow->internal |= ADC_SLOW_TEMPERATURE >> 10;
+            INF_VAL("Slow channel ", internal, 10, " set for ADC1 (internal)");
+        }
+        ((ADCPacketHeader*)slow_packet)->channels = mask | ADC_HEADER_SLOW;
+        ((ADCPacketHeader*)slow_packet)->mode = (header.mode & 0xF0) | (ADC_BITS_RAW & 0x0F);
+        slow->divider = slow_divider;
+        slow_packet_periods = SLOW_SAMPLES / slow_nchannels;
+        ADC_ExternalTrigInjectedConvConfig(ADC1, ADC_ExternalTrigInjecConv_T1_TRGO);
+        ADC_ExternalTrigInjectedConvCmd(ADC1, ENABLE);
+        if (slow_dual) {
+            ADC_ExternalTrigInjectedConvConfig(ADC2, ADC_ExternalTrigInjecConv_None);
+            ADC_ExternalTrigInjectedConvCmd(ADC2, ENABLE);
+        }
+    }
+    ADC_TempSensorVrefintCmd(slow_internal ? ENABLE : DISABLE);
     console_flush_from_it();
     
+    trigger_chan_index = trigger_index();
+    awd_setup();
     INF_VAL("Trigger: ", regs.trigger, 10, "");
     INF_VAL("Trigger channel number: ", regs.trig_channel, 10, "");
     INF_VAL("Trigger channel index: ", trigger_chan_index, 10, "");
     INF_VAL("Command: ", regs.cmd, 10, "");
     console_flush_from_it();
     
-    if (trigger_chan_index < 0) {
-        WRN_STR("Channel for trigger is not enabled, set to first one");
-        trigger_chan_index = 0;
-    }
-    
     ADC_DMACmd(ADC1, ENABLE);
     
-    ADC_Cmd(ADC1, ENABLE);
-    ADC_ResetCalibration(ADC1);
-    while (ADC_GetResetCalibrationStatus(ADC1) == SET)
-        ;
-    ADC_StartCalibration(ADC1);
-    while (ADC_GetCalibrationStatus(ADC1) == SET)
-        ;
+    adc_power_up(ADC1, 1 << 0);
     
     if (nchannels > 1 || interleave_mode) {
         ADC_ExternalTrigConvCmd(ADC2, ENABLE);
-    
-        ADC_Cmd(ADC2, ENABLE);
-        ADC_ResetCalibration(ADC2);
-        while (ADC_GetResetCalibrationStatus(ADC2) == SET)
-            ;
-        ADC_StartCalibration(ADC2);
-        while (ADC_GetCalibrationStatus(ADC2) == SET)
-            ;
+        adc_power_up(ADC2, 1 << 1);
     }
     
-    INF_STR("ADC calibration done");
-    
-    DMA_ITConfig(DMA1_Channel1, DMA_IT_TC | DMA_IT_HT, ENABLE);
+    DMA_ITConfig(DMA1_Channel1, raw_mode ? DMA_IT_TC : (DMA_IT_TC | DMA_IT_HT), ENABLE);
     
     NVIC_PriorityGroupConfig(IRQ_PRIO_GROUP_CFG);
     {
@@ -655,6 +1899,20 @@ static void update_mode(void) {
         NVIC_Init(&s);
     }
     
+    if (slow_nchannels) {
+        ADC_ClearITPendingBit(ADC1, ADC_IT_JEOC);
+        ADC_ITConfig(ADC1, ADC_IT_JEOC, ENABLE);
+    }
+    {
+        /* always on, trigger may become AWD_HI/AWD_LO on the fly */
+        NVIC_InitTypeDef s;
+        s.NVIC_IRQChannel = ADC_IRQ;
+        s.NVIC_IRQChannelPreemptionPriority = ADCDMA_IRQ_PRIO;
+        s.NVIC_IRQChannelSubPriority = 0;
+        s.NVIC_IRQChannelCmd = ENABLE;
+        NVIC_Init(&s);
+    }
+    
     trigger_reset(1);
     
     if (continuous_mode) {
@@ -667,10 +1925,23 @@ static void update_mode(void) {
     }
 }
 
+static void request_restart(void) {
+    restart_pending = 1;
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+static void request_commit(void) {
+    commit_pending = 1;
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
 static void adc_init(void) {
     INF_STR("adc init");
 
     pInformation->Current_Configuration = 0;
+    NVIC_SetPriority(PendSV_IRQn, NVIC_EncodePriority(IRQ_PRIO_GROUP_CFG >> 8, PACK_IRQ_PRIO, 0));
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;  /* DWT cycle counter for PACK_LOAD and *_CYCLES */
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
     usbd_power_on();
     USB_SIL_Init();
 }
@@ -692,22 +1963,110 @@ static void adc_reset(void) {
     SetEPRxCount(ENDP0, Device_Property.MaxPacketSize);
     SetEPRxValid(ENDP0);
 
-    /* Initialize Endpoint 1 */
-    SetEPType(ENDP1, EP_BULK);
-    SetEPTxAddr(ENDP1, ENDP1_TXADDR);
-    SetEPTxCount(ENDP1, 0);
-    SetEPTxStatus(ENDP1, EP_TX_NAK);
-    SetEPRxStatus(ENDP1, EP_RX_DIS);
+    /* Endpoint 1 is initialized by update_mode() */
+    iso_mode = 0;
     
     /* Set this device to response on default address */
     SetDeviceAddress(0);
     
-    update_mode();
+    regs_staged = regs;
+    regs_write_pending = 0;
+    regs_staged_kind = 0;
+    request_restart();
     adc_tx_total = adc_rx_total = 0;
 }
 
+/* The first sample of the first period that starts after TIM1 has
+ * stopped: conversions of the period it stopped in may still be going
+ */
+static uint32_t next_period_sample(void) {
+    uint32_t queued = (block_queue_head - block_queue_tail) * block_samples;
+    uint32_t first = adc_rx_total + queued;
+    uint32_t done = (dma_transfers - DMA_GetCurrDataCounter(DMA1_Channel1)) % (dma_transfers / 2) *
+                    dma_transfer_samples;  /* conversions in the half being written */
+    if (dummy_mode) /* halves hold whole periods */
+        return first + (done + nchannels) / (nchannels + 1) * nchannels;
+    return first + done + (nchannels - (block_phase + queued + done) % nchannels) % nchannels;
+}
+
+/* FREQUENCY or PERIOD on the fly: when ADC sample time and DMA block
+ * size stay the same, TIM1 stops at the end of the current period and
+ * starts again with the new one, samples go on and packets from the
+ * first one at the new rate carry it in header. Returns 0 if
+ * acquisition must restart instead.
+ */
+static int retime(void) {
+    TIM_TimeBaseInitTypeDef s;
+    uint32_t conversion_ticks, use_period;
+    uint8_t code = regs_staged.period ? ADC_FREQUENCY_CUSTOM : regs_staged.frequency;
+    
+    /* continuous conversions, slow group triggered by TIM1 updates and
+     * modes without a sample stream are set up from scratch
+     */
+    if (!timer_period_scale || slow_nchannels || raw_mode || fft_bits || stats_mode ||
+        gap_active || paused || !(TIM1->CR1 & TIM_CR1_CEN) ||
+        code == ADC_FREQUENCY_OFF || code == ADC_FREQUENCY_MAX)
+        return 0;
+    conversion_ticks = select_conversion_ticks(regs_staged.frequency, regs_staged.period);
+    if (select_sample_time(conversion_ticks) != adc_sample_time_set)
+        return 0;
+    select_time_base(conversion_ticks, regs_staged.period != 0, &s);
+    use_period = (uint32_t)(s.TIM_Period + 1) * (s.TIM_Prescaler + 1);
+    if (select_block_packets(use_period, dma_block_samples / block_packets) != block_packets)
+        return 0;
+    
+    /* counter stops by itself at the next update event, new values are
+     * loaded before it starts again; the first period at the new rate
+     * is late by the few instructions in between
+     */
+    TIM_SelectOnePulseMode(TIM1, TIM_OPMode_Single);
+    while (TIM1->CR1 & TIM_CR1_CEN)
+        ;
+    retime_sample = next_period_sample();
+    TIM_SetAutoreload(TIM1, s.TIM_Period);
+    TIM_PrescalerConfig(TIM1, s.TIM_Prescaler, TIM_PSCReloadMode_Immediate);
+    TIM_SelectOnePulseMode(TIM1, TIM_OPMode_Repetitive);
+    TIM_Cmd(TIM1, ENABLE);
+    
+    retime_mode = (header.mode & 0x0F) | (code << 4);
+    regs.frequency = regs_staged.frequency;
+    regs.period = regs_staged.period;
+    regs.use_period = use_period;
+    INF_VAL("period of conversions: ", regs.use_period, 10, " ticks");
+    return 1;
+}
+
+/* Applies all staged registers, doing no more than they need */
+static void commit_regs(void) {
+    uint32_t t0 = timer_usec();
+    int kind = regs_staged_kind ? regs_staged_kind : ADC_UPDATE_RESTART;
+    
+    if (kind == ADC_UPDATE_TIMING && !retime())
+        kind = ADC_UPDATE_RESTART;
+    if (kind == ADC_UPDATE_RESTART) {
+        regs = regs_staged;
+        update_mode();
+    }
+    else {
+        NVIC_DisableIRQ(ADC_IRQ);  /* watchdog interrupt sees all old or all new values */
+        update_live();
+        NVIC_EnableIRQ(ADC_IRQ);
+    }
+    regs_staged_kind = 0;
+    regs.update_kind = kind;
+    regs.update_usec = timer_usec() - t0;
+    INF_VAL("registers committed in ", regs.update_usec, 10, " us");
+}
+
 static void adc_status_in(void) {
     DBG_STR("status_in()");
+    
+    /* called at the end of data stage, and again when status stage is done */
+    if (regs_write_pending) {
+        regs_write_pending = 0;
+        if (regs_write_commit)
+            request_commit();
+    }
 }
 
 static void adc_status_out(void) {
@@ -725,11 +2084,25 @@ static RESULT adc_data_setup(uint8_t RequestNo) {
     DBG_VAL("  USBwIndexs  = 0x", pInformation->USBwIndexs.w, 16, ")");
     DBG_VAL("  USBwLengths = 0x", pInformation->USBwLengths.w, 16, ")");
     
+    regs_write_pending = 0;
+    
     if (Type_Recipient == (VENDOR_REQUEST | DEVICE_RECIPIENT)) {
         switch (RequestNo) {
         case ADC_REQUEST_SETUP:
             CopyRoutine = read_reg;
             break;
+        case ADC_REQUEST_WRITE_REGS:
+            if (!(pInformation->USBbmRequestType & 0x80) &&
+                pInformation->USBwIndexs.w + pInformation->USBwLengths.w <= sizeof(regs_staged)) {
+                int i;
+                
+                for (i = 0; i < pInformation->USBwLengths.w; i++)
+                    stage_reg(pInformation->USBwIndexs.w + i);
+                regs_write_pending = 1;
+                regs_write_commit = !(pInformation->USBwValues.bw.bb0 & ADC_WRITE_STAGE);
+                CopyRoutine = write_regs;
+            }
+            break;
         default:
             break;
         }
@@ -750,26 +2123,39 @@ static RESULT adc_nodata_setup(uint8_t RequestNo) {
     DBG_VAL("  USBwValues = 0x", pInformation->USBwValues.w, 16, ")");
     DBG_VAL("  USBwIndexs = 0x", pInformation->USBwIndexs.w, 16, ")");
     
+    regs_write_pending = 0;
+    
     if (RequestNo == ADC_REQUEST_SETUP) {
         if (write_reg(pInformation->USBwIndexs.bw.bb0, pInformation->USBwValues.bw.bb0) ||
             write_reg(pInformation->USBwIndexs.bw.bb1, pInformation->USBwValues.bw.bb1)) {
-            update_mode();
+            request_commit();
             return USB_SUCCESS;
         }
     }
+    else if (RequestNo == ADC_REQUEST_WRITE_REGS) {
+        /* zero-length write commits what was staged before */
+        request_commit();
+        return USB_SUCCESS;
+    }
 
     return USB_UNSUPPORT;
 }
 
 static RESULT adc_get_interface_setting(uint8_t Interface, uint8_t AlternateSetting) {
     DBG_VAL("get_interface_setting(Interface = 0x", Interface, 16, ")");
-    if (AlternateSetting > 0)
+    if (AlternateSetting > ADC_ALT_SETTING_ISO)
         return USB_UNSUPPORT;
     else if (Interface > 1)
         return USB_UNSUPPORT;
     return USB_SUCCESS;
 }
 
+static void adc_set_interface(void) {
+    INF_VAL("set_interface(AlternateSetting = ", pInformation->USBwValue0, 10, ")");
+    iso_mode = (pInformation->USBwValue0 == ADC_ALT_SETTING_ISO);
+    request_restart();
+}
+
 static uint8_t *adc_get_device_descriptor(uint16_t Length) {
     DBG_VAL("get_device_descriptor(Length = ", Length, 10, ")");
     return Standard_GetDescriptorData(Length, &Device_Descriptor);
@@ -786,110 +2172,1043 @@ static uint8_t *adc_get_string_descriptor(uint16_t Length) {
     return NULL;
 }
 
+static inline int packets_to_send(void) {
+    if (segments)
+        return drain_packets > 0;
+    return usb_first_packet != usb_last_packet;
+}
+
+/* Sets up sending of `drain_segment`, its trigger event goes first */
+static void start_segment_drain(void) {
+    ADCPacketHeader *hdr = (ADCPacketHeader*)trig_event_packet;
+    ring_start = drain_segment * segment_packets;
+    ring_end = ring_start + segment_packets;
+    usb_first_packet = segment_info[drain_segment].first;
+    drain_packets = segment_packets;
+    hdr->sequence = ((ADCPacketHeader*)usb_packets[usb_first_packet])->sequence;
+    hdr->channels = 0;
+    hdr->mode = ADC_EVENT_TRIGGER;
+    memcpy(trig_event_packet + sizeof(ADCPacketHeader), &segment_info[drain_segment].event, sizeof(ADCTriggerEvent));
+    trig_event_pending = 1;
+}
+
+/* Current segment is full: moves ring to the next one, or starts sending
+ * all of them after the last one; returns slot for the next packet
+ */
+static int close_segment(void) {
+    segment_info[segment].first = usb_first_packet;
+    memcpy(&segment_info[segment].event, trig_event_packet + sizeof(ADCPacketHeader), sizeof(ADCTriggerEvent));
+    ring_packets = 0;
+    if (++segment < segments) {
+        trigger_reset(1);
+        ring_start = ring_end;
+        ring_end += segment_packets;
+        usb_first_packet = ring_start;
+        return ring_start;
+    }
+    drain_segment = 0;
+    start_segment_drain();
+    is_triggered = 1;
+    return SPARE_PACKET;
+}
+
+static inline int ring_free(void) {
+    int n = usb_first_packet - usb_last_packet - 1;
+    return (n < 0) ? n + ring_end - ring_start : n;
+}
+
+/* Samples converted into the DMA half-buffer after the one being processed */
+static uint32_t dma_samples_in_flight(void) {
+    uint32_t done = (dma_transfers - DMA_GetCurrDataCounter(DMA1_Channel1)) % (dma_transfers / 2);
+    return done * dma_transfer_samples * nchannels / (nchannels + dummy_mode);
+}
+
+/* SLOWDOWN: TIM1 goes at the next lower FREQUENCY, samples after the gap
+ * are stamped with it
+ */
+static void slow_down(uint32_t next_first) {
+    int code;
+    if (retime_mode) { /* FREQUENCY written just before, packets of gap are dropped anyway */
+        header.mode = retime_mode;
+        retime_mode = 0;
+    }
+    code = header.mode >> 4;
+    if (!timer_period_scale || code >= ADC_FREQUENCY_1KHZ)
+        return;
+    gap_old_period = TIM1->ARR + 1;
+    if (raw_mode) { /* DMA isn't re-armed yet */
+        gap_split_sample = gap_split_end = next_first;
+    }
+    else {
+        gap_split_sample = adc_rx_total + dma_samples_in_flight();
+        gap_split_end = adc_rx_total + block_samples;
+    }
+    code++;
+    gap_new_period = frequency_period_us[code] * timer_period_scale;
+    TIM_SetAutoreload(TIM1, gap_new_period - 1);
+    header.mode = (header.mode & 0x0F) | (code << 4);
+}
+
+/* PAUSE: conversions go on when there is room in ring again, missing
+ * periods are counted by time
+ */
+static void resume_acquisition(void) {
+    uint64_t period_ticks = ((uint64_t)(TIM1->ARR + 1) * (TIM1->PSC + 1)) << (2 * oversampling);
+    uint64_t paused_ticks = (uint64_t)(timer_usec() - pause_usec) * (SystemCoreClock / 1000000);
+    uint32_t periods = (paused_ticks + period_ticks / 2) / period_ticks;
+    gap_periods += periods;
+    packet_period += periods;
+    slow_next_period += periods << (2 * oversampling);
+    paused = 0;
+    TIM_Cmd(TIM1, ENABLE);
+}
+
+/* Packet at usb_last_packet, starting at `first`, is the first one dropped */
+static void start_gap(uint32_t first, uint32_t next_first) {
+    gap_active = 1;
+    gap_first_sample = first;
+    gap_phase = packet_phase(usb_packets[usb_last_packet]);
+    /* host has counted partial period after previous gap already */
+    gap_periods = (gap_phase && packet_is_gap(usb_packets[ring_prev(usb_last_packet)])) ? -1 : 0;
+    gap_packets = 1;
+    gap_old_period = 0;
+    regs.overflows++;
+    regs.dropped_packets++;
+    switch (regs.overflow) {
+    case ADC_OVERFLOW_PAUSE:
+        if (timer_period_scale) {
+            TIM_Cmd(TIM1, DISABLE);
+            pause_usec = timer_usec();
+            paused = 1;
+        }
+        break;
+    case ADC_OVERFLOW_SLOWDOWN:
+        slow_down(next_first);
+        break;
+    }
+}
+
+/* DROP_OLDEST: all packets waiting in ring, except the one at
+ * usb_first_packet, are dropped; gap event takes the first freed slot
+ */
+static int drop_oldest(uint32_t next_first) {
+    int id = ring_next(usb_first_packet);
+    int prev_gap = packet_is_gap(usb_packets[usb_first_packet]);
+    uint32_t samples = 0;
+    gap_periods = 0;
+    gap_packets = 0;
+    gap_old_period = 0;
+    gap_event_slot = id;
+    if (packet_is_gap(usb_packets[id])) { /* previous gap is not sent yet */
+        const ADCGapEvent *gap = (const ADCGapEvent*)(usb_packets[id] + sizeof(ADCPacketHeader));
+        gap_periods = gap->periods;
+        gap_packets = gap->packets;
+        prev_gap = 1;
+        id = ring_next(id);
+    }
+    if (packet_is_event(usb_packets[id])) /* timestamp or slow group, data packet follows */
+        id = ring_next(id);
+    gap_phase = packet_phase(usb_packets[id]);
+    if (prev_gap && gap_phase)
+        gap_periods--;
+    for (;;) {
+        if (!packet_is_event(usb_packets[id])) {
+            samples += packet_samples(usb_packets[id]);
+            gap_packets++;
+            regs.dropped_packets++;
+        }
+        if (id == usb_last_packet)
+            break;
+        id = ring_next(id);
+    }
+    gap_first_sample = next_first - (samples << (2 * oversampling));
+    gap_next_sample = next_first;
+    regs.overflows++;
+    return ring_next(gap_event_slot);
+}
+
+/* Writes gap event prepared by next_packet_slot(), packet it replaces
+ * isn't needed any more
+ */
+static void put_gap_event(void) {
+    uint8_t *packet = usb_packets[gap_event_slot];
+    ADCPacketHeader *hdr = (ADCPacketHeader*)packet;
+    ADCGapEvent *gap = (ADCGapEvent*)(packet + sizeof(ADCPacketHeader));
+    int shift = 2 * oversampling;
+    uint32_t samples = (gap_next_sample - gap_first_sample) >> shift;
+    int32_t periods = (gap_phase + samples + nchannels - 1) / nchannels;
+    if (gap_old_period) { /* periods before split are longer */
+        uint32_t old = ((gap_split_sample - gap_first_sample) >> shift) / nchannels;
+        int32_t ticks = (int32_t)(old * gap_old_period) + slowdown_residue;
+        int32_t n = (ticks + (int32_t)gap_new_period / 2) / (int32_t)gap_new_period;
+        /* carried to the next slowdown, so rounding doesn't accumulate */
+        slowdown_residue = ticks - n * (int32_t)gap_new_period;
+        periods += n - old;
+    }
+    hdr->sequence = (header.sequence + 1) & 0x7f; /* the next packet's one */
+    hdr->channels = 0;
+    hdr->mode = ADC_EVENT_GAP;
+    gap->periods = periods + gap_periods;
+    gap->packets = gap_packets;
+    gap_event_slot = -1;
+}
+
+/* Phase of the packet following usb_last_packet */
+static inline int next_packet_phase(void) {
+    const uint8_t *last = usb_packets[usb_last_packet];
+    return (packet_phase(last) + packet_samples(last)) % nchannels;
+}
+
+/* Writes timestamp event into slot `id` for the packet that follows it,
+ * `packet_period` is already advanced past usb_last_packet
+ */
+static int put_timestamp_event(int id, uint32_t next_first) {
+    ADCPacketHeader *hdr = (ADCPacketHeader*)usb_packets[id];
+    ADCTimestampEvent *event = (ADCTimestampEvent*)(usb_packets[id] + sizeof(ADCPacketHeader));
+    int phase = next_packet_phase();
+    /* DMA interrupt came at the end of the block, it may go past `next_first` */
+    uint32_t block_end = raw_mode ? next_first : adc_rx_total;
+    hdr->sequence = (header.sequence + 1) & 0x7f; /* the next packet's one */
+    hdr->channels = 0;
+    hdr->mode = ADC_EVENT_TIMESTAMP;
+    event->period = packet_period + (phase ? 1 : 0);
+    event->timestamp = block_usec;
+    event->timestamp_period = packet_period +
+        (phase + ((block_end - next_first) >> (2 * oversampling))) / nchannels;
+    timestamp_countdown = regs.timestamps;
+    return ring_next(id);
+}
+
+/* Moves complete slow group packet into slot `id`, before the packet
+ * that follows it; its offset becomes relative to that packet
+ */
+static int put_slow_packet(int id) {
+    ADCSlowHeader *slow = (ADCSlowHeader*)(slow_packet + sizeof(ADCPacketHeader));
+    uint32_t period = packet_period + (next_packet_phase() ? 1 : 0);
+    slow->offset -= period << (2 * oversampling);
+    ((ADCPacketHeader*)slow_packet)->sequence = (header.sequence + 1) & 0x7f; /* the next packet's one */
+    memcpy(usb_packets[id], slow_packet, ADC_PACKET_SIZE);
+    slow->periods = 0;
+    slow_pending = 0;
+    return ring_next(id);
+}
+
+/* Returns slot for the packet following usb_last_packet (which is
+ * complete), the same slot if it is dropped on overflow; `next_first` is
+ * `adc_rx_total` at the first sample of the next packet
+ */
+static int next_packet_slot(uint32_t next_first) {
+    int next;
+    if (segments && segment == segments) /* segments are being sent */
+        return SPARE_PACKET;
+    next = ring_next(usb_last_packet);
+    if (gap_active) {
+        if (!is_triggered ||
+            (!paused && ring_free() >= OVERFLOW_RESUME_PACKETS &&
+             (!gap_old_period || (int32_t)(next_first - gap_split_end) >= 0))) {
+            /* the last dropped packet is replaced with gap event */
+            gap_active = 0;
+            gap_event_slot = usb_last_packet;
+            gap_next_sample = next_first;
+            return next;
+        }
+        gap_packets++;
+        regs.dropped_packets++;
+        return usb_last_packet;
+    }
+    if (!is_triggered)
+        return next;
+    if (next != usb_first_packet) {
+        if (regs.timestamps && !segments && --timestamp_countdown <= 0 &&
+            ring_next(next) != usb_first_packet)
+            return put_timestamp_event(next, next_first);
+        if (slow_pending && ring_next(next) != usb_first_packet)
+            return put_slow_packet(next);
+        return next;
+    }
+    if (segments)
+        return close_segment();
+    if (!usb_is_draining())
+        return next;
+    if (regs.overflow == ADC_OVERFLOW_DROP_OLDEST)
+        return drop_oldest(next_first);
+    start_gap(next_first - (packet_samples(usb_packets[usb_last_packet]) << (2 * oversampling)), next_first);
+    return usb_last_packet;
+}
+
+/* USB interrupt must be masked: overflow handling looks at and
+ * rewrites packets near usb_first_packet
+ */
+static void close_packet(void) {
+    const uint8_t *packet = usb_packets[usb_last_packet];
+    packet_period += (packet_phase(packet) + packet_samples(packet)) / nchannels;
+    packet_first_sample += packet_samples(packet) << (2 * oversampling);
+    if (ring_packets < ADC_SAMPLES_COUNT)
+        ring_packets++;
+    usb_last_packet = next_packet_slot(packet_first_sample);
+    if (gap_event_slot >= 0)
+        put_gap_event();
+}
+
+static void push_packet(void) {
+    NVIC_DisableIRQ(USB_IRQ);
+    close_packet();
+    NVIC_EnableIRQ(USB_IRQ);
+}
+
+static void next_segment_drain(void) {
+    if (++drain_segment < segments)
+        start_segment_drain();
+    else
+        trigger_reset(0);
+}
+
+/* Consumer: packet at usb_first_packet is handed over to USB, every
+ * send path takes it off ring here
+ */
+static inline void ring_pop(void) {
+    adc_tx_total += packet_samples(usb_packets[usb_first_packet]);
+    usb_first_packet = ring_next(usb_first_packet);
+    if (segments && --drain_packets == 0)
+        next_segment_drain();
+}
+
+/* EP1 buffer to be filled next, double buffering alternates them */
+static inline int ep1_tx_buffer(void) {
+    return (GetENDPOINT(ENDP1) & EP_DTOG_RX) ? 1 : 0;
+}
+
+static inline uint16_t ep1_tx_addr(int buffer) {
+    return buffer ? ENDP1_TXADDR1 : ENDP1_TXADDR0;
+}
+
+/* Hands filled EP1 buffer over to USB */
+static void ep1_send(int buffer) {
+    if (buffer)
+        SetEPDblBuf1Count(ENDP1, EP_DBUF_IN, sizeof(USBPacket));
+    else
+        SetEPDblBuf0Count(ENDP1, EP_DBUF_IN, sizeof(USBPacket));
+    FreeUserBuffer(ENDP1, EP_DBUF_IN);
+    usb_tx_in_progress++;
+}
+
+/* trigger event goes right before the packet with trigger flag */
 static void schedule_transmission() {
-    STM_ARR(" (adc) ", (const char*)usb_packets[usb_first_packet], sizeof(USBPacket), "");
-    USB_SIL_Write(ENDP1, usb_packets[usb_first_packet], sizeof(USBPacket));
-    SetEPTxValid(ENDP1);
-    usb_tx_in_progress = 1;
-    usb_first_packet = (usb_first_packet + 1) % ADC_SAMPLES_COUNT;
+    uint8_t *packet = trig_event_pending ? trig_event_packet : usb_packets[usb_first_packet];
+    int buffer = ep1_tx_buffer();
+    uint32_t t0;
+    STM_ARR(" (adc) ", (const char*)packet, sizeof(USBPacket), "");
+    t0 = DWT->CYCCNT;
+    UserToPMABufferCopy(packet, ep1_tx_addr(buffer), sizeof(USBPacket));
+    ep1_send(buffer);
+    if (trig_event_pending) {
+        trig_event_pending = 0;
+        return;
+    }
+    ring_pop();
+    ring_copy_cycles += DWT->CYCCNT - t0;
+    ring_copy_packets++;
 }
 
-void adcdma_irq() {
-    uint16_t *src;
+/* USB interrupt only */
+static void fill_ep1(void) {
+    while (is_triggered && usb_tx_in_progress < ENDP1_TX_BUFFERS && packets_to_send())
+        schedule_transmission();
+}
+
+/* Producer: USB interrupt is pended to send what was published; with
+ * both buffers busy it refills them when one is sent anyway. Producer
+ * publishes before it reads usb_tx_in_progress, and USB interrupt
+ * decrements it before it looks at the ring, so a wakeup isn't lost.
+ */
+static inline void kick_transmission(void) {
+    if (is_triggered && !iso_mode && usb_tx_in_progress < ENDP1_TX_BUFFERS)
+        NVIC_SetPendingIRQ(USB_IRQ);
+}
+
+/* Adds `cycles` to PACK_LOAD, publishes it, DMA_IRQ_RATE and cycles per
+ * packet of both send paths each second
+ */
+static void account_load(uint32_t cycles) {
+    uint32_t now = timer_usec();
+    uint32_t usec = now - load_usec;
+    uint32_t copy_cycles, copy_packets;
+    load_cycles += cycles;
+    if (usec < 1000000)
+        return;
+    regs.dma_irq_rate = (uint64_t)(dma_irqs - load_dma_irqs) * 1000000 / usec;
+    regs.pack_load = (uint64_t)load_cycles * 1000 / ((uint64_t)usec * (SystemCoreClock / 1000000));
+    load_dma_irqs = dma_irqs;
+    load_cycles = 0;
+    load_usec = now;
+    
+    NVIC_DisableIRQ(USB_IRQ);
+    copy_cycles = ring_copy_cycles;
+    copy_packets = ring_copy_packets;
+    ring_copy_cycles = ring_copy_packets = 0;
+    NVIC_EnableIRQ(USB_IRQ);
+    regs.direct_cycles = direct_packets ? direct_cycles / direct_packets : 0;
+    regs.ring_cycles = (ring_pack_packets && copy_packets) ?
+                       ring_pack_cycles / ring_pack_packets + copy_cycles / copy_packets : 0;
+    direct_cycles = direct_packets = ring_pack_cycles = ring_pack_packets = 0;
+}
+
+static void adcdma_raw_irq(void) {
     uint8_t *dst = (uint8_t*)usb_packets[usb_last_packet];
-    ADCPacketHeader *pHeader = (ADCPacketHeader*)dst;
-    uint8_t *pBody = dst + sizeof(ADCPacketHeader);
-    uint32_t i;
+    uint32_t t0 = DWT->CYCCNT;
     int next_usb_last_packet;
+    int phase = block_phase;
+    int seg = segment;
+    
+    if (DMA_GetITStatus(DMA1_IT_TC1) != SET) /* should not happen */
+        return;
+    DMA_ClearITPendingBit(DMA1_IT_GL1);
+    
+    /* next_packet_slot() looks at header of the completed packet */
+    if (!segments || seg != segments)
+        stamp_header(dst, phase);
+    packet_period += (phase + samples_per_packet) / nchannels;
+    
+    /* re-arm first, ADC keeps converting while we are here */
+    next_usb_last_packet = next_packet_slot(packet_first_sample + samples_per_packet);
+    DMA_Cmd(DMA1_Channel1, DISABLE);
+    DMA1_Channel1->CMAR = (uint32_t)(usb_packets[next_usb_last_packet] + sizeof(ADCPacketHeader));
+    DMA_SetCurrDataCounter(DMA1_Channel1, raw_dma_transfers);
+    DMA_Cmd(DMA1_Channel1, ENABLE);
+    
+    adc_rx_total += samples_per_packet;
+    block_phase = (phase + samples_per_packet) % nchannels;
+    if (segments && seg == segments) /* segments are being sent, packet was spare */
+        return;
+    
+    if (segment == seg) { /* otherwise the packet completed previous segment */
+        is_triggered = check_trigger((uint16_t*)(dst + sizeof(ADCPacketHeader)), samples_per_packet, phase);
+        if (ring_packets < ADC_SAMPLES_COUNT)
+            ring_packets++;
+    }
+    
+    packet_first_sample += samples_per_packet;
+    usb_last_packet = next_usb_last_packet;
+    if (gap_event_slot >= 0)
+        put_gap_event();
+    
+    kick_transmission();
+    account_load(DWT->CYCCNT - t0);
+}
+
+static void rice_encode_block(const uint16_t *src, int nsamples) {
+    int swap = samples_in_reversed_order;
+    int i;
+    for (i = 0; i < nsamples; i++) {
+        rice.period[rice.slot] = src[i ^ swap];
+        if (++rice.slot < nchannels)
+            continue;
+        rice.slot = 0;
+        if (!rice_encode_period(rice.period)) {
+            rice_end();
+            push_packet();
+            rice_begin(open_packet(0));
+            rice_encode_period(rice.period);
+        }
+    }
+}
+
+static void oversample_block(const uint16_t *src, int nsamples) {
+    int swap = samples_in_reversed_order;
+    int shift = oversampling;
+    int periods = 1 << (2 * oversampling);
+    int i, ch;
+    for (i = 0; i < nsamples; i++) {
+        ovs.sum[ovs.slot] += src[i ^ swap];
+        if (++ovs.slot < nchannels)
+            continue;
+        ovs.slot = 0;
+        if (++ovs.count < periods)
+            continue;
+        ovs.count = 0;
+        for (ch = 0; ch < nchannels; ch++) {
+            *(ovs.dst++) = (uint16_t)(ovs.sum[ch] >> shift);
+            ovs.sum[ch] = 0;
+            if (ovs.dst == ovs.end) {
+                push_packet();
+                ovs_begin(open_packet((ch + 1) % nchannels));
+            }
+        }
+    }
+}
+
+static void peak_block(const uint16_t *src, int nsamples) {
+    int swap = samples_in_reversed_order;
+    int periods = 1 << (2 * oversampling);
+    int i, ch;
+    for (i = 0; i < nsamples; i++) {
+        uint32_t v = src[i ^ swap];
+        uint32_t minmax = ovs.sum[ovs.slot];
+        if (v < (minmax & 0xffff))
+            minmax = (minmax & 0xffff0000) | v;
+        if (v > (minmax >> 16))
+            minmax = (minmax & 0xffff) | (v << 16);
+        ovs.sum[ovs.slot] = minmax;
+        if (++ovs.slot < nchannels)
+            continue;
+        ovs.slot = 0;
+        if (++ovs.count < periods)
+            continue;
+        ovs.count = 0;
+        for (ch = 0; ch < nchannels; ch++) {
+            *(ovs.dst++) = (uint16_t)ovs.sum[ch];
+            *(ovs.dst++) = (uint16_t)(ovs.sum[ch] >> 16);
+            ovs.sum[ch] = 0xffff;
+            if (ovs.dst == ovs.end) {
+                push_packet();
+                ovs_begin(open_packet((ch + 1) % nchannels));
+            }
+        }
+    }
+}
+
+/* Puts magnitudes of all channels into the ring, packets that don't fit are dropped */
+static void put_spectrum(void) {
+    int bins = 1 << (fft_bits - 1);
+    int ch, first, i;
+    for (ch = 0; ch < nchannels; ch++) {
+        const uint32_t *acc = fft_acc + ch * bins;
+        for (first = 0; first < bins; first += SPECTRUM_BINS) {
+            uint8_t *packet = usb_packets[usb_last_packet];
+            ADCPacketHeader *hdr = (ADCPacketHeader*)packet;
+            ADCSpectrumHeader *spectrum = (ADCSpectrumHeader*)(packet + sizeof(ADCPacketHeader));
+            uint16_t *dst = (uint16_t*)(packet + sizeof(ADCPacketHeader) + sizeof(ADCSpectrumHeader));
+            int next = ring_next(usb_last_packet);
+            header.sequence = (header.sequence + 1) & 0x7f;
+            if (next == usb_first_packet) {
+                regs.dropped_packets++;
+                continue;
+            }
+            hdr->sequence = header.sequence;
+            hdr->channels = 1 << period_channels[ch];
+            hdr->mode = header.mode;
+            spectrum->first = first;
+            spectrum->bits = fft_bits;
+            spectrum->blocks = fft_blocks;
+            for (i = 0; i < SPECTRUM_BINS; i++) {
+                uint32_t v = (first + i < bins) ? (acc[first + i] + fft_blocks / 2) / fft_blocks : 0;
+                dst[i] = (v > 0xffff) ? 0xffff : v;
+            }
+            usb_last_packet = next;
+        }
+    }
+}
+
+/* `phase` is channel slot of src[0] */
+static void spectrum_block(const uint16_t *src, int nsamples, int phase) {
+    int swap = samples_in_reversed_order;
+    int i;
+    
+    if (fft_channel < nchannels) {
+        uint32_t t0 = DWT->CYCCNT;
+        fft_magnitudes(fft_buf + (fft_channel << fft_bits), fft_bits,
+                       fft_acc + (fft_channel << (fft_bits - 1)));
+        regs.fft_cycles = DWT->CYCCNT - t0;
+        /* halves of DMA buffer queued meanwhile are stale */
+        block_queue_tail = block_queue_head;
+        if (++fft_channel < nchannels)
+            return;
+        if (++fft_blocks >= fft_average) {
+            put_spectrum();
+            memset(fft_acc, 0, nchannels << (fft_bits + 1));
+            fft_blocks = 0;
+        }
+        fft_synced = fft_fill = 0;
+        return;
+    }
+    for (i = 0; i < nsamples; i++) {
+        int slot = phase;
+        if (++phase == nchannels)
+            phase = 0;
+        if (!fft_synced && slot != 0)
+            continue;
+        fft_synced = 1;
+        fft_buf[(slot << fft_bits) + fft_fill] = src[i ^ swap];
+        if (slot == nchannels - 1 && ++fft_fill == (1 << fft_bits)) {
+            fft_channel = 0;
+            return;
+        }
+    }
+}
+
+/* Puts records of all channels into the ring, the ones that don't fit
+ * are dropped; accumulation starts over, crossings are counted through
+ * the new means
+ */
+static void put_stats(void) {
+    int ch;
+    for (ch = 0; ch < nchannels; ch++) {
+        struct stats_acc *acc = &stats[ch];
+        uint8_t *packet = usb_packets[usb_last_packet];
+        ADCPacketHeader *hdr = (ADCPacketHeader*)packet;
+        ADCStatsRecord *record = (ADCStatsRecord*)(packet + sizeof(ADCPacketHeader));
+        int next = ring_next(usb_last_packet);
+        header.sequence = (header.sequence + 1) & 0x7f;
+        if (next == usb_first_packet)
+            regs.dropped_packets++;
+        else {
+            hdr->sequence = header.sequence;
+            hdr->channels = 1 << period_channels[ch];
+            hdr->mode = header.mode;
+            record->window = stats_index;
+            record->periods = stats_window;
+            record->sum = acc->sum;
+            record->sum_squares = acc->sum_squares;
+            record->min = acc->min;
+            record->max = acc->max;
+            record->level = acc->level;
+            record->crossings = acc->crossings;
+            record->first_crossing = acc->first_crossing;
+            record->last_crossing = acc->last_crossing;
+            memset(record + 1, 0, ADC_SAMPLE_SIZE - sizeof(ADCStatsRecord));
+            usb_last_packet = next;
+        }
+        acc->level = (acc->sum + stats_window / 2) / stats_window;
+        stats_reset(acc);
+    }
+    stats_index++;
+}
+
+/* `phase` is channel slot of src[0] */
+static void stats_block(const uint16_t *src, int nsamples, int phase) {
+    int swap = samples_in_reversed_order;
+    uint32_t hysteresis = regs.trig_hysteresis;
+    int i;
+    for (i = 0; i < nsamples; i++) {
+        struct stats_acc *acc = &stats[phase];
+        uint32_t v = src[i ^ swap];
+        acc->sum += v;
+        acc->sum_squares += v * v;
+        if (v < acc->min)
+            acc->min = v;
+        if (v > acc->max)
+            acc->max = v;
+        if (v + hysteresis < acc->level)
+            acc->armed = 1;
+        else if (acc->armed && v > acc->level + hysteresis) {
+            acc->armed = 0;
+            if (acc->crossings++ == 0)
+                acc->first_crossing = stats_period;
+            acc->last_crossing = stats_period;
+        }
+        if (++phase < nchannels)
+            continue;
+        phase = 0;
+        if (++stats_period == stats_window) {
+            put_stats();
+            stats_period = 0;
+        }
+    }
+}
+
+/* Removes dummy ADC2 sample from the end of each period, returns number
+ * of samples left
+ */
+static int drop_dummy_samples(uint16_t *buf, int nsamples) {
+    uint16_t *src = buf, *dst = buf, *end = buf + nsamples;
+    int ch;
+    while (src < end) {
+        for (ch = 0; ch < nchannels; ch++)
+            *(dst++) = *(src++);
+        src++;
+    }
+    return dst - buf;
+}
+
+/* nsamples is a multiple of 4, so is every part of packet */
+static void stream_pack(const uint32_t *src, int nsamples) {
+    while (nsamples > 0) {
+        int n = samples_per_packet - stream.filled;
+        if (n > nsamples)
+            n = nsamples;
+        pack_kernel(src, stream.dst + stream.filled * sample_bits / 8, n);
+        src += n / 2;
+        nsamples -= n;
+        stream.filled += n;
+        if (stream.filled == samples_per_packet) {
+            push_packet();
+            stream.phase = (stream.phase + samples_per_packet) % nchannels;
+            stream.dst = open_packet(stream.phase);
+            stream.filled = 0;
+        }
+    }
+}
+
+/* End of injected sequence, results of one slow period */
+static void slow_group_irq(void) {
+    static const uint8_t injected[ADC_SLOW_CHANNELS_MAX / 2] = {
+        ADC_InjectedChannel_1, ADC_InjectedChannel_2, ADC_InjectedChannel_3, ADC_InjectedChannel_4
+    };
+    ADCSlowHeader *slow = (ADCSlowHeader*)(slow_packet + sizeof(ADCPacketHeader));
+    uint16_t *values;
+    int i;
+    
+    ADC_ClearITPendingBit(ADC1, ADC_IT_JEOC);
+    if (!slow_nchannels)
+        return;
+    if (slow_vrefint >= 0) {
+        uint32_t vrefint = ADC_GetInjectedConversionValue(ADC1, injected[slow_ranks[slow_vrefint]]);
+        regs.vdda_mv = vrefint ? ADC_VREFINT_MV * 0xfff / vrefint : 0;
+    }
+    /* results are dropped while previous packet waits for a slot */
+    if (!slow_pending && is_triggered) {
+        if (slow->periods == 0)
+            slow->offset = slow_next_period; /* made relative in put_slow_packet() */
+        values = (uint16_t*)(slow + 1) + slow->periods * slow_nchannels;
+        for (i = 0; i < slow_nchannels; i++)
+            values[i] = ADC_GetInjectedConversionValue((slow_ranks[i] & SLOW_RANK_ADC2) ? ADC2 : ADC1,
+                                                       injected[slow_ranks[i] & ~SLOW_RANK_ADC2]);
+        if (++slow->periods == slow_packet_periods)
+            slow_pending = 1;
+    }
+    slow_next_period += slow_divider;
+}
+
+void adc_irq(void) {
+    if (ADC_GetITStatus(ADC1, ADC_IT_AWD) == SET || ADC_GetITStatus(ADC2, ADC_IT_AWD) == SET) {
+        ADC_ITConfig(ADC1, ADC_IT_AWD, DISABLE);
+        ADC_ITConfig(ADC2, ADC_IT_AWD, DISABLE);
+        ADC_ClearITPendingBit(ADC1, ADC_IT_AWD);
+        ADC_ClearITPendingBit(ADC2, ADC_IT_AWD);
+        trig_awd_hit = 1;
+    }
+    if (ADC_GetITStatus(ADC1, ADC_IT_JEOC) == SET)
+        slow_group_irq();
+}
+
+void adcdma_irq() {
+    uint32_t head = block_queue_head;
+    DMABlock *block = &block_queue[head % BLOCK_QUEUE_SIZE];
+    uint16_t offset;
+    
+    dma_irqs++;
+    if (raw_mode) {
+        block_usec = timer_usec();
+        adcdma_raw_irq();
+        return;
+    }
     
     if (DMA_GetITStatus(DMA1_IT_HT1) == SET) {
-        src = &adcdma_rx_buf[0];
+        offset = 0;
         DMA_ClearITPendingBit(DMA1_IT_HT1);
     }
     else if (DMA_GetITStatus(DMA1_IT_TC1) == SET) {
-        src = &adcdma_rx_buf[samples_per_packet];
+        offset = dma_block_samples;
         DMA_ClearITPendingBit(DMA1_IT_TC1);
     }
     else /* should not happen */
         return;
     
-    adc_rx_total += samples_per_packet;
+    /* the slot held this half two interrupts ago; if the previous entry
+     * is still queued, DMA is refilling its half and PendSV drops it
+     */
+    block->offset = offset;
+    block->usec = timer_usec();
+    block_queue_head = head + 1;
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
+uint32_t adc_direct_packets = 0;  /* sent by send_direct() */
+
+/* Fast path of plain packing: when ring is empty and EP1 has a free
+ * buffer, packet at usb_last_packet (only its header is stamped) is
+ * packed straight into that buffer and sent, skipping usb_packets[] and
+ * the copy in USB interrupt. Returns 0 if it has to go through ring.
+ * Its body is not kept, so pretrigger window starts after it; this is
+ * why negative TRIG_OFFSET keeps the ring path.
+ */
+static int send_direct(uint16_t *src) {
+    const uint32_t *header_word = (const uint32_t*)usb_packets[usb_last_packet];
+    volatile uint32_t *pma;
+    uint32_t t0;
+    int buffer;
     
-    header.sequence = (header.sequence + 1) & 0x7f;
-    *pHeader = header;
+    if (iso_mode || segments || !is_triggered || (int32_t)regs.trig_offset < 0)
+        return 0;
     
-    if (samples_in_reversed_order) {
-        static uint16_t swapped_src[ADC_SAMPLE_SIZE * 4];
-        uint32_t *src_u32 = (uint32_t*)src;
-        uint32_t *dst_u32 = (uint32_t*)swapped_src;
-        for (i = 0; i < samples_per_packet; i += 2) {
-            *(dst_u32++) = (src_u32[0] >> 16) | (src_u32[0] << 16);
-            src_u32++;
-        }
-        src = &swapped_src[0];
+    NVIC_DisableIRQ(USB_IRQ);
+    if (trig_event_pending || gap_active || packets_to_send() ||
+        usb_tx_in_progress >= ENDP1_TX_BUFFERS) {
+        NVIC_EnableIRQ(USB_IRQ);
+        return 0;
     }
-    is_triggered = check_trigger(src);
+    t0 = DWT->CYCCNT;
+    buffer = ep1_tx_buffer();
+    pma = (volatile uint32_t*)(PMAAddr + ep1_tx_addr(buffer) * 2);
+    pma[0] = *header_word & 0xffff;
+    pma[1] = *header_word >> 16;
+    pma_pack_kernel((uint32_t*)src, pma + sizeof(ADCPacketHeader) / 2, samples_per_packet);
     
-    switch (header.mode & 0x0F) {
-    case ADC_BITS_DIGITAL:
-        for (i = 0; i < samples_per_packet; i += 4) {
-            uint32_t v1 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v2 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v3 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v4 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            *(pBody++) = (uint8_t)(((v1 >>  4) & 0xc0) | 
-                                   ((v2 >>  6) & 0x30) |
-                                   ((v3 >>  8) & 0x0c) |
-                                   ((v4 >> 10) & 0x03) );
-        }
-        break;
-    case ADC_BITS_LO:
-        for (i = 0; i < samples_per_packet; i += 2) {
-            uint32_t v1 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v2 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            *(pBody++) = (uint8_t)(((v1 >> 4) & 0xf0) | ((v2 >> 8) & 0x0f));
+    /* as if it was published and sent at once; events may follow it */
+    close_packet();
+    ring_packets = 0;
+    ring_pop();
+    ep1_send(buffer);
+    NVIC_EnableIRQ(USB_IRQ);
+    direct_cycles += DWT->CYCCNT - t0;
+    direct_packets++;
+    adc_direct_packets++;
+    return 1;
+}
+
+/* Plain packing, block holds `block_packets` whole packets */
+static void pack_packets(uint16_t *src, int phase) {
+    int n;
+    for (n = 0; n < block_packets; n++) {
+        uint8_t *dst = (uint8_t*)usb_packets[usb_last_packet];
+        stamp_header(dst, phase);
+        
+        /* capture may start in a later packet of block, trigger event skips to it */
+        if (n == 0)
+            is_triggered = check_trigger(src, block_samples, phase);
+        
+        if (!send_direct(src)) {
+            uint32_t t0 = DWT->CYCCNT;
+            pack_kernel((uint32_t*)src, dst + sizeof(ADCPacketHeader), samples_per_packet);
+            push_packet();
+            ring_pack_cycles += DWT->CYCCNT - t0;
+            ring_pack_packets++;
         }
-        break;
-    case ADC_BITS_MID:
-        for (i = 0; i < samples_per_packet; i += 2) {
-            uint32_t v1 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v2 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            *(pBody++) = (uint8_t)(v1 >> 4);
-            *(pBody++) = (uint8_t)(v2 >> 4);
+        if (segments && segment == segments) /* the last one is complete */
+            break;
+        src += samples_per_packet;
+        phase = (phase + samples_per_packet) % nchannels;
+    }
+}
+
+/* PendSV was late for `n` blocks and DMA refilled their halves. Their
+ * samples are dropped like on ring overflow, with the packet being filled
+ * (plain packing has none), and a gap event tells host how many periods
+ * are missing. Oversampling and Rice coding skip to the next averaging
+ * window or period, where the packet after the gap starts. If the packet
+ * being filled has trigger flag, the next one takes it and the gap
+ * counts from the first period of capture.
+ */
+static void drop_blocks(int n) {
+    int plain = !rice_mode && !oversampling && !dummy_mode;
+    uint32_t lost = n * block_samples;
+    uint32_t window = 0, pos = 0, next_first;
+    int phase, started = 0, capture_start;
+    
+    adc_block_overruns += n;
+    if (segments && segment == segments) /* segments are being sent */
+        return;
+    adc_rx_total += lost;
+    if (fft_bits || stats_mode) {
+        /* no sample stream; spectrum input starts over, stats window gets fewer samples */
+        block_phase = (block_phase + lost) % nchannels;
+        if (fft_bits && fft_channel >= nchannels)
+            fft_synced = fft_fill = 0;
+        return;
+    }
+    
+    if (rice_mode) {
+        window = nchannels;
+        pos = resync_samples ? window - resync_samples : (uint32_t)rice.slot;
+    }
+    else if (oversampling) {
+        window = nchannels << (2 * oversampling);
+        pos = resync_samples ? window - resync_samples : (uint32_t)(ovs.count * nchannels + ovs.slot);
+    }
+    resync_samples = window ? (window - (pos + lost) % window) % window : 0;
+    next_first = adc_rx_total + resync_samples;
+    phase = plain ? block_phase : packet_phase(usb_packets[usb_last_packet]);
+    capture_start = !plain && (((ADCPacketHeader*)usb_packets[usb_last_packet])->sequence & 0x80);
+    
+    NVIC_DisableIRQ(USB_IRQ);
+    if (!gap_active && (!segments || ring_next(usb_last_packet) != usb_first_packet)) {
+        started = gap_active = 1;
+        gap_first_sample = packet_first_sample;
+        gap_phase = phase;
+        gap_periods = (phase && (capture_start || packet_is_gap(usb_packets[ring_prev(usb_last_packet)]))) ? -1 : 0;
+        gap_packets = !plain;
+        gap_old_period = 0;
+        regs.dropped_packets += gap_packets;
+    }
+    packet_period += (phase + ((next_first - packet_first_sample) >> (2 * oversampling))) / nchannels;
+    packet_first_sample = next_first;
+    block_phase = (block_phase + lost) % nchannels;
+    /* a gap opened here ends at once if there is a slot for its event,
+     * one of ring overflow ends as usual
+     */
+    if (started && (!is_triggered || ring_next(usb_last_packet) != usb_first_packet)) {
+        gap_active = 0;
+        gap_event_slot = usb_last_packet;
+        gap_next_sample = next_first;
+        usb_last_packet = ring_next(usb_last_packet);
+        if (ring_packets < ADC_SAMPLES_COUNT)
+            ring_packets++;
+        put_gap_event();
+    }
+    NVIC_EnableIRQ(USB_IRQ);
+    
+    if (rice_mode) {
+        rice.slot = 0;
+        rice_begin(open_packet(0));
+    }
+    else if (oversampling) {
+        int ch;
+        for (ch = 0; ch < nchannels; ch++)
+            ovs.sum[ch] = peak_mode ? 0xffff : 0;
+        ovs.count = ovs.slot = 0;
+        ovs_begin(open_packet(0));
+    }
+    else if (dummy_mode) {
+        stream.phase = block_phase;
+        stream.filled = 0;
+        stream.dst = open_packet(block_phase);
+    }
+    if (capture_start)
+        ((ADCPacketHeader*)usb_packets[usb_last_packet])->sequence |= 0x80;
+}
+
+static void pack_block(uint16_t *src) {
+    int nsamples;
+    int phase = block_phase;
+    
+    if (segments && segment == segments) /* segments are being sent */
+        return;
+    
+    nsamples = dummy_mode ? drop_dummy_samples(src, dma_block_samples) : block_samples;
+    adc_rx_total += nsamples;
+    block_phase = (phase + nsamples) % nchannels;
+    if (resync_samples) { /* these belong to the gap */
+        int n = (resync_samples < nsamples) ? resync_samples : nsamples;
+        resync_samples -= n;
+        if (n == nsamples)
+            return;
+        src += n;
+        nsamples -= n;
+        phase = (phase + n) % nchannels;
+    }
+    
+    if (fft_bits) {
+        /* spectra go out as soon as they are ready */
+        is_triggered = 1;
+        spectrum_block(src, nsamples, phase);
+    }
+    else if (stats_mode) {
+        is_triggered = 1;
+        stats_block(src, nsamples, phase);
+    }
+    else if (rice_mode) {
+        /* packet stays open until the next sample period doesn't fit */
+        is_triggered = check_trigger(src, nsamples, phase);
+        rice_encode_block(src, nsamples);
+    }
+    else if (oversampling) {
+        /* packet stays open until it is filled with averaged samples */
+        is_triggered = check_trigger(src, nsamples, phase);
+        if (peak_mode)
+            peak_block(src, nsamples);
+        else
+            oversample_block(src, nsamples);
+    }
+    else if (dummy_mode) {
+        is_triggered = check_trigger(src, nsamples, phase);
+        stream_pack((uint32_t*)src, nsamples);
+    }
+    else
+        pack_packets(src, phase);
+    
+    kick_transmission();
+}
+
+/* PendSV: applies what USB interrupt requested, then packs queued blocks */
+void adc_pack_irq(void) {
+    uint32_t t0 = DWT->CYCCNT;
+    for (;;) {
+        uint32_t tail = block_queue_tail;
+        uint32_t head;
+        uint16_t offset;
+        if (paused && ring_free() >= OVERFLOW_RESUME_PACKETS)
+            resume_acquisition();
+        if (restart_pending || commit_pending) {
+            uint32_t t1 = DWT->CYCCNT;
+            /* EP1 is reinitialized, USB interrupt must not see it halfway */
+            NVIC_DisableIRQ(USB_IRQ);
+            if (restart_pending) {
+                restart_pending = 0;
+                update_mode();
+            }
+            if (commit_pending) {
+                commit_pending = 0;
+                commit_regs();
+            }
+            NVIC_EnableIRQ(USB_IRQ);
+            t0 += DWT->CYCCNT - t1;  /* reconfiguration is not packing, UPDATE_USEC has it */
+            continue;
         }
-        break;
-    case ADC_BITS_HI:
-        for (i = 0; i < samples_per_packet; i += 2) {
-            uint32_t v1 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            uint32_t v2 = ((uint32_t)(*(src++)) - regs.offset) << regs.gain;
-            *(pBody++) = (uint8_t)(v1 >> 4);
-            *(pBody++) = (uint8_t)(((v1 << 4) & 0xf0) | (v2 & 0x0f));
-            *(pBody++) = (uint8_t)(v2 >> 4);
+        head = block_queue_head;
+        if (tail == head)
+            break;
+        if (head - tail > 1) {
+            drop_blocks(head - tail - 1);
+            tail = head - 1;
         }
-        break;
+        /* the next DMA interrupt writes the other slot */
+        block_usec = block_queue[tail % BLOCK_QUEUE_SIZE].usec;
+        offset = block_queue[tail % BLOCK_QUEUE_SIZE].offset;
+        block_queue_tail = tail + 1;
+        pack_block(&adcdma_rx_buf[offset]);
     }
+    account_load(DWT->CYCCNT - t0);
+}
+
+/* Called once per frame in isochronous mode, after the buffer filled
+ * on previous call was sent; fills it again with up to
+ * ADC_ISO_PACKETS_PER_FRAME packets from the ring (possibly none).
+ */
+static void schedule_iso_frame(void) {
+    int buf = (GetENDPOINT(ENDP1) & EP_DTOG_TX) ? 0 : 1;
+    uint16_t addr = buf ? ENDP1_ISO_TXADDR1 : ENDP1_ISO_TXADDR0;
+    int n = 0;
     
-    next_usb_last_packet = (usb_last_packet + 1) % ADC_SAMPLES_COUNT;
-    if (!is_triggered || !usb_tx_in_progress ||
-        next_usb_last_packet != usb_first_packet) { /* no overflow */
-        usb_last_packet = next_usb_last_packet;
-    }
+    usb_tx_in_progress -= iso_frame_packets[buf];
     
-    if (is_triggered && !usb_tx_in_progress)
-        schedule_transmission();
+    while (is_triggered && n < ADC_ISO_PACKETS_PER_FRAME && packets_to_send()) {
+        if (trig_event_pending) {
+            UserToPMABufferCopy(trig_event_packet, addr + n * sizeof(USBPacket), sizeof(USBPacket));
+            trig_event_pending = 0;
+            n++;
+            continue;
+        }
+        UserToPMABufferCopy(usb_packets[usb_first_packet], addr + n * sizeof(USBPacket), sizeof(USBPacket));
+        ring_pop();
+        n++;
+    }
+    if (paused && ring_free() >= OVERFLOW_RESUME_PACKETS)
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk; /* producer resumes */
+    if (buf)
+        SetEPDblBuf1Count(ENDP1, EP_DBUF_IN, n * sizeof(USBPacket));
+    else
+        SetEPDblBuf0Count(ENDP1, EP_DBUF_IN, n * sizeof(USBPacket));
+    iso_frame_packets[buf] = n;
+    usb_tx_in_progress += n;
 }
 
 void adc_on_packet_transmitted() {
     DBG_STR("packet_transmitted()");
-    adc_tx_total += samples_per_packet;
-    if (!is_triggered) {
-        usb_tx_in_progress = 0;
+    if (iso_mode) {
+        schedule_iso_frame();
         return;
     }
-    if (usb_last_packet != usb_first_packet)
-        schedule_transmission();
-    else
-        usb_tx_in_progress = 0;
-    if (usb_last_packet != usb_first_packet && !usb_tx_in_progress)
-        schedule_transmission();
+    if (usb_tx_in_progress > 0)
+        usb_tx_in_progress--;
+    if (!is_triggered)
+        return;
+    fill_ep1();
+    if (paused && ring_free() >= OVERFLOW_RESUME_PACKETS)
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk; /* producer resumes */
+}
+
+/* USB interrupt, after its events; sends what producer has published */
+void adc_usb_irq(void) {
+    if (!iso_mode)
+        fill_ep1();
 }
@@ -0,0 +1,204 @@
+#include "fft.h"
+
+/* Fixed-point FFT: Q15 values in 16 bits, each stage is scaled down only
+ * as much as its worst-case growth needs (block floating point), so small
+ * signals keep their resolution. Real input of N samples is transformed
+ * as N/2 complex ones (even samples are real parts), radix-4 stages go
+ * after a radix-2 one if log2(N/2) is odd.
+ */
+
+#define QUARTER         (FFT_SIZE_MAX / 4)
+/* outputs stay in 16 bits if inputs are below these */
+#define RADIX2_LIMIT    13500  /* 32767 / (1 + sqrt(2)) */
+#define RADIX4_LIMIT    6200  /* 32767 / (1 + 3 * sqrt(2)) */
+
+/* sin(2 * pi * i / FFT_SIZE_MAX) in Q15, quarter of period */
+static const int16_t sin_table[QUARTER + 1] = {
+        0,   201,   402,   603,   804,  1005,  1206,  1407,  1608,  1809,  2009,  2210,
+     2411,  2611,  2811,  3012,  3212,  3412,  3612,  3812,  4011,  4211,  4410,  4609,
+     4808,  5007,  5205,  5404,  5602,  5800,  5998,  6195,  6393,  6590,  6787,  6983,
+     7180,  7376,  7571,  7767,  7962,  8157,  8351,  8546,  8740,  8933,  9127,  9319,
+     9512,  9704,  9896, 10088, 10279, 10469, 10660, 10850, 11039, 11228, 11417, 11605,
+    11793, 11980, 12167, 12354, 12540, 12725, 12910, 13095, 13279, 13463, 13646, 13828,
+    14010, 14192, 14373, 14553, 14733, 14912, 15091, 15269, 15447, 15624, 15800, 15976,
+    16151, 16326, 16500, 16673, 16846, 17018, 17190, 17361, 17531, 17700, 17869, 18037,
+    18205, 18372, 18538, 18703, 18868, 19032, 19195, 19358, 19520, 19681, 19841, 20001,
+    20160, 20318, 20475, 20632, 20788, 20943, 21097, 21251, 21403, 21555, 21706, 21856,
+    22006, 22154, 22302, 22449, 22595, 22740, 22884, 23028, 23170, 23312, 23453, 23593,
+    23732, 23870, 24008, 24144, 24279, 24414, 24548, 24680, 24812, 24943, 25073, 25202,
+    25330, 25457, 25583, 25708, 25833, 25956, 26078, 26199, 26320, 26439, 26557, 26674,
+    26791, 26906, 27020, 27133, 27246, 27357, 27467, 27576, 27684, 27791, 27897, 28002,
+    28106, 28209, 28311, 28411, 28511, 28610, 28707, 28803, 28899, 28993, 29086, 29178,
+    29269, 29359, 29448, 29535, 29622, 29707, 29792, 29875, 29957, 30038, 30118, 30196,
+    30274, 30350, 30425, 30499, 30572, 30644, 30715, 30784, 30853, 30920, 30986, 31050,
+    31114, 31177, 31238, 31298, 31357, 31415, 31471, 31527, 31581, 31634, 31686, 31737,
+    31786, 31834, 31881, 31927, 31972, 32015, 32058, 32099, 32138, 32177, 32214, 32251,
+    32286, 32319, 32352, 32383, 32413, 32442, 32470, 32496, 32522, 32546, 32568, 32590,
+    32610, 32629, 32647, 32664, 32679, 32693, 32706, 32718, 32729, 32738, 32746, 32753,
+    32758, 32762, 32766, 32767, 32767
+};
+
+/* cos(2 * pi * i / FFT_SIZE_MAX) */
+static inline int32_t fft_cos(int i) {
+    i &= FFT_SIZE_MAX - 1;
+    if (i <= QUARTER)
+        return sin_table[QUARTER - i];
+    if (i <= 2 * QUARTER)
+        return -sin_table[i - QUARTER];
+    if (i <= 3 * QUARTER)
+        return -sin_table[3 * QUARTER - i];
+    return sin_table[i - 3 * QUARTER];
+}
+
+static inline int32_t fft_sin(int i) {
+    return fft_cos(i - QUARTER);
+}
+
+/* Right shift for values of `n` complex points so the next stage fits */
+static int stage_shift(const int16_t *z, int n, int32_t limit) {
+    int32_t max = 0;
+    int i, shift = 0;
+    for (i = 0; i < 2 * n; i++) {
+        int32_t v = z[i];
+        if (v < 0)
+            v = -v;
+        if (v > max)
+            max = v;
+    }
+    while ((max >> shift) >= limit)
+        shift++;
+    return shift;
+}
+
+static inline int16_t scale(int32_t v, int shift) {
+    return (int16_t)((v + ((1 << shift) >> 1)) >> shift);
+}
+
+static void bit_reverse(int16_t *z, int bits) {
+    int n = 1 << bits;
+    int i, j, b;
+    for (i = 0; i < n; i++) {
+        for (j = 0, b = 0; b < bits; b++)
+            j |= ((i >> b) & 1) << (bits - 1 - b);
+        if (j > i) {
+            int16_t re = z[2 * i], im = z[2 * i + 1];
+            z[2 * i] = z[2 * j];
+            z[2 * i + 1] = z[2 * j + 1];
+            z[2 * j] = re;
+            z[2 * j + 1] = im;
+        }
+    }
+}
+
+/* Decimation in time over bit-reversed input: sub-transforms of
+ * residues 0, 2, 1, 3 lie in this order before each radix-4 stage.
+ * Returns total right shift of the result.
+ */
+static int fft_complex(int16_t *z, int bits) {
+    int n = 1 << bits;
+    int len = 1;  /* size of sub-transforms done */
+    int total = 0, shift, j, k;
+    
+    bit_reverse(z, bits);
+    if (bits & 1) {
+        shift = stage_shift(z, n, RADIX2_LIMIT);
+        total += shift;
+        for (j = 0; j < 2 * n; j += 4) {
+            int32_t ar = z[j], ai = z[j + 1], br = z[j + 2], bi = z[j + 3];
+            z[j] = scale(ar + br, shift);
+            z[j + 1] = scale(ai + bi, shift);
+            z[j + 2] = scale(ar - br, shift);
+            z[j + 3] = scale(ai - bi, shift);
+        }
+        len = 2;
+    }
+    for (; len < n; len *= 4) {
+        int step = FFT_SIZE_MAX / (4 * len);  /* of W = exp(-2j * pi / (4 * len)) */
+        shift = stage_shift(z, n, RADIX4_LIMIT);
+        total += shift;
+        for (k = 0; k < len; k++) {
+            int32_t c1 = fft_cos(k * step), s1 = fft_sin(k * step);
+            int32_t c2 = fft_cos(2 * k * step), s2 = fft_sin(2 * k * step);
+            int32_t c3 = fft_cos(3 * k * step), s3 = fft_sin(3 * k * step);
+            for (j = k; j < n; j += 4 * len) {
+                int16_t *p0 = &z[2 * j], *p2 = &z[2 * (j + len)],
+                        *p1 = &z[2 * (j + 2 * len)], *p3 = &z[2 * (j + 3 * len)];
+                /* residue r times W^(r*k) */
+                int32_t a0r = p0[0], a0i = p0[1];
+                int32_t a1r = (p1[0] * c1 + p1[1] * s1) >> 15, a1i = (p1[1] * c1 - p1[0] * s1) >> 15;
+                int32_t a2r = (p2[0] * c2 + p2[1] * s2) >> 15, a2i = (p2[1] * c2 - p2[0] * s2) >> 15;
+                int32_t a3r = (p3[0] * c3 + p3[1] * s3) >> 15, a3i = (p3[1] * c3 - p3[0] * s3) >> 15;
+                int32_t sr = a0r + a2r, si = a0i + a2i;  /* residues 0 and 2 */
+                int32_t dr = a0r - a2r, di = a0i - a2i;
+                int32_t tr = a1r + a3r, ti = a1i + a3i;  /* residues 1 and 3 */
+                int32_t ur = a1r - a3r, ui = a1i - a3i;
+                /* output q goes to j + q * len */
+                p0[0] = scale(sr + tr, shift);
+                p0[1] = scale(si + ti, shift);
+                p2[0] = scale(dr + ui, shift);  /* -j * (a1 - a3) */
+                p2[1] = scale(di - ur, shift);
+                p1[0] = scale(sr - tr, shift);
+                p1[1] = scale(si - ti, shift);
+                p3[0] = scale(dr - ui, shift);
+                p3[1] = scale(di + ur, shift);
+            }
+        }
+    }
+    return total;
+}
+
+static uint32_t isqrt(uint32_t x) {
+    uint32_t r = 0, b = 1UL << 30;
+    while (b > x)
+        b >>= 2;
+    while (b) {
+        if (x >= r + b) {
+            x -= r + b;
+            r = (r >> 1) + b;
+        }
+        else
+            r >>= 1;
+        b >>= 2;
+    }
+    return r;
+}
+
+void fft_magnitudes(int16_t *buf, int bits, uint32_t *acc) {
+    int n = 1 << bits, half = n / 2;
+    int step = FFT_SIZE_MAX >> bits;  /* of exp(-2j * pi / n) */
+    int i, k, shift;
+    
+    for (i = 0; i < n; i++) {
+        int32_t x = ((int32_t)buf[i] - 0x800) << 4;
+        int32_t w = (0x8000 - fft_cos(i * step)) >> 1;  /* Hann */
+        buf[i] = (int16_t)((x * w) >> 15);
+    }
+    shift = fft_complex(buf, bits - 1);
+    
+    /* 2 * X[k] = E - j * W^k * O, where E and O are Z[k] + Z*[half - k]
+     * and Z[k] - Z*[half - k]
+     */
+    for (k = 0; k < half; k++) {
+        int m = (half - k) & (half - 1);
+        int32_t zr = buf[2 * k], zi = buf[2 * k + 1];
+        int32_t mr = buf[2 * m], mi = -buf[2 * m + 1];
+        int32_t evr = zr + mr, evi = zi + mi;
+        int32_t odr = zr - mr, odi = zi - mi;
+        int32_t c = fft_cos(k * step), s = fft_sin(k * step);
+        int32_t pr = (odr * c + odi * s) >> 15, pi = (odi * c - odr * s) >> 15;
+        int32_t xr = evr + pi, xi = evi - pr;
+        int fit = 0;
+        uint32_t mag;
+        if (xr < 0)
+            xr = -xr;
+        if (xi < 0)
+            xi = -xi;
+        while ((xr >> fit) > 46340 || (xi >> fit) > 46340)  /* squares sum in 32 bits */
+            fit++;
+        xr >>= fit;
+        xi >>= fit;
+        mag = isqrt((uint32_t)(xr * xr) + (uint32_t)(xi * xi)) << fit;
+        /* amplitude of sine is 4 / n of its bin with Hann window */
+        acc[k] += ((mag << (shift + 1)) + (1 << (bits - 1))) >> bits;
+    }
+}
@@ -88,6 +88,10 @@ int main() {
                 console_putnum(adc_tx_total, 10, 0);
                 console_putstr("; rx: ");
                 console_putnum(adc_rx_total, 10, 0);
+                console_putstr("; overruns: ");
+                console_putnum(adc_block_overruns, 10, 0);
+                console_putstr("; direct: ");
+                console_putnum(adc_direct_packets, 10, 0);
                 console_putstr("\r\n");
             }
             INF() {
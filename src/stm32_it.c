@@ -33,6 +33,7 @@ void DebugMon_Handler(void) {
 }
 
 void PendSV_Handler(void) {
+    adc_pack_irq();
 }
 
 void SysTick_Handler(void) {
@@ -40,6 +41,7 @@ void SysTick_Handler(void) {
 
 void USB_IRQ_HANDLER(void) {
     usbd_istr();
+    adc_usb_irq();
 }
 
 void CONSOLE_IRQ_HANDLER(void) {
@@ -49,3 +51,7 @@ void CONSOLE_IRQ_HANDLER(void) {
 void ADCDMA_IRQ_HANDLER(void) {
     adcdma_irq();
 }
+
+void ADC_IRQ_HANDLER(void) {
+    adc_irq();
+}
@@ -0,0 +1,81 @@
+#ifndef __HOST_H
+#define __HOST_H
+
+/* Host build of src/adc.c: firmware headers are used as they are, then
+ * core peripherals that adc.c touches directly are moved to memory of
+ * simulated hardware in mock.c. Must be included before adc.c.
+ */
+
+#include <stdint.h>
+#include "adc.h"
+#include "console.h"
+#include "fft.h"
+#include "led.h"
+#include "timer.h"
+
+extern SCB_Type host_scb;
+extern DWT_Type host_dwt;
+extern CoreDebug_Type host_core_debug;
+extern TIM_TypeDef host_tim1;
+extern DMA_Channel_TypeDef host_dma1_channel1;
+extern uint32_t host_pma[512 / 2];  /* 16-bit words at 32-bit stride, as on STM32F103 */
+
+#undef SCB
+#define SCB         (&host_scb)
+#undef DWT
+#define DWT         (&host_dwt)
+#undef CoreDebug
+#define CoreDebug   (&host_core_debug)
+#undef TIM1
+#define TIM1        (&host_tim1)
+#undef DMA1_Channel1
+#define DMA1_Channel1   (&host_dma1_channel1)
+#undef PMAAddr
+#define PMAAddr     ((uintptr_t)host_pma)
+
+/* NVIC of core_cm3.h writes registers, simulated one runs handlers that
+ * become pending and unmasked at once, by priority
+ */
+void host_nvic_enable(IRQn_Type irq);
+void host_nvic_disable(IRQn_Type irq);
+void host_nvic_set_pending(IRQn_Type irq);
+void host_nvic_clear_pending(IRQn_Type irq);
+void host_nvic_set_priority(IRQn_Type irq, uint32_t priority);
+#define NVIC_EnableIRQ          host_nvic_enable
+#define NVIC_DisableIRQ         host_nvic_disable
+#define NVIC_SetPendingIRQ      host_nvic_set_pending
+#define NVIC_ClearPendingIRQ    host_nvic_clear_pending
+#define NVIC_SetPriority        host_nvic_set_priority
+
+enum {
+    HOST_IRQ_DMA,
+    HOST_IRQ_USB,
+    HOST_IRQ_ADC,
+    HOST_IRQ_PENDSV,
+    HOST_IRQS
+};
+
+extern uint64_t host_ps;  /* simulated time, picoseconds */
+extern void (*host_preempt_hook)(void);  /* called where USB interrupt gets masked or unmasked, on timer reads and EP1 buffer writes */
+extern int host_irq_held[HOST_IRQS];  /* pending interrupt waits while set */
+void host_dispatch(void);
+void host_pend(int index);
+int host_irq_running(int index);
+
+extern uint16_t (*host_adc_source)(uint32_t conversion);
+extern uint32_t host_adc_conversions;
+extern uint32_t host_adc_awd_irqs;  /* times analog watchdog made ADC interrupt pending */
+int host_adc_running(void);
+uint32_t host_dma_transfers_left(void);
+void host_dma_partial(uint32_t n);
+uint32_t host_dma_run(void);
+void host_dma_raise(uint32_t flag);
+
+extern uint32_t host_usb_completed;
+extern uint32_t host_usb_overwrites;
+extern void (*host_usb_receive)(const uint8_t *packet, int length);
+int host_usb_pending(void);
+int host_usb_send(void);
+void host_usb_done(void);
+
+#endif /* __HOST_H */
@@ -0,0 +1,128 @@
+/* Packet ring under random interleaving: at every point where an
+ * interrupt may come in (see host_preempt_hook), host may read a packet,
+ * its USB interrupt coming as soon as priorities and masking allow, or
+ * DMA may complete a half. Whatever the order, no EP1 buffer may be
+ * handed over while USB still owns it, and every packet must arrive once
+ * and in order, as sim_check() sees it. Host reads at different rates,
+ * so the ring also overflows with both drop policies.
+ * Usage: interleave [-t ms] [-r rate]
+ */
+
+#include <unistd.h>
+#include "sim.h"
+
+static uint32_t preempt_rate = 3;  /* one preemption in that many points */
+static uint32_t preempt_seed = 1;
+static uint32_t preemptions = 0;
+static int in_preempt = 0;
+
+static void preempt(void) {
+    uint32_t r;
+    if (in_preempt) /* handlers it runs come here too */
+        return;
+    in_preempt = 1;
+    preempt_seed = sim_hash(preempt_seed);
+    r = preempt_seed;
+    if (r % preempt_rate == 0) {
+        if ((r >> 16) & 1) {
+            if (host_usb_send()) {
+                host_usb_done();
+                preemptions++;
+            }
+        }
+        /* the half after that one is being packed */
+        else if (host_adc_running() && block_queue_head == block_queue_tail &&
+                 !host_irq_running(HOST_IRQ_DMA)) {
+            host_dma_raise(host_dma_run());
+            preemptions++;
+        }
+    }
+    in_preempt = 0;
+}
+
+static const struct {
+    const char *name;
+    uint8_t bits, oversampling, frequency;
+    int channels;
+    uint8_t cmd;
+    int32_t trig_offset;
+} modes[] = {
+    {"12-bit",  ADC_BITS_HI,    0, ADC_FREQUENCY_MAX,    1, ADC_CMD_CONTINUOUS, 0},
+    {"8-bit",   ADC_BITS_MID,   0, ADC_FREQUENCY_200KHZ, 2, ADC_CMD_CONTINUOUS, 0},
+    {"dummy",   ADC_BITS_LO,    0, ADC_FREQUENCY_MAX,    3, ADC_CMD_CONTINUOUS, 0},
+    {"rice",    ADC_BITS_RICE,  0, ADC_FREQUENCY_MAX,    2, ADC_CMD_CONTINUOUS, 0},
+    {"sum 4",   ADC_BITS_HI,    1, ADC_FREQUENCY_MAX,    1, ADC_CMD_CONTINUOUS, 0},
+    {"raw",     ADC_BITS_RAW,   0, ADC_FREQUENCY_200KHZ, 2, ADC_CMD_CONTINUOUS, 0},
+    {"pretrig", ADC_BITS_HI,    0, ADC_FREQUENCY_MAX,    2, ADC_CMD_ONCE,       -500},
+    {"delay",   ADC_BITS_MID,   0, ADC_FREQUENCY_200KHZ, 1, ADC_CMD_ONCE,       300},
+};
+
+static const uint32_t usb_rates[] = {0, 10, 2};  /* packets/ms, 0 - as fast as USB allows */
+static const uint8_t policies[] = {ADC_OVERFLOW_DROP_NEWEST, ADC_OVERFLOW_DROP_OLDEST};
+
+int main(int argc, char **argv) {
+    uint32_t ms = 50;
+    int failed = 0;
+    unsigned m, u, p;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:r:")) != -1) {
+        switch (opt) {
+        case 't':
+            ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'r':
+            preempt_rate = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t ms] [-r rate]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    sim_init();
+    printf("mode    chans  usb/ms  overflow  preemptions  packets  gaps  overwrites  errors\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (u = 0; u < sizeof(usb_rates) / sizeof(usb_rates[0]); u++) {
+            for (p = 0; p < sizeof(policies); p++) {
+                uint32_t overwrites;
+                uint64_t bad;
+                regs.cmd = modes[m].cmd;
+                regs.bits = modes[m].bits;
+                regs.channels = (1 << modes[m].channels) - 1;
+                regs.frequency = modes[m].frequency;
+                regs.period = 0;
+                regs.samples = 18;
+                regs.oversampling = modes[m].oversampling;
+                regs.overflow = policies[p];
+                regs.trigger = (modes[m].cmd == ADC_CMD_ONCE) ? ADC_TRIGGER_RISING : ADC_TRIGGER_NONE;
+                regs.trig_channel = 0;
+                regs.trig_level = 0xc00;
+                regs.trig_offset = (uint32_t)modes[m].trig_offset;
+                sim_usb_packets_ms = usb_rates[u];
+                sim_restart();
+                overwrites = host_usb_overwrites;
+                preemptions = 0;
+                preempt_seed = 1 + m * 16 + u * 4 + p;
+                host_preempt_hook = preempt;
+                sim_run(ms * SIM_PS_PER_MS);
+                host_preempt_hook = NULL;
+                overwrites = host_usb_overwrites - overwrites;
+                bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered;
+                if (bad || overwrites || !sim_rx.checked)
+                    failed++;
+                printf("%-7s %5d %7u %9s %12u %8u %5u %11u %7llu\n",
+                       modes[m].name, modes[m].channels, usb_rates[u],
+                       policies[p] == ADC_OVERFLOW_DROP_OLDEST ? "oldest" : "newest",
+                       preemptions, sim_rx.data, sim_rx.gaps, overwrites, (unsigned long long)bad);
+            }
+        }
+    }
+    regs.oversampling = 0;
+    regs.overflow = ADC_OVERFLOW_DROP_NEWEST;
+    regs.trigger = ADC_TRIGGER_NONE;
+    regs.trig_offset = 0;
+    if (failed)
+        printf("%d setting(s) lost, duplicated or overwrote packets\n", failed);
+    return failed ? 1 : 0;
+}
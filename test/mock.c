@@ -0,0 +1,578 @@
+#include <string.h>
+#include "host.h"
+
+/* Simulated hardware behind the host build of adc.c: NVIC, DMA channel
+ * 1 fed by ADC conversions, analog watchdogs of ADC1 and ADC2, TIM1
+ * on/off, double-buffered EP1 of USB, and the library functions adc.c
+ * calls, which do nothing else.
+ */
+
+SCB_Type host_scb;
+DWT_Type host_dwt;
+CoreDebug_Type host_core_debug;
+TIM_TypeDef host_tim1;
+DMA_Channel_TypeDef host_dma1_channel1;
+uint32_t host_pma[512 / 2];
+
+uint32_t SystemCoreClock = 72000000;
+uint64_t host_ps = 0;
+void (*host_preempt_hook)(void) = NULL;
+
+uint32_t timer_usec(void) {
+    if (host_preempt_hook)
+        host_preempt_hook();
+    return (uint32_t)(host_ps / 1000000);
+}
+
+void timer_delay_usec(uint32_t dt) {
+    host_ps += (uint64_t)dt * 1000000;
+}
+
+/* NVIC: handler runs when it is pending, enabled, not held and of
+ * higher priority than what runs now
+ */
+static void host_usb_irq(void);
+
+static struct {
+    IRQn_Type irq;
+    void (*handler)(void);
+    int priority;
+    int pending;
+    int enabled;
+} host_irqs[] = {
+    [HOST_IRQ_DMA]    = { DMA1_Channel1_IRQn,     adcdma_irq,   ADCDMA_IRQ_PRIO, 0, 0 },
+    [HOST_IRQ_USB]    = { USB_LP_CAN1_RX0_IRQn,   host_usb_irq, USB_IRQ_PRIO,    0, 1 },
+    [HOST_IRQ_ADC]    = { ADC1_2_IRQn,            adc_irq,      ADCDMA_IRQ_PRIO, 0, 0 },
+    [HOST_IRQ_PENDSV] = { PendSV_IRQn,            adc_pack_irq, PACK_IRQ_PRIO,   0, 1 },
+};
+#define HOST_THREAD_PRIORITY    16
+static int host_level = HOST_THREAD_PRIORITY;
+int host_irq_held[HOST_IRQS];
+
+static int host_irq_index(IRQn_Type irq) {
+    int i;
+    for (i = 0; i < HOST_IRQS; i++) {
+        if (host_irqs[i].irq == irq)
+            return i;
+    }
+    return -1;
+}
+
+void host_dispatch(void) {
+    for (;;) {
+        int i, next = -1, level;
+        if (host_scb.ICSR & SCB_ICSR_PENDSVSET_Msk) {
+            host_scb.ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+            host_irqs[HOST_IRQ_PENDSV].pending = 1;
+        }
+        for (i = 0; i < HOST_IRQS; i++) {
+            if (host_irqs[i].pending && host_irqs[i].enabled && !host_irq_held[i] &&
+                host_irqs[i].priority < host_level &&
+                (next < 0 || host_irqs[i].priority < host_irqs[next].priority))
+                next = i;
+        }
+        if (next < 0)
+            return;
+        level = host_level;
+        host_level = host_irqs[next].priority;
+        host_irqs[next].pending = 0;
+        host_irqs[next].handler();
+        host_level = level;
+    }
+}
+
+int host_irq_running(int index) {
+    return host_level == host_irqs[index].priority;
+}
+
+void host_pend(int index) {
+    host_irqs[index].pending = 1;
+    host_dispatch();
+}
+
+void host_nvic_enable(IRQn_Type irq) {
+    int i = host_irq_index(irq);
+    if (i >= 0)
+        host_irqs[i].enabled = 1;
+    if (host_preempt_hook)
+        host_preempt_hook();
+    host_dispatch();
+}
+
+void host_nvic_disable(IRQn_Type irq) {
+    int i = host_irq_index(irq);
+    if (host_preempt_hook)
+        host_preempt_hook();
+    if (i >= 0)
+        host_irqs[i].enabled = 0;
+}
+
+void host_nvic_set_pending(IRQn_Type irq) {
+    int i = host_irq_index(irq);
+    if (i >= 0)
+        host_pend(i);
+}
+
+void host_nvic_clear_pending(IRQn_Type irq) {
+    int i = host_irq_index(irq);
+    if (i >= 0)
+        host_irqs[i].pending = 0;
+}
+
+/* priority group 2: two bits of preemption priority above two of subpriority */
+void host_nvic_set_priority(IRQn_Type irq, uint32_t priority) {
+    int i = host_irq_index(irq);
+    if (i >= 0)
+        host_irqs[i].priority = priority >> 2;
+}
+
+void NVIC_Init(NVIC_InitTypeDef *s) {
+    int i = host_irq_index((IRQn_Type)s->NVIC_IRQChannel);
+    if (i < 0)
+        return;
+    host_irqs[i].priority = s->NVIC_IRQChannelPreemptionPriority;
+    host_irqs[i].enabled = (s->NVIC_IRQChannelCmd == ENABLE);
+}
+
+void NVIC_PriorityGroupConfig(uint32_t group) {
+    (void)group;
+}
+
+/* DMA channel 1: the counter runs down from CNDTR as ADC conversions
+ * are stored, HT and TC flags are raised on the way
+ */
+static struct {
+    int enabled;
+    int word;
+    int circular;
+    uint32_t it;
+    uint32_t base;
+    uint16_t size;
+} host_dma;
+static uint32_t host_dma_flags = 0;
+uint16_t (*host_adc_source)(uint32_t conversion) = NULL;
+uint32_t host_adc_conversions = 0;
+static void host_adc_convert(uint32_t conversion, uint16_t value);
+static int host_tim1_enabled = 0;
+static int host_adc_continuous = 0;
+
+/* conversions are counted from DMA setup of acquisition */
+void DMA_DeInit(DMA_Channel_TypeDef *ch) {
+    memset(&host_dma, 0, sizeof(host_dma));
+    host_adc_conversions = 0;
+    memset(ch, 0, sizeof(*ch));
+    host_dma_flags = 0;
+}
+
+void DMA_Init(DMA_Channel_TypeDef *ch, DMA_InitTypeDef *s) {
+    host_dma.word = (s->DMA_MemoryDataSize == DMA_MemoryDataSize_Word);
+    host_dma.circular = (s->DMA_Mode == DMA_Mode_Circular);
+    ch->CMAR = s->DMA_MemoryBaseAddr;
+    ch->CNDTR = s->DMA_BufferSize;
+}
+
+void DMA_Cmd(DMA_Channel_TypeDef *ch, FunctionalState state) {
+    host_dma.enabled = (state == ENABLE);
+    if (host_dma.enabled) {
+        host_dma.base = ch->CMAR;
+        host_dma.size = ch->CNDTR;
+    }
+}
+
+void DMA_ITConfig(DMA_Channel_TypeDef *ch, uint32_t it, FunctionalState state) {
+    (void)ch;
+    if (state == ENABLE)
+        host_dma.it |= it;
+    else
+        host_dma.it &= ~it;
+}
+
+void DMA_SetCurrDataCounter(DMA_Channel_TypeDef *ch, uint16_t n) {
+    ch->CNDTR = n;
+}
+
+uint16_t DMA_GetCurrDataCounter(DMA_Channel_TypeDef *ch) {
+    return ch->CNDTR;
+}
+
+ITStatus DMA_GetITStatus(uint32_t it) {
+    return (host_dma_flags & it) ? SET : RESET;
+}
+
+void DMA_ClearITPendingBit(uint32_t it) {
+    if (it & DMA1_IT_GL1)
+        it |= DMA1_IT_TC1 | DMA1_IT_HT1 | DMA1_IT_TE1;
+    host_dma_flags &= ~it;
+}
+
+int host_adc_running(void) {
+    return host_dma.enabled && host_dma1_channel1.CNDTR &&
+           (host_tim1_enabled || host_adc_continuous);
+}
+
+/* Transfers left until the next HT or TC event */
+uint32_t host_dma_transfers_left(void) {
+    uint32_t n = host_dma1_channel1.CNDTR;
+    if (host_dma.circular && n > host_dma.size / 2)
+        n -= host_dma.size / 2;
+    return n;
+}
+
+/* Stores one transfer, returns HT or TC flag if it raises one */
+static uint32_t host_dma_transfer(void) {
+    DMA_Channel_TypeDef *ch = &host_dma1_channel1;
+    uint32_t index = host_dma.size - ch->CNDTR;
+    if (host_dma.word) {
+        uint16_t *dst = (uint16_t*)(uintptr_t)host_dma.base + index * 2;
+        dst[0] = host_adc_source(host_adc_conversions);
+        host_adc_convert(host_adc_conversions++, dst[0]);
+        dst[1] = host_adc_source(host_adc_conversions);
+        host_adc_convert(host_adc_conversions++, dst[1]);
+    }
+    else {
+        uint16_t *dst = (uint16_t*)(uintptr_t)host_dma.base + index;
+        dst[0] = host_adc_source(host_adc_conversions);
+        host_adc_convert(host_adc_conversions++, dst[0]);
+    }
+    if (--ch->CNDTR == host_dma.size / 2 && host_dma.circular)
+        return DMA1_IT_HT1;
+    if (ch->CNDTR == 0) {
+        if (host_dma.circular)
+            ch->CNDTR = host_dma.size;
+        return DMA1_IT_TC1;
+    }
+    return 0;
+}
+
+/* Stores up to `n` transfers, short of the next HT or TC event */
+void host_dma_partial(uint32_t n) {
+    uint32_t left = host_dma_transfers_left();
+    if (!host_adc_running())
+        return;
+    for (n = (n < left) ? n : left - 1; n; n--)
+        host_dma_transfer();
+}
+
+/* Stores conversions up to the next HT or TC event, returns its flag,
+ * 0 if DMA doesn't run
+ */
+uint32_t host_dma_run(void) {
+    if (!host_adc_running())
+        return 0;
+    for (;;) {
+        uint32_t flag = host_dma_transfer();
+        if (flag)
+            return flag;
+    }
+}
+
+/* Raises event of host_dma_run(), DMA interrupt runs if it is enabled */
+void host_dma_raise(uint32_t flag) {
+    if (!flag)
+        return;
+    host_dma_flags |= flag | DMA1_IT_GL1;
+    if (host_dma.it & flag)
+        host_pend(HOST_IRQ_DMA);
+}
+
+/* ADC1 and ADC2: regular sequences, so that each conversion DMA stores
+ * is known to come from a given ADC and channel, and analog watchdog on
+ * a single regular channel. AWD flag is set by every conversion of the
+ * channel beyond thresholds, ADC interrupt is pending while a flag is
+ * set with its interrupt enabled.
+ */
+static struct {
+    uint8_t sequence[16];
+    uint8_t length;
+    uint8_t it;  /* enable bits of CR1 */
+    uint8_t flags;  /* SR */
+    int awd;
+    uint8_t awd_channel;
+    uint16_t awd_hi, awd_lo;
+} host_adcs[2];
+uint32_t host_adc_awd_irqs = 0;
+
+static int host_adc_index(ADC_TypeDef *adc) {
+    return (adc == ADC2) ? 1 : 0;
+}
+
+static void host_adc_check_irq(void) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (host_adcs[i].flags & (ADC_IT_AWD >> 8) && host_adcs[i].it & (uint8_t)ADC_IT_AWD) {
+            if (!host_irqs[HOST_IRQ_ADC].pending)
+                host_adc_awd_irqs++;
+            host_pend(HOST_IRQ_ADC);
+            return;
+        }
+    }
+}
+
+/* word-sized DMA transfers carry ADC1 conversion in lower halfword and
+ * ADC2 one in upper halfword, both of the same rank
+ */
+static void host_adc_convert(uint32_t conversion, uint16_t value) {
+    int i = host_dma.word ? (conversion & 1) : 0;
+    uint32_t rank = host_dma.word ? conversion / 2 : conversion;
+    if (!host_adcs[i].awd || !host_adcs[i].length ||
+        host_adcs[i].sequence[rank % host_adcs[i].length] != host_adcs[i].awd_channel)
+        return;
+    if (value > host_adcs[i].awd_hi || value < host_adcs[i].awd_lo) {
+        host_adcs[i].flags |= ADC_IT_AWD >> 8;
+        host_adc_check_irq();
+    }
+}
+
+void ADC_Init(ADC_TypeDef *adc, ADC_InitTypeDef *s) {
+    host_adcs[host_adc_index(adc)].length = s->ADC_NbrOfChannel;
+}
+
+void ADC_RegularChannelConfig(ADC_TypeDef *adc, uint8_t ch, uint8_t rank, uint8_t time) {
+    (void)time;
+    host_adcs[host_adc_index(adc)].sequence[(rank - 1) & 15] = ch;
+}
+
+void ADC_ITConfig(ADC_TypeDef *adc, uint16_t it, FunctionalState state) {
+    int i = host_adc_index(adc);
+    if (state == ENABLE) {
+        host_adcs[i].it |= (uint8_t)it;
+        host_adc_check_irq();
+    }
+    else
+        host_adcs[i].it &= ~(uint8_t)it;
+}
+
+ITStatus ADC_GetITStatus(ADC_TypeDef *adc, uint16_t it) {
+    int i = host_adc_index(adc);
+    return (host_adcs[i].flags & (it >> 8) && host_adcs[i].it & (uint8_t)it) ? SET : RESET;
+}
+
+void ADC_ClearITPendingBit(ADC_TypeDef *adc, uint16_t it) {
+    host_adcs[host_adc_index(adc)].flags &= ~(it >> 8);
+}
+
+void ADC_AnalogWatchdogCmd(ADC_TypeDef *adc, uint32_t awd) {
+    host_adcs[host_adc_index(adc)].awd = (awd == ADC_AnalogWatchdog_SingleRegEnable);
+}
+
+void ADC_AnalogWatchdogSingleChannelConfig(ADC_TypeDef *adc, uint8_t ch) {
+    host_adcs[host_adc_index(adc)].awd_channel = ch;
+}
+
+void ADC_AnalogWatchdogThresholdsConfig(ADC_TypeDef *adc, uint16_t hi, uint16_t lo) {
+    int i = host_adc_index(adc);
+    host_adcs[i].awd_hi = hi;
+    host_adcs[i].awd_lo = lo;
+}
+
+void TIM_Cmd(TIM_TypeDef *tim, FunctionalState state) {
+    if (state == ENABLE)
+        tim->CR1 |= TIM_CR1_CEN;
+    else
+        tim->CR1 &= ~TIM_CR1_CEN;
+    if (tim == TIM1)
+        host_tim1_enabled = (state == ENABLE);
+}
+
+/* Single: TIM1 runs to the end of its period at once, i.e. the scan of
+ * channels it has started is completed, and stops
+ */
+void TIM_SelectOnePulseMode(TIM_TypeDef *tim, uint16_t mode) {
+    uint32_t period = host_dma.word ? 2 * host_adcs[0].length : host_adcs[0].length;
+    if (mode != TIM_OPMode_Single || tim != TIM1 || !host_tim1_enabled)
+        return;
+    while (period && host_adc_running() && host_adc_conversions % period)
+        host_dma_raise(host_dma_transfer());
+    TIM_Cmd(tim, DISABLE);
+}
+
+void TIM_PrescalerConfig(TIM_TypeDef *tim, uint16_t prescaler, uint16_t mode) {
+    (void)mode;
+    tim->PSC = prescaler;
+}
+
+void TIM_DeInit(TIM_TypeDef *tim) {
+    memset(tim, 0, sizeof(*tim));
+    if (tim == TIM1)
+        host_tim1_enabled = 0;
+}
+
+void TIM_TimeBaseInit(TIM_TypeDef *tim, TIM_TimeBaseInitTypeDef *s) {
+    tim->ARR = s->TIM_Period;
+    tim->PSC = s->TIM_Prescaler;
+}
+
+void TIM_SetAutoreload(TIM_TypeDef *tim, uint16_t value) {
+    tim->ARR = value;
+}
+
+void TIM_OC1Init(TIM_TypeDef *tim, TIM_OCInitTypeDef *s) { (void)tim; (void)s; }
+void TIM_CtrlPWMOutputs(TIM_TypeDef *tim, FunctionalState state) { (void)tim; (void)state; }
+void TIM_SelectOutputTrigger(TIM_TypeDef *tim, uint16_t source) { (void)tim; (void)source; }
+
+void ADC_Cmd(ADC_TypeDef *adc, FunctionalState state) {
+    if (adc == ADC1 && state == DISABLE)
+        host_adc_continuous = 0;
+}
+
+void ADC_SoftwareStartConvCmd(ADC_TypeDef *adc, FunctionalState state) {
+    if (adc == ADC1)
+        host_adc_continuous = (state == ENABLE);
+}
+
+FlagStatus ADC_GetCalibrationStatus(ADC_TypeDef *adc) { (void)adc; return RESET; }
+FlagStatus ADC_GetResetCalibrationStatus(ADC_TypeDef *adc) { (void)adc; return RESET; }
+uint16_t ADC_GetConversionValue(ADC_TypeDef *adc) { (void)adc; return 0; }
+uint16_t ADC_GetInjectedConversionValue(ADC_TypeDef *adc, uint8_t ch) { (void)adc; (void)ch; return 0; }
+void ADC_ClearFlag(ADC_TypeDef *adc, uint8_t flag) { (void)adc; (void)flag; }
+void ADC_DMACmd(ADC_TypeDef *adc, FunctionalState state) { (void)adc; (void)state; }
+void ADC_ExternalTrigConvCmd(ADC_TypeDef *adc, FunctionalState state) { (void)adc; (void)state; }
+void ADC_ExternalTrigInjectedConvCmd(ADC_TypeDef *adc, FunctionalState state) { (void)adc; (void)state; }
+void ADC_ExternalTrigInjectedConvConfig(ADC_TypeDef *adc, uint32_t trig) { (void)adc; (void)trig; }
+void ADC_InjectedChannelConfig(ADC_TypeDef *adc, uint8_t ch, uint8_t rank, uint8_t time) { (void)adc; (void)ch; (void)rank; (void)time; }
+void ADC_InjectedSequencerLengthConfig(ADC_TypeDef *adc, uint8_t n) { (void)adc; (void)n; }
+void ADC_ResetCalibration(ADC_TypeDef *adc) { (void)adc; }
+void ADC_StartCalibration(ADC_TypeDef *adc) { (void)adc; }
+void ADC_TempSensorVrefintCmd(FunctionalState state) { (void)state; }
+
+/* EP1 IN, double-buffered: application fills the buffer DTOG_RX (SW_BUF)
+ * points to and FreeUserBuffer() hands it over; USB sends buffers in
+ * turn, starting at DTOG_TX. Contents are taken from PMA when sent.
+ */
+static struct {
+    uint16_t addr[2];
+    uint16_t count[2];
+    int full[2];
+    int sw_buf;
+    int hw_buf;
+} host_ep1;
+uint32_t host_usb_completed = 0;  /* sent, EP1_IN_Callback() not called yet */
+uint32_t host_usb_overwrites = 0;  /* buffers handed over while USB still owned them */
+void (*host_usb_receive)(const uint8_t *packet, int length) = NULL;
+
+static DEVICE_INFO host_device_info;
+DEVICE_INFO *pInformation = &host_device_info;
+
+static void host_usb_irq(void) {
+    while (host_usb_completed) {
+        host_usb_completed--;
+        adc_on_packet_transmitted();
+    }
+    adc_usb_irq();
+}
+
+int host_usb_pending(void) {
+    return host_ep1.full[host_ep1.hw_buf];
+}
+
+/* Host reads one packet: the buffer at DTOG_TX goes out, USB interrupt
+ * comes with host_usb_done()
+ */
+int host_usb_send(void) {
+    int buf = host_ep1.hw_buf;
+    uint8_t packet[64];
+    int i;
+    if (!host_ep1.full[buf])
+        return 0;
+    for (i = 0; i < host_ep1.count[buf]; i += 2) {
+        uint16_t word = (uint16_t)host_pma[host_ep1.addr[buf] / 2 + i / 2];
+        packet[i] = (uint8_t)word;
+        packet[i + 1] = (uint8_t)(word >> 8);
+    }
+    host_ep1.full[buf] = 0;
+    host_ep1.hw_buf ^= 1;
+    if (host_usb_receive)
+        host_usb_receive(packet, host_ep1.count[buf]);
+    host_usb_completed++;
+    return 1;
+}
+
+/* USB interrupt for packets sent */
+void host_usb_done(void) {
+    host_pend(HOST_IRQ_USB);
+}
+
+uint16_t GetENDPOINT(uint8_t ep) {
+    if (ep != ENDP1)
+        return 0;
+    return (host_ep1.sw_buf ? EP_DTOG_RX : 0) | (host_ep1.hw_buf ? EP_DTOG_TX : 0);
+}
+
+void ClearDTOG_RX(uint8_t ep) {
+    if (ep == ENDP1)
+        host_ep1.sw_buf = 0;
+}
+
+void ClearDTOG_TX(uint8_t ep) {
+    if (ep == ENDP1) {
+        host_ep1.hw_buf = 0;
+        host_ep1.full[0] = host_ep1.full[1] = 0;
+        host_usb_completed = 0;
+    }
+}
+
+void SetEPDblBuffAddr(uint8_t ep, uint16_t addr0, uint16_t addr1) {
+    if (ep == ENDP1) {
+        host_ep1.addr[0] = addr0;
+        host_ep1.addr[1] = addr1;
+    }
+}
+
+void SetEPDblBuf0Count(uint8_t ep, uint8_t dir, uint16_t count) {
+    (void)dir;
+    if (ep == ENDP1)
+        host_ep1.count[0] = count;
+}
+
+void SetEPDblBuf1Count(uint8_t ep, uint8_t dir, uint16_t count) {
+    (void)dir;
+    if (ep == ENDP1)
+        host_ep1.count[1] = count;
+}
+
+void FreeUserBuffer(uint8_t ep, uint8_t dir) {
+    (void)dir;
+    if (ep != ENDP1)
+        return;
+    if (host_preempt_hook)
+        host_preempt_hook();
+    if (host_ep1.full[host_ep1.sw_buf])
+        host_usb_overwrites++;
+    host_ep1.full[host_ep1.sw_buf] = 1;
+    host_ep1.sw_buf ^= 1;
+}
+
+void UserToPMABufferCopy(uint8_t *src, uint16_t addr, uint16_t n) {
+    uint16_t i;
+    if (host_preempt_hook)
+        host_preempt_hook();
+    for (i = 0; i < n; i += 2)
+        host_pma[addr / 2 + i / 2] = src[i] | (i + 1 < n ? src[i + 1] << 8 : 0);
+}
+
+void SetEPDblBuffCount(uint8_t ep, uint8_t dir, uint16_t count) { (void)ep; (void)dir; (void)count; }
+void SetEPDoubleBuff(uint8_t ep) { (void)ep; }
+void ClearEPDoubleBuff(uint8_t ep) { (void)ep; }
+void Clear_Status_Out(uint8_t ep) { (void)ep; }
+void SetBTABLE(uint16_t value) { (void)value; }
+void SetDeviceAddress(uint8_t addr) { (void)addr; }
+void SetEPRxAddr(uint8_t ep, uint16_t addr) { (void)ep; (void)addr; }
+void SetEPRxCount(uint8_t ep, uint16_t count) { (void)ep; (void)count; }
+void SetEPRxStatus(uint8_t ep, uint16_t state) { (void)ep; (void)state; }
+void SetEPRxValid(uint8_t ep) { (void)ep; }
+void SetEPTxAddr(uint8_t ep, uint16_t addr) { (void)ep; (void)addr; }
+void SetEPTxStatus(uint8_t ep, uint16_t state) { (void)ep; (void)state; }
+void SetEPType(uint8_t ep, uint16_t type) { (void)ep; (void)type; }
+void NOP_Process(void) {}
+uint8_t *Standard_GetDescriptorData(uint16_t length, PONE_DESCRIPTOR desc) { (void)length; (void)desc; return NULL; }
+uint32_t USB_SIL_Init(void) { return 0; }
+RESULT usbd_power_on(void) { return USB_SUCCESS; }
+
+void led_set_period(uint32_t period_usec) { (void)period_usec; }
+
+/* console is quiet */
+int console_start_record(int level, uint32_t min_space_in_txbuf) { (void)level; (void)min_space_in_txbuf; return 0; }
+void console_flush_from_it(void) {}
+void console_putstr(const char *s) { (void)s; }
+void console_putnum(uint32_t value, int base, uint32_t min_width) { (void)value; (void)base; (void)min_width; }
+void console_putasc(const char *buf, char delimiter, uint32_t nbytes) { (void)buf; (void)delimiter; (void)nbytes; }
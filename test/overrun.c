@@ -0,0 +1,108 @@
+/* Block overruns: PendSV is held off at random for up to `-l` DMA
+ * interrupts, as if higher priority work took that long, so DMA refills
+ * halves before they are packed. Every dropped half must come out as a
+ * gap of the right length: no sample after it may be duplicated, lost
+ * or shifted (sim_check()), in plain, dummy conversion, Rice coding and
+ * oversampling modes.
+ * Usage: overrun [-t ms] [-l blocks]
+ */
+
+#include <unistd.h>
+#include "sim.h"
+
+static uint32_t hold_max = 8;
+static uint32_t hold_until = 0;  /* dma_irqs */
+static uint32_t hold_seed = 1;
+
+static void hold_pendsv(void) {
+    hold_seed = sim_hash(hold_seed);
+    if (host_irq_held[HOST_IRQ_PENDSV]) {
+        if ((int32_t)(dma_irqs - hold_until) >= 0) {
+            host_irq_held[HOST_IRQ_PENDSV] = 0;
+            host_dispatch();
+        }
+    }
+    else if (hold_seed % 16 == 0) {
+        hold_until = dma_irqs + 1 + (hold_seed >> 8) % hold_max;
+        host_irq_held[HOST_IRQ_PENDSV] = 1;
+    }
+}
+
+static const struct {
+    const char *name;
+    uint8_t bits, oversampling;
+    int channels;
+} modes[] = {
+    {"12-bit",  ADC_BITS_HI,      0, 1},
+    {"12-bit",  ADC_BITS_HI,      0, 2},
+    {"8-bit",   ADC_BITS_MID,     0, 4},
+    {"dummy",   ADC_BITS_HI,      0, 3},
+    {"dummy",   ADC_BITS_LO,      0, 5},
+    {"rice",    ADC_BITS_RICE,    0, 1},
+    {"rice",    ADC_BITS_RICE,    0, 3},
+    {"sum 4",   ADC_BITS_HI,      1, 1},
+    {"sum 16",  ADC_BITS_HI,      2, 3},
+};
+
+static const uint8_t frequencies[] = {ADC_FREQUENCY_MAX, ADC_FREQUENCY_200KHZ};
+
+int main(int argc, char **argv) {
+    uint32_t ms = 100;
+    int failed = 0;
+    unsigned m, f;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:l:")) != -1) {
+        switch (opt) {
+        case 't':
+            ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'l':
+            hold_max = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t ms] [-l blocks]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    sim_init();
+    sim_usb_packets_ms = 0;  /* ring doesn't overflow, gaps are of overruns */
+    printf("mode    chans  frequency  overruns  gaps  gap periods  checked  errors\n");
+    for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        for (f = 0; f < sizeof(frequencies); f++) {
+            uint32_t overruns;
+            uint64_t bad;
+            regs.cmd = ADC_CMD_CONTINUOUS;
+            regs.bits = modes[m].bits;
+            regs.channels = (1 << modes[m].channels) - 1;
+            regs.frequency = frequencies[f];
+            regs.period = 0;
+            regs.trigger = ADC_TRIGGER_NONE;
+            regs.samples = 18;
+            regs.oversampling = modes[m].oversampling;
+            sim_restart();
+            sim_run(5 * SIM_PS_PER_MS);  /* drops before capture start need no gap */
+            overruns = adc_block_overruns;
+            hold_seed = 1 + m * 16 + f;
+            sim_tick = hold_pendsv;
+            sim_run(ms * SIM_PS_PER_MS);
+            sim_tick = NULL;
+            host_irq_held[HOST_IRQ_PENDSV] = 0;
+            host_dispatch();
+            sim_run(10 * SIM_PS_PER_MS);  /* the last gap gets out */
+            overruns = adc_block_overruns - overruns;
+            bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered;
+            if (bad || !overruns || !sim_rx.gaps || !sim_rx.checked)
+                failed++;
+            printf("%-7s %5d %10d %9u %5u %12llu %8llu %7llu\n",
+                   modes[m].name, modes[m].channels, frequencies[f], overruns, sim_rx.gaps,
+                   (unsigned long long)sim_rx.gap_periods, (unsigned long long)sim_rx.checked,
+                   (unsigned long long)bad);
+        }
+    }
+    regs.oversampling = 0;
+    if (failed)
+        printf("%d setting(s) lost or duplicated samples on overruns\n", failed);
+    return failed ? 1 : 0;
+}
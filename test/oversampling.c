@@ -0,0 +1,73 @@
+/* OVERSAMPLING and PEAK: each output value of acquisition must equal
+ * the reference one, sum of 4^k conversions >> k or their min and max
+ * (sim_expected()), for every channel and position, also across ring
+ * overflow gaps at the maximum rate.
+ * Usage: oversampling [-t ms]
+ */
+
+#include <unistd.h>
+#include "sim.h"
+
+/* full scale steps and noise, sums reach their maximum */
+static uint16_t wave_extremes(uint32_t index) {
+    uint32_t h = sim_hash(index);
+    return ((index >> 12) & 1) ? ((h & 3) ? 0xfff : 0) : (h & 0xfff);
+}
+
+static const int channel_counts[] = {1, 2, 3, 5, 10};
+static const uint8_t frequencies[] = {ADC_FREQUENCY_MAX, ADC_FREQUENCY_200KHZ, ADC_FREQUENCY_20KHZ};
+
+int main(int argc, char **argv) {
+    uint32_t ms = 100;
+    int failed = 0;
+    int peak, k, opt;
+    unsigned c, f;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't') {
+            fprintf(stderr, "usage: %s [-t ms]\n", argv[0]);
+            return 2;
+        }
+        ms = strtoul(optarg, NULL, 0);
+    }
+
+    sim_init();
+    sim_signal = wave_extremes;
+    printf("mode k  chans  frequency  outputs  gaps  errors\n");
+    for (peak = 0; peak < 2; peak++) {
+        for (k = 1; k <= (peak ? ADC_PEAK_MAX : ADC_OVERSAMPLING_MAX); k++) {
+            uint64_t checked = 0;
+            for (c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+                for (f = 0; f < sizeof(frequencies); f++) {
+                    uint64_t bad;
+                    regs.cmd = ADC_CMD_CONTINUOUS;
+                    regs.bits = ADC_BITS_HI;
+                    regs.channels = (1 << channel_counts[c]) - 1;
+                    regs.frequency = frequencies[f];
+                    regs.period = 0;
+                    regs.trigger = ADC_TRIGGER_NONE;
+                    regs.samples = 18;
+                    regs.oversampling = peak ? 0 : k;
+                    regs.peak = peak ? k : 0;
+                    sim_restart();
+                    sim_run(ms * SIM_PS_PER_MS);
+                    bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered;
+                    if (bad)
+                        failed++;
+                    checked += sim_rx.checked;
+                    printf("%-4s %d %6d %10d %8llu %5u %7llu\n",
+                           peak ? "peak" : "sum", k, channel_counts[c], frequencies[f],
+                           (unsigned long long)sim_rx.checked, sim_rx.gaps, (unsigned long long)bad);
+                }
+            }
+            if (!checked) {
+                printf("no output with k = %d\n", k);
+                failed++;
+            }
+        }
+    }
+    regs.oversampling = regs.peak = 0;
+    if (failed)
+        printf("%d setting(s) differ from reference\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,173 @@
+/* Packing kernels against the packing code they replaced (switch on mode
+ * in DMA interrupt, with swap pass for fast interleaved mode): output
+ * must be bit-identical for every bits/scaling/order combination, into
+ * RAM and into packet memory. Then host time per packet of each, and of
+ * the two send paths: packing into RAM and copying it to packet memory
+ * (ring) against packing straight into packet memory (direct).
+ * Usage: pack_kernels [-n packets]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+#include "../src/adc.c"
+
+static const uint8_t kernel_bits[4] = {ADC_BITS_DIGITAL, ADC_BITS_LO, ADC_BITS_MID, ADC_BITS_HI};
+
+/* as adcdma_irq() packed one packet before kernels */
+static void ref_pack(uint8_t bits, uint16_t offset, uint8_t gain, int swapped,
+                     const uint16_t *src, uint8_t *pBody, uint32_t samples_per_packet) {
+    static uint16_t swapped_src[ADC_SAMPLE_SIZE * 4];
+    uint32_t i;
+    if (swapped) {
+        const uint32_t *src_u32 = (const uint32_t*)src;
+        uint32_t *dst_u32 = (uint32_t*)swapped_src;
+        for (i = 0; i < samples_per_packet; i += 2) {
+            *(dst_u32++) = (src_u32[0] >> 16) | (src_u32[0] << 16);
+            src_u32++;
+        }
+        src = &swapped_src[0];
+    }
+    switch (bits) {
+    case ADC_BITS_DIGITAL:
+        for (i = 0; i < samples_per_packet; i += 4) {
+            uint32_t v1 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v2 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v3 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v4 = ((uint32_t)(*(src++)) - offset) << gain;
+            *(pBody++) = (uint8_t)(((v1 >>  4) & 0xc0) |
+                                   ((v2 >>  6) & 0x30) |
+                                   ((v3 >>  8) & 0x0c) |
+                                   ((v4 >> 10) & 0x03) );
+        }
+        break;
+    case ADC_BITS_LO:
+        for (i = 0; i < samples_per_packet; i += 2) {
+            uint32_t v1 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v2 = ((uint32_t)(*(src++)) - offset) << gain;
+            *(pBody++) = (uint8_t)(((v1 >> 4) & 0xf0) | ((v2 >> 8) & 0x0f));
+        }
+        break;
+    case ADC_BITS_MID:
+        for (i = 0; i < samples_per_packet; i += 2) {
+            uint32_t v1 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v2 = ((uint32_t)(*(src++)) - offset) << gain;
+            *(pBody++) = (uint8_t)(v1 >> 4);
+            *(pBody++) = (uint8_t)(v2 >> 4);
+        }
+        break;
+    case ADC_BITS_HI:
+        for (i = 0; i < samples_per_packet; i += 2) {
+            uint32_t v1 = ((uint32_t)(*(src++)) - offset) << gain;
+            uint32_t v2 = ((uint32_t)(*(src++)) - offset) << gain;
+            *(pBody++) = (uint8_t)(v1 >> 4);
+            *(pBody++) = (uint8_t)(((v1 << 4) & 0xf0) | (v2 & 0x0f));
+            *(pBody++) = (uint8_t)(v2 >> 4);
+        }
+        break;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static uint16_t src[ADC_SAMPLE_SIZE * 4] __attribute__((aligned(4)));
+    static uint32_t pma[ADC_SAMPLE_SIZE / 2];
+    static USBPacket packet __attribute__((aligned(4)));
+    uint8_t ref[ADC_SAMPLE_SIZE], out[ADC_SAMPLE_SIZE];
+    volatile uint8_t sink = 0;
+    uint32_t packets = 200000;
+    int failed = 0;
+    int b, scaled, swapped, opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "usage: %s [-n packets]\n", argv[0]);
+            return 2;
+        }
+        packets = strtoul(optarg, NULL, 0);
+    }
+
+    srand(1);
+    printf("bits scaled swapped  ns/packet: old  kernel  speedup   ring  direct\n");
+    for (b = 0; b < 4; b++) {
+        uint32_t nsamples = ADC_SAMPLE_SIZE * 8 / kernel_bits[b];
+        for (scaled = 0; scaled < 2; scaled++) {
+            for (swapped = 0; swapped < 2; swapped++) {
+                PackKernel kernel = pack_kernels[b][scaled][swapped];
+                PMAPackKernel pma_kernel = pma_pack_kernels[b][scaled][swapped];
+                uint16_t offset = 0;
+                uint8_t gain = 0;
+                uint64_t t0, t_ref, t_kernel, t_pma, t_ring;
+                uint32_t n, i;
+                int trial, bad = 0;
+
+                for (trial = 0; trial < 2000; trial++) {
+                    for (i = 0; i < nsamples; i++)
+                        src[i] = rand() & 0xfff;
+                    if (scaled) {
+                        offset = rand() & 0xfff;
+                        gain = rand() % 5;
+                    }
+                    pack_offset = offset;
+                    pack_gain = gain;
+                    ref_pack(kernel_bits[b], offset, gain, swapped, src, ref, nsamples);
+                    memset(out, 0x5a, sizeof(out));
+                    kernel((const uint32_t*)src, out, nsamples);
+                    memset(pma, 0xa5, sizeof(pma));
+                    pma_kernel((const uint32_t*)src, pma, nsamples);
+                    if (memcmp(ref, out, ADC_SAMPLE_SIZE))
+                        bad++;
+                    for (i = 0; i < ADC_SAMPLE_SIZE / 2; i++)
+                        if (pma[i] != (uint32_t)(ref[2 * i] | ref[2 * i + 1] << 8))
+                            break;
+                    if (i < ADC_SAMPLE_SIZE / 2)
+                        bad++;
+                }
+
+                t0 = now_ns();
+                for (n = 0; n < packets; n++) {
+                    ref_pack(kernel_bits[b], offset, gain, swapped, src, ref, nsamples);
+                    sink ^= ref[n % ADC_SAMPLE_SIZE];
+                }
+                t_ref = now_ns() - t0;
+                t0 = now_ns();
+                for (n = 0; n < packets; n++) {
+                    kernel((const uint32_t*)src, out, nsamples);
+                    sink ^= out[n % ADC_SAMPLE_SIZE];
+                }
+                t_kernel = now_ns() - t0;
+                t0 = now_ns();
+                for (n = 0; n < packets; n++)
+                    pma_kernel((const uint32_t*)src, pma, nsamples);
+                t_pma = now_ns() - t0;
+                t0 = now_ns();
+                for (n = 0; n < packets; n++) {  /* as USB interrupt sends it from ring */
+                    kernel((const uint32_t*)src, packet + sizeof(ADCPacketHeader), nsamples);
+                    UserToPMABufferCopy(packet, ENDP1_TXADDR0, sizeof(USBPacket));
+                }
+                t_ring = now_ns() - t0;
+
+                printf("%4d %6d %7d %15.1f %7.1f %7.2fx %6.1f %7.1f%s\n",
+                       kernel_bits[b], scaled, swapped,
+                       (double)t_ref / packets, (double)t_kernel / packets,
+                       t_kernel ? (double)t_ref / t_kernel : 0.0,
+                       (double)t_ring / packets, (double)t_pma / packets,
+                       bad ? "  MISMATCH" : "");
+                if (bad)
+                    failed++;
+            }
+        }
+    }
+    (void)sink;
+    if (failed)
+        printf("%d kernel(s) differ from old packing\n", failed);
+    return failed ? 1 : 0;
+}
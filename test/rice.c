@@ -0,0 +1,119 @@
+/* Delta + Rice coding (BITS = 1) round trip: waveforms typical for the
+ * device go through acquisition and packing in adc.c, packets are
+ * decoded as plot_adc.py does, every value must come back exactly.
+ * Prints samples per packet against 40 of plain 12-bit packing and host
+ * time of interrupt handlers per sample.
+ * Usage: rice [-t ms]
+ */
+
+#include <math.h>
+#include <unistd.h>
+#include "sim.h"
+
+static int wave_channels = 1;
+
+static uint16_t clamp12(double v) {
+    return (v < 0) ? 0 : (v > 0xfff) ? 0xfff : (uint16_t)v;
+}
+
+/* a few LSB of noise, as ADC gives on a quiet input */
+static int lsb_noise(uint32_t index, int lsb) {
+    return (int)(sim_hash(index ^ 0x9e3779b9) % (2 * lsb + 1)) - lsb;
+}
+
+static uint16_t wave_dc(uint32_t index) {
+    return clamp12(1500 + 300 * (index % wave_channels) + lsb_noise(index, 1));
+}
+
+static uint16_t wave_sine(uint32_t index) {
+    uint32_t period = index / wave_channels, ch = index % wave_channels;
+    return clamp12(2048 + 1800 * sin(2 * M_PI * period / 400.0 + ch) + lsb_noise(index, 2));
+}
+
+static uint16_t wave_square(uint32_t index) {
+    uint32_t period = index / wave_channels;
+    return clamp12(((period / 150) & 1 ? 3300 : 600) + lsb_noise(index, 2));
+}
+
+static uint16_t wave_ramp(uint32_t index) {
+    uint32_t period = index / wave_channels;
+    return clamp12((period * 3) % 4096 + lsb_noise(index, 1));
+}
+
+static uint16_t wave_walk(uint32_t index) {
+    /* random walk, restarted so that any index is computed quickly */
+    uint32_t period = index / wave_channels, ch = index % wave_channels;
+    uint32_t i, start = period & ~63U;
+    int v = 2048 + (int)(sim_hash(start * 16 + ch) % 1024) - 512;
+    for (i = start; i < period; i++)
+        v += (int)(sim_hash(i * 16 + ch) % 41) - 20;
+    return clamp12(v);
+}
+
+/* worst case, nothing to compress */
+static uint16_t wave_noise(uint32_t index) {
+    return sim_noise(index);
+}
+
+static const struct {
+    const char *name;
+    uint16_t (*signal)(uint32_t index);
+} waves[] = {
+    {"dc",     wave_dc},
+    {"sine",   wave_sine},
+    {"square", wave_square},
+    {"ramp",   wave_ramp},
+    {"walk",   wave_walk},
+    {"noise",  wave_noise},
+};
+
+static const int channel_counts[] = {1, 2, 3, 4, 10};
+
+int main(int argc, char **argv) {
+    uint32_t ms = 50;
+    int failed = 0;
+    unsigned w, c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't') {
+            fprintf(stderr, "usage: %s [-t ms]\n", argv[0]);
+            return 2;
+        }
+        ms = strtoul(optarg, NULL, 0);
+    }
+
+    sim_init();
+    sim_usb_packets_ms = 0;  /* host keeps up, nothing is dropped */
+    printf("wave   chans  packets  samples  samples/packet  vs 12-bit  errors  ns/sample\n");
+    for (w = 0; w < sizeof(waves) / sizeof(waves[0]); w++) {
+        for (c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+            uint64_t bad;
+            double per_packet;
+            wave_channels = channel_counts[c];
+            sim_signal = waves[w].signal;
+            regs.cmd = ADC_CMD_CONTINUOUS;
+            regs.bits = ADC_BITS_RICE;
+            regs.channels = (1 << wave_channels) - 1;
+            regs.frequency = ADC_FREQUENCY_100KHZ;
+            regs.period = 0;
+            regs.trigger = ADC_TRIGGER_NONE;
+            regs.samples = 18;
+            sim_restart();
+            sim_cpu_ns = 0;
+            sim_run(ms * SIM_PS_PER_MS);
+            bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered + sim_rx.gaps;
+            if (bad || !sim_rx.checked)
+                failed++;
+            per_packet = sim_rx.data ? (double)sim_rx.checked / sim_rx.data : 0;
+            printf("%-6s %5d %8u %8llu %15.1f %9.2fx %7llu %10.1f\n",
+                   waves[w].name, wave_channels, sim_rx.data, (unsigned long long)sim_rx.checked,
+                   per_packet, per_packet / (ADC_SAMPLE_SIZE * 8 / ADC_BITS_HI),
+                   (unsigned long long)bad,
+                   sim_rx.checked ? (double)sim_cpu_ns / sim_rx.checked : 0.0);
+        }
+    }
+    if (failed)
+        printf("%d round trip(s) failed\n", failed);
+    return failed ? 1 : 0;
+}
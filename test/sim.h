@@ -0,0 +1,408 @@
+#ifndef __SIM_H
+#define __SIM_H
+
+/* Simulated acquisition: adc.c runs against mock.c, ADC converts a known
+ * signal at the rate of current settings and host reads packets at a
+ * given rate; every data packet received is decoded as plot_adc.py does
+ * and each sample is checked against the signal at its position.
+ * Include once, in the test program: adc.c is compiled with it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "host.h"
+#include "../src/adc.c"
+
+#define SIM_PS_PER_MS       1000000000ULL
+#define SIM_USB_PACKETS_MS  10  /* about what hosts in README table read */
+
+/* 12-bit value of `index`-th sample since acquisition start, channels
+ * of period go in order; dummy conversions read 0
+ */
+static uint32_t sim_hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint16_t sim_noise(uint32_t index) {
+    return sim_hash(index) & 0xfff;
+}
+
+static uint16_t (*sim_signal)(uint32_t index) = sim_noise;
+
+static uint16_t sim_conversion(uint32_t conversion) {
+    uint32_t slots = nchannels + dummy_mode;
+    if (samples_in_reversed_order) /* ADC2 goes first, into upper halfword */
+        conversion ^= 1;
+    if (conversion % slots == (uint32_t)nchannels)
+        return 0;
+    return sim_signal(conversion / slots * nchannels + conversion % slots);
+}
+
+/* what host got */
+static struct {
+    uint32_t packets;  /* all of them, events too */
+    uint32_t data;
+    uint32_t gaps;
+    uint32_t gap_periods;
+    uint32_t gap_packets;
+    uint32_t triggers;
+    int32_t trig_position;  /* of the last trigger event */
+    int64_t trig_period;  /* absolute, where device found the last trigger */
+    int64_t first_period;  /* absolute, of the first checked sample */
+    uint32_t lost;  /* by sequence, without gap event */
+    uint64_t checked;  /* samples */
+    uint64_t mismatches;
+    uint64_t reordered;  /* periods that don't go up */
+    int64_t last_period;  /* absolute, of the last checked sample */
+} sim_rx;
+
+/* decoder state, names follow read_adc() of plot_adc.py */
+static struct {
+    int started;
+    int last_seq, seq_offset;
+    int64_t rice_periods;
+    uint32_t partial[ADC_TOTAL_CHANNELS];
+    int partial_n;
+    int64_t stream_offset;
+    int gap;
+    uint32_t gap_periods;
+    int64_t next_period;
+    int trig_pending;
+    int64_t trig_skip;
+    int64_t origin;  /* absolute output period of the first kept one of capture */
+    int64_t pending_origin;
+} sim_dec;
+
+static uint32_t sim_rx_origin = 0;  /* adc_rx_total at acquisition start */
+
+/* expected value of output period `period` of channel slot `ch`: the
+ * same packing of the signal as device does, min/max pair as max << 16 | min
+ */
+static uint32_t sim_expected(int64_t period, int ch, int bits) {
+    int shift = 2 * oversampling;
+    uint32_t first = (uint32_t)(period << shift) * nchannels + ch;
+    uint32_t sum = 0, lo = 0xffff, hi = 0;
+    uint32_t i;
+    if (!oversampling) {
+        uint32_t v = sim_signal(first);
+        if (bits >= ADC_BITS_LO && bits <= ADC_BITS_HI)
+            return v & (0xfff & ~((1 << (ADC_BITS_HI - bits)) - 1));
+        if (bits == ADC_BITS_DIGITAL)
+            return v & 0xc00;
+        return v;
+    }
+    for (i = 0; i < (1U << shift); i++) {
+        uint32_t v = sim_signal(first + i * nchannels);
+        sum += v;
+        if (v < lo)
+            lo = v;
+        if (v > hi)
+            hi = v;
+    }
+    return peak_mode ? (hi << 16 | lo) : (sum >> oversampling) & 0xffff;
+}
+
+static void sim_check(int64_t period, int ch, uint32_t value, int bits) {
+    int64_t abs_period = sim_dec.origin + period;
+    if (!sim_rx.checked++)
+        sim_rx.first_period = abs_period;
+    if (abs_period * nchannels + ch <= sim_rx.last_period)
+        sim_rx.reordered++;
+    sim_rx.last_period = abs_period * nchannels + ch;
+    if (value != sim_expected(abs_period, ch, bits)) {
+        if (sim_rx.mismatches < 5)
+            printf("  mismatch at period %lld channel %d: 0x%x, expected 0x%x\n",
+                   (long long)abs_period, ch, value, sim_expected(abs_period, ch, bits));
+        sim_rx.mismatches++;
+    }
+}
+
+/* body into values, as unpack_data() of plot_adc.py */
+static int sim_unpack(const uint8_t *data, int bits, int swapped, uint32_t *v) {
+    int n = 0, i, bit = 0;
+    switch (bits) {
+    case ADC_BITS_RICE: {
+        uint32_t prev[ADC_TOTAL_CHANNELS] = {0}, acc[ADC_TOTAL_CHANNELS] = {0};
+        int period, ch;
+#define SIM_GET(nbits, out) do { int j_; out = 0; \
+            for (j_ = 0; j_ < (nbits); j_++, bit++) \
+                out = (out << 1) | ((data[1 + bit / 8] >> (7 - bit % 8)) & 1); } while (0)
+        for (period = 0; period < data[0]; period++) {
+            uint32_t raw;
+            SIM_GET(1, raw);
+            for (ch = 0; ch < nchannels; ch++) {
+                uint32_t u, x;
+                if (raw) {
+                    int32_t d;
+                    SIM_GET(RICE_RAW_BITS, x);
+                    d = (int32_t)x - (int32_t)prev[ch];
+                    u = (d >= 0) ? (uint32_t)d << 1 : ((uint32_t)-d << 1) - 1;
+                }
+                else {
+                    int k = rice_k(acc[ch]);
+                    uint32_t q = 0, b = 1, r = 0;
+                    while (q < RICE_ESCAPE) {
+                        SIM_GET(1, b);
+                        if (!b)
+                            break;
+                        q++;
+                    }
+                    if (q == RICE_ESCAPE)
+                        SIM_GET(RICE_ESCAPE_BITS, u);
+                    else {
+                        SIM_GET(k, r);
+                        u = (q << k) | r;
+                    }
+                    x = prev[ch] + (int32_t)((u >> 1) ^ -(u & 1));
+                }
+                acc[ch] = period ? acc[ch] + u - (acc[ch] >> RICE_ACC_SHIFT) : RICE_ACC_INIT;
+                prev[ch] = x;
+                v[n++] = x;
+            }
+        }
+#undef SIM_GET
+        return n;
+    }
+    case ADC_BITS_DIGITAL:
+        for (i = 0; i < ADC_SAMPLE_SIZE; i++) {
+            v[n++] = (data[i] & 0xc0) << 4;
+            v[n++] = (data[i] & 0x30) << 6;
+            v[n++] = (data[i] & 0x0c) << 8;
+            v[n++] = (data[i] & 0x03) << 10;
+        }
+        return n;
+    case ADC_BITS_LO:
+        for (i = 0; i < ADC_SAMPLE_SIZE; i++) {
+            v[n++] = (data[i] & 0xf0) << 4;
+            v[n++] = (data[i] & 0x0f) << 8;
+        }
+        return n;
+    case ADC_BITS_MID:
+        for (i = 0; i < ADC_SAMPLE_SIZE; i++)
+            v[n++] = data[i] << 4;
+        return n;
+    case ADC_BITS_HI:
+        for (i = 0; i < ADC_SAMPLE_SIZE; i += 3) {
+            v[n++] = (data[i] << 4) | (data[i + 1] >> 4);
+            v[n++] = (data[i + 2] << 4) | (data[i + 1] & 0xf);
+        }
+        return n;
+    case ADC_BITS_PEAK:
+        for (i = 0; i < ADC_SAMPLE_SIZE; i += 4)
+            v[n++] = (uint32_t)(data[i] | data[i + 1] << 8) | (uint32_t)(data[i + 2] | data[i + 3] << 8) << 16;
+        return n;
+    default: /* 16-bit words, raw or sums */
+        for (i = 0; i < ADC_SAMPLE_SIZE; i += 2)
+            v[n++] = data[i] | data[i + 1] << 8;
+        if (bits == (ADC_BITS_RAW & 0x0F) && swapped)
+            for (i = 0; i + 1 < n; i += 2) {
+                uint32_t t = v[i];
+                v[i] = v[i + 1];
+                v[i + 1] = t;
+            }
+        return n;
+    }
+}
+
+/* EP1 IN packet got by host, as read_adc() of plot_adc.py */
+static void sim_receive(const uint8_t *packet, int length) {
+    const ADCPacketHeader *hdr = (const ADCPacketHeader*)packet;
+    int nch = nchannels;
+    int bits = hdr->mode & 0x0F;
+    int offset = hdr->channels >> ADC_HEADER_OFFSET_SHIFT;
+    int seq_n = hdr->sequence & 0x7f;
+    int restarted, lost, n, i, complete;
+    int64_t new_seq, first_period, first_sample;
+    uint32_t v[ADC_TOTAL_CHANNELS + ADC_SAMPLE_SIZE * 8];  /* room for partial period before */
+    uint32_t *samples;
+
+    (void)length;
+    sim_rx.packets++;
+    if (hdr->channels & ADC_HEADER_SLOW)
+        return;
+    if (!(hdr->channels & ADC_HEADER_CHANNELS_MASK)) {
+        const uint8_t *body = packet + sizeof(ADCPacketHeader);
+        if (hdr->mode == ADC_EVENT_TRIGGER) {
+            const ADCTriggerEvent *event = (const ADCTriggerEvent*)body;
+            /* device knows where the capture is, signal is indexed from acquisition start */
+            int64_t trig_period = (int64_t)((trig_sample - trigger_chan_index - sim_rx_origin) / nch) >> (2 * oversampling);
+            sim_dec.trig_pending = 1;
+            sim_dec.gap = 0;  /* of the previous capture */
+            sim_dec.trig_skip = event->skip;
+            sim_dec.pending_origin = trig_period - event->position;
+            sim_rx.triggers++;
+            sim_rx.trig_position = event->position;
+            sim_rx.trig_period = trig_period;
+        }
+        else if (hdr->mode == ADC_EVENT_GAP) {
+            const ADCGapEvent *event = (const ADCGapEvent*)body;
+            sim_dec.gap_periods = sim_dec.gap ? sim_dec.gap_periods + event->periods : event->periods;
+            sim_dec.gap = 1;
+            sim_rx.gaps++;
+            sim_rx.gap_periods += event->periods;
+            sim_rx.gap_packets += event->packets;
+        }
+        return;
+    }
+    sim_rx.data++;
+    restarted = !sim_dec.started || (hdr->sequence & 0x80);
+    if (restarted) {
+        sim_dec.started = 1;
+        sim_dec.last_seq = sim_dec.seq_offset = seq_n - 1;
+        sim_dec.rice_periods = 0;
+        sim_dec.trig_skip = sim_dec.trig_pending ? sim_dec.trig_skip : 0;
+        sim_dec.origin = sim_dec.trig_pending ? sim_dec.pending_origin : 0;
+        sim_dec.trig_pending = 0;
+        sim_dec.next_period = 0;  /* a gap before the first packet counts from capture start */
+    }
+    new_seq = sim_dec.last_seq + (((seq_n - sim_dec.last_seq) % 0x80) + 0x80) % 0x80;
+    lost = (new_seq != sim_dec.last_seq + 1);
+    if (lost && !sim_dec.gap)
+        sim_rx.lost += new_seq - 1 - sim_dec.last_seq;
+    sim_dec.last_seq = new_seq;
+
+    n = sim_unpack(packet + sizeof(ADCPacketHeader), bits,
+                   nch == 1 && (hdr->mode >> 4) == ADC_FREQUENCY_MAX, v + ADC_TOTAL_CHANNELS);
+    samples = v + ADC_TOTAL_CHANNELS;
+    if (sim_dec.gap) {
+        int64_t resync = sim_dec.next_period + sim_dec.gap_periods;
+        if (bits == ADC_BITS_RICE)
+            sim_dec.rice_periods = resync;
+        else {
+            sim_dec.seq_offset = new_seq - 1;
+            sim_dec.stream_offset = offset - resync * nch;
+        }
+    }
+    if (bits == ADC_BITS_RICE) {
+        first_period = sim_dec.rice_periods;
+        sim_dec.rice_periods += n / nch;
+        complete = n;
+    }
+    else {
+        first_sample = (int64_t)n * (new_seq - sim_dec.seq_offset - 1);
+        if (restarted && !sim_dec.gap)
+            sim_dec.stream_offset = offset;
+        if (!restarted && !lost && !sim_dec.gap && sim_dec.partial_n == (nch - offset) % nch) {
+            first_sample -= sim_dec.partial_n;
+            samples -= sim_dec.partial_n;
+            memcpy(samples, sim_dec.partial, sim_dec.partial_n * sizeof(uint32_t));
+            n += sim_dec.partial_n;
+        }
+        else {
+            samples += offset;
+            n -= offset;
+            first_sample += offset;
+        }
+        complete = n / nch * nch;
+        sim_dec.partial_n = n - complete;
+        memcpy(sim_dec.partial, samples + complete, sim_dec.partial_n * sizeof(uint32_t));
+        first_period = (first_sample - sim_dec.stream_offset) / nch;
+    }
+    sim_dec.next_period = first_period + complete / nch;
+    sim_dec.gap = 0;
+
+    for (i = 0; i < complete; i++) {
+        int64_t period = first_period + i / nch - sim_dec.trig_skip;
+        if (period >= 0)
+            sim_check(period, i % nch, samples[i], bits);
+    }
+}
+
+/* Reads settings in `regs` as if host wrote and committed them, and
+ * starts acquisition from scratch
+ */
+static void sim_restart(void) {
+    regs_staged = regs;
+    request_restart();
+    host_dispatch();
+    sim_rx_origin = adc_rx_total;
+    memset(&sim_rx, 0, sizeof(sim_rx));
+    memset(&sim_dec, 0, sizeof(sim_dec));
+    sim_rx.last_period = -1;
+}
+
+/* Applies `regs_staged` as a register write of host does, staged with
+ * stage_reg(); decoding starts over if acquisition restarted
+ */
+static void sim_commit(void) {
+    request_commit();
+    host_dispatch();
+    if (regs.update_kind != ADC_UPDATE_RESTART)
+        return;
+    sim_rx_origin = adc_rx_total;
+    memset(&sim_rx, 0, sizeof(sim_rx));
+    memset(&sim_dec, 0, sizeof(sim_dec));
+    sim_rx.last_period = -1;
+}
+
+/* Device is plugged in: USB reset, default settings */
+static void sim_init(void) {
+    host_adc_source = sim_conversion;
+    host_usb_receive = sim_receive;
+    Device_Property.Init();
+    Device_Property.Reset();
+    host_dispatch();
+}
+
+static uint32_t sim_usb_packets_ms = SIM_USB_PACKETS_MS;  /* host reads, 0 - as fast as USB allows */
+static void (*sim_tick)(void) = NULL;  /* called before each DMA event and USB read */
+static uint64_t sim_cpu_ns = 0;  /* host CPU time in interrupt handlers, of DMA events and packets sent */
+
+static uint64_t sim_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Simulated time between conversions, whole period of channels takes USE_PERIOD */
+static uint64_t sim_conversion_ps(void) {
+    return (uint64_t)regs.use_period * 1000000 / (SystemCoreClock / 1000000) / (nchannels + dummy_mode);
+}
+
+/* Runs acquisition for `ps` of simulated time */
+static void sim_run(uint64_t ps) {
+    uint64_t end = host_ps + ps;
+    uint64_t transfer_ps = sim_conversion_ps() * dma_transfer_samples;
+    uint64_t usb_ps = sim_usb_packets_ms ? SIM_PS_PER_MS / sim_usb_packets_ms : SIM_PS_PER_MS / 19;
+    uint64_t next_usb = host_ps + usb_ps;
+    uint64_t next_dma = host_ps + host_dma_transfers_left() * transfer_ps;
+    while (host_ps < end) {
+        uint64_t t0;
+        uint32_t flag;
+        if (host_adc_running() && next_dma <= next_usb) {
+            host_ps = next_dma;
+            if (sim_tick)
+                sim_tick();
+            flag = host_dma_run();
+            t0 = sim_now_ns();
+            host_dma_raise(flag);
+            sim_cpu_ns += sim_now_ns() - t0;
+            next_dma = host_ps + host_dma_transfers_left() * transfer_ps;
+        }
+        else {
+            host_ps = next_usb;
+            if (sim_tick)
+                sim_tick();
+            if (host_usb_send()) { /* polls that find nothing aren't counted */
+                t0 = sim_now_ns();
+                host_usb_done();
+                sim_cpu_ns += sim_now_ns() - t0;
+            }
+            next_usb += usb_ps;
+            if (!host_adc_running())
+                next_dma = next_usb;
+        }
+    }
+    /* conversions done by now, a register write after this sees them */
+    if (host_adc_running() && next_dma > host_ps)
+        host_dma_partial(host_dma_transfers_left() - (next_dma - host_ps + transfer_ps - 1) / transfer_ps);
+}
+
+#endif /* __SIM_H */
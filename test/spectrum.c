@@ -0,0 +1,139 @@
+/* Fixed-point FFT of SPECTRUM (fft_magnitudes()) against the same Hann
+ * window and bin scaling in double precision, for every block size: bin
+ * error is given in 1/16 of LSB, as magnitudes are sent. Then host time
+ * per block.
+ * Usage: spectrum [-n blocks]
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "host.h"
+#include "../src/adc.c"
+
+#define MAX_ERROR       16  /* of any bin, 1 LSB */
+#define MAX_PEAK_ERROR  0.01  /* relative, of sine amplitude */
+
+static int signal_bits;
+
+static int sample_sine(int i, double cycles, double amplitude) {
+    return (int)lround(2048 + amplitude * sin(2 * M_PI * cycles * i / (1 << signal_bits) + 0.3));
+}
+
+static uint16_t clamp12(int v) {
+    return (v < 0) ? 0 : (v > 0xfff) ? 0xfff : v;
+}
+
+static const struct {
+    const char *name;
+    double cycles, amplitude;  /* of sine in block, LSB */
+    int noise;  /* LSB */
+    double cycles2, amplitude2;
+} waves[] = {
+    {"dc",          0,     0,     0, 0,  0},
+    {"full scale",  10,    2047,  0, 0,  0},
+    {"off bin",     37.4,  2000,  0, 0,  0},
+    {"small",       21,    10,    0, 0,  0},
+    {"noisy",       50.2,  1000,  100, 0,  0},
+    {"two tones",   12.5,  1500,  0, 90, 300},
+    {"noise",       0,     0,     2047, 0,  0},
+};
+
+static void make_block(uint16_t *samples, int w) {
+    int n = 1 << signal_bits, i;
+    for (i = 0; i < n; i++) {
+        int v = sample_sine(i, waves[w].cycles, waves[w].amplitude) - 2048 +
+                sample_sine(i, waves[w].cycles2, waves[w].amplitude2);
+        if (waves[w].noise)
+            v += rand() % (2 * waves[w].noise + 1) - waves[w].noise;
+        samples[i] = clamp12(v);
+    }
+}
+
+/* Sine amplitude of each bin, 1/16 LSB, as fft_magnitudes() gives it */
+static void reference(const uint16_t *samples, double *bins) {
+    int n = 1 << signal_bits, i, k;
+    for (k = 0; k < n / 2; k++) {
+        double re = 0, im = 0;
+        for (i = 0; i < n; i++) {
+            double x = ((int)samples[i] - 0x800) * 16.0 * (1 - cos(2 * M_PI * i / n)) / 2;
+            re += x * cos(2 * M_PI * i * k / n);
+            im -= x * sin(2 * M_PI * i * k / n);
+        }
+        bins[k] = 4 * sqrt(re * re + im * im) / n;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    static uint16_t samples[FFT_SIZE_MAX];
+    static int16_t buf[FFT_SIZE_MAX];
+    static uint32_t acc[FFT_SIZE_MAX / 2];
+    static double bins[FFT_SIZE_MAX / 2];
+    uint32_t blocks = 20000;
+    int failed = 0;
+    int bits, opt;
+    unsigned w;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "usage: %s [-n blocks]\n", argv[0]);
+            return 2;
+        }
+        blocks = strtoul(optarg, NULL, 0);
+    }
+
+    srand(1);
+    printf("bits wave        max error  at bin  peak  reference  device\n");
+    for (bits = FFT_BITS_MIN; bits <= FFT_BITS_MAX; bits++) {
+        int n = 1 << bits, i;
+        uint64_t t0, elapsed;
+        signal_bits = bits;
+        for (w = 0; w < sizeof(waves) / sizeof(waves[0]); w++) {
+            double max_error = 0, peak_error;
+            int worst = 0, peak = 0, k, bad;
+            make_block(samples, w);
+            reference(samples, bins);
+            for (i = 0; i < n; i++)
+                buf[i] = samples[i];
+            memset(acc, 0, sizeof(acc));
+            fft_magnitudes(buf, bits, acc);
+            for (k = 0; k < n / 2; k++) {
+                double error = fabs(acc[k] - bins[k]);
+                if (error > max_error) {
+                    max_error = error;
+                    worst = k;
+                }
+                if (bins[k] > bins[peak])
+                    peak = k;
+            }
+            peak_error = bins[peak] ? fabs(acc[peak] - bins[peak]) / bins[peak] : 0;
+            bad = max_error > MAX_ERROR || (waves[w].amplitude >= 1000 && peak_error > MAX_PEAK_ERROR);
+            if (bad)
+                failed++;
+            printf("%4d %-10s %10.1f %7d %5d %10.1f %7u%s\n", bits, waves[w].name,
+                   max_error, worst, peak, bins[peak], acc[peak], bad ? "  FAIL" : "");
+        }
+
+        make_block(samples, 1);
+        t0 = now_ns();
+        for (i = 0; i < (int)blocks; i++) {
+            memcpy(buf, samples, n * sizeof(buf[0]));
+            fft_magnitudes(buf, bits, acc);
+        }
+        elapsed = now_ns() - t0;
+        printf("%4d host time %.0f ns/block, %.1f ns/sample\n\n", bits,
+               (double)elapsed / blocks, (double)elapsed / blocks / n);
+    }
+    if (failed)
+        printf("%d spectrum(s) differ from reference\n", failed);
+    return failed ? 1 : 0;
+}
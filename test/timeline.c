@@ -0,0 +1,89 @@
+/* Packets produced, sent and dropped for each BITS, number of channels
+ * and FREQUENCY of README table, as `plot_adc.py --profile` shows them
+ * for a device, with host CPU time of interrupt handlers per packet.
+ * Time is simulated: ADC converts at the rate of settings, host reads
+ * `-u` packets per millisecond, handlers take no time.
+ * Usage: timeline [-t ms] [-u packets_per_ms] [-b bits] [-c channels]
+ */
+
+#include <unistd.h>
+#include "sim.h"
+
+static const uint8_t all_bits[] = {
+    ADC_BITS_RICE, ADC_BITS_DIGITAL, ADC_BITS_LO, ADC_BITS_MID, ADC_BITS_HI, ADC_BITS_RAW
+};
+
+/* of each ADC, as in README table */
+static const uint32_t frequency_hz[ADC_FREQUENCY_1KHZ + 1] = {
+    0, 857143, 500000, 200000, 100000, 50000, 20000, 10000, 5000, 2000, 1000
+};
+
+int main(int argc, char **argv) {
+    uint32_t ms = 100;
+    int only_bits = 0, only_channels = 0;
+    int errors = 0;
+    unsigned b;
+    int nch, code, opt;
+
+    while ((opt = getopt(argc, argv, "t:u:b:c:")) != -1) {
+        switch (opt) {
+        case 't':
+            ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            sim_usb_packets_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            only_bits = atoi(optarg);
+            break;
+        case 'c':
+            only_channels = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t ms] [-u packets_per_ms] [-b bits] [-c channels]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    sim_init();
+    printf("bits chans  frequency  pkt/DMA  produced/s    sent/s  dropped/s  gaps  errors  ns/packet\n");
+    for (b = 0; b < sizeof(all_bits); b++) {
+        if (only_bits && all_bits[b] != only_bits)
+            continue;
+        for (nch = 1; nch <= ADC_TOTAL_CHANNELS; nch++) {
+            if (only_channels && nch != only_channels)
+                continue;
+            for (code = ADC_FREQUENCY_MAX; code <= ADC_FREQUENCY_1KHZ; code++) {
+                uint32_t produced, dropped, bad;
+                char ns[16];
+                double seconds = ms / 1000.0;
+                regs.cmd = ADC_CMD_CONTINUOUS;
+                regs.bits = all_bits[b];
+                regs.channels = (1 << nch) - 1;
+                regs.frequency = code;
+                regs.period = 0;
+                regs.trigger = ADC_TRIGGER_NONE;
+                regs.samples = 18;  /* one capture for the whole run */
+                sim_restart();
+                sim_cpu_ns = 0;
+                sim_run(ms * SIM_PS_PER_MS);
+                dropped = regs.dropped_packets;
+                produced = sim_rx.data + dropped;
+                bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered;
+                if (bad)
+                    errors++;
+                if (produced)
+                    snprintf(ns, sizeof(ns), "%.0f", (double)sim_cpu_ns / produced);
+                else
+                    strcpy(ns, "-");
+                printf("%4d %5d %10u %8d %11.0f %9.0f %10.0f %5u %7u %10s\n",
+                       all_bits[b], nch, frequency_hz[code], regs.block_packets,
+                       produced / seconds, sim_rx.data / seconds, dropped / seconds,
+                       sim_rx.gaps, bad, ns);
+            }
+        }
+    }
+    if (errors)
+        printf("%d setting(s) with samples not as converted\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,130 @@
+/* FREQUENCY and PERIOD written during acquisition: when ADC sample time
+ * and DMA block size stay the same, only TIM1 is reprogrammed, so no
+ * sample may be lost, duplicated or shifted across the write, and
+ * packets starting at or after the first period at the new rate, and
+ * only they, must carry it in header. Other changes restart acquisition,
+ * the table shows packets waiting in buffer that are dropped then.
+ * Usage: timing [-t ms]
+ */
+
+#include <unistd.h>
+#include "sim.h"
+
+static const struct {
+    uint8_t bits, oversampling;
+    int channels;
+    uint8_t frequency;
+    uint32_t period;
+    uint8_t new_frequency;
+    uint32_t new_period;
+    int kind;  /* expected ADC_UPDATE_* */
+} cases[] = {
+    {ADC_BITS_HI,   0, 1, ADC_FREQUENCY_20KHZ,  0,     ADC_FREQUENCY_10KHZ, 0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 1, ADC_FREQUENCY_1KHZ,   0,     ADC_FREQUENCY_5KHZ,  0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 4, ADC_FREQUENCY_10KHZ,  0,     ADC_FREQUENCY_5KHZ,  0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_MID,  0, 3, ADC_FREQUENCY_5KHZ,   0,     ADC_FREQUENCY_2KHZ,  0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_LO,   0, 6, ADC_FREQUENCY_2KHZ,   0,     ADC_FREQUENCY_10KHZ, 0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_RICE, 0, 2, ADC_FREQUENCY_10KHZ,  0,     ADC_FREQUENCY_20KHZ, 0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   1, 1, ADC_FREQUENCY_10KHZ,  0,     ADC_FREQUENCY_5KHZ,  0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 2, ADC_FREQUENCY_10KHZ,  0,     ADC_FREQUENCY_10KHZ, 10000, ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 1, ADC_FREQUENCY_5KHZ,   0,     ADC_FREQUENCY_5KHZ,  2000,  ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 3, ADC_FREQUENCY_5KHZ,   10000, ADC_FREQUENCY_20KHZ, 0,     ADC_UPDATE_TIMING},
+    {ADC_BITS_HI,   0, 1, ADC_FREQUENCY_200KHZ, 0,     ADC_FREQUENCY_100KHZ, 0,    ADC_UPDATE_RESTART},  /* sample time */
+    {ADC_BITS_HI,   0, 1, ADC_FREQUENCY_10KHZ,  0,     ADC_FREQUENCY_500KHZ, 0,    ADC_UPDATE_RESTART},  /* sample time, block size */
+    {ADC_BITS_HI,   0, 2, ADC_FREQUENCY_MAX,    0,     ADC_FREQUENCY_200KHZ, 0,    ADC_UPDATE_RESTART},  /* continuous conversions */
+    {ADC_BITS_LO,   0, 2, ADC_FREQUENCY_200KHZ, 0,     ADC_FREQUENCY_MAX,    0,    ADC_UPDATE_RESTART},
+};
+
+/* packets of the capture after the write */
+static int checking = 0;
+static int new_code = 0;
+static uint32_t split = 0;  /* ADC samples from acquisition start */
+static uint32_t old_rate = 0, new_rate = 0, misstamped = 0, restarts = 0;
+
+static void receive(const uint8_t *packet, int length) {
+    const ADCPacketHeader *hdr = (const ADCPacketHeader*)packet;
+    if (checking && (hdr->channels & ADC_HEADER_CHANNELS_MASK) && !(hdr->channels & ADC_HEADER_SLOW)) {
+        /* the first sample of packet, counted as the device does */
+        int64_t first = sim_rx.last_period + 1 + sim_dec.partial_n;
+        int64_t sample = ((first / nchannels) << (2 * oversampling)) * nchannels + first % nchannels;
+        int is_new = (hdr->mode >> 4) == new_code;
+        if (hdr->sequence & 0x80)
+            restarts++;
+        if (is_new != (sample >= split))
+            misstamped++;
+        if (is_new)
+            new_rate++;
+        else
+            old_rate++;
+    }
+    sim_receive(packet, length);
+}
+
+static int ring_waiting(void) {
+    return ring_end - ring_start - 1 - ring_free();
+}
+
+int main(int argc, char **argv) {
+    uint32_t ms = 50;
+    int failed = 0;
+    unsigned c;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't') {
+            fprintf(stderr, "usage: %s [-t ms]\n", argv[0]);
+            return 2;
+        }
+        ms = strtoul(optarg, NULL, 0);
+    }
+
+    sim_init();
+    host_usb_receive = receive;
+    sim_usb_packets_ms = 0;  /* ring doesn't overflow, gaps would be of the write */
+    printf("bits  ovs chans  old period  new period  kind  dropped  old rate  new rate  misstamped  errors\n");
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        uint32_t old_period, waiting;
+        uint64_t bad;
+        int ok;
+        regs.cmd = ADC_CMD_CONTINUOUS;
+        regs.bits = cases[c].bits;
+        regs.oversampling = cases[c].oversampling;
+        regs.channels = (1 << cases[c].channels) - 1;
+        regs.frequency = cases[c].frequency;
+        regs.period = cases[c].period;
+        regs.trigger = ADC_TRIGGER_NONE;
+        regs.samples = 18;
+        sim_restart();
+        sim_run(ms * SIM_PS_PER_MS);
+        old_period = regs.use_period;
+
+        regs_staged = regs;
+        regs_staged.frequency = cases[c].new_frequency;
+        regs_staged.period = cases[c].new_period;
+        stage_reg(ADC_INDEX_FREQUENCY);
+        waiting = ring_waiting();
+        old_rate = new_rate = misstamped = restarts = 0;
+        sim_commit();
+        checking = (regs.update_kind == ADC_UPDATE_TIMING);
+        new_code = cases[c].new_period ? ADC_FREQUENCY_CUSTOM : cases[c].new_frequency;
+        split = retime_sample - sim_rx_origin;
+        sim_run(ms * SIM_PS_PER_MS);
+        checking = 0;
+
+        bad = sim_rx.mismatches + sim_rx.lost + sim_rx.reordered + sim_rx.gaps;
+        ok = !bad && regs.update_kind == cases[c].kind && sim_rx.checked;
+        if (regs.update_kind == ADC_UPDATE_TIMING)
+            ok = ok && !misstamped && !restarts && old_rate && new_rate;
+        if (!ok)
+            failed++;
+        printf("%4d %4d %5d %11u %11u %5d %8u %9u %9u %11u %7llu%s\n",
+               cases[c].bits, cases[c].oversampling, cases[c].channels, old_period, regs.use_period,
+               regs.update_kind, regs.update_kind == ADC_UPDATE_RESTART ? waiting : 0,
+               old_rate, new_rate, misstamped, (unsigned long long)bad, ok ? "" : "  FAIL");
+    }
+    regs.oversampling = 0;
+    regs.period = 0;
+    if (failed)
+        printf("%d write(s) applied wrongly\n", failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,278 @@
+/* Trigger position: synthetic waveforms with a known crossing go through
+ * check_trigger() in acquisition, trigger event must point at the exact
+ * period a reference detector finds, with TRIG_OFFSET applied to the
+ * period, and the first kept period must be the one it names. AWD_HI and
+ * AWD_LO go through the simulated analog watchdog and adc_irq(): one
+ * interrupt per capture, a spike seen by a late interrupt re-arms the
+ * watchdog after AWD_MISSED_BLOCKS. Then host CPU time of interrupt
+ * handlers per DMA block while the trigger is armed and the level never
+ * crosses, software triggers against the watchdog, for `-t` ms each.
+ * Usage: trigger [-t ms]
+ */
+
+#include <math.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define EDGE_PERIOD     3001  /* periods before the crossing, ring holds pretrigger ones */
+#define SPIKE_PERIOD    1000  /* one period beyond the level, before the step */
+
+static int wave_channels = 1;
+static int wave_slot = 0;
+static int wave_falling = 0;
+
+static int noise(uint32_t index, int amplitude) {
+    return (int)(sim_hash(index ^ 0x51ed270b) % (2 * amplitude + 1)) - amplitude;
+}
+
+static uint16_t level_at(int32_t period, uint32_t index, int kind) {
+    int v;
+    switch (kind) {
+    default:
+    case 0: /* clean step */
+        v = (period < EDGE_PERIOD) ? 1000 : 3000;
+        break;
+    case 1: /* noise on the level, hysteresis holds it off until the ramp */
+        if (period < 500)
+            v = 2600 + noise(index, 40);
+        else if (period >= 1500 && period < 2500)
+            v = 1500 + noise(index, 40);
+        else if (period < 1500)
+            v = 2048 + noise(index, 40);
+        else
+            v = 1500 + (period - 2500) + noise(index, 40);
+        break;
+    case 2: /* noisy sine */
+        v = 2048 + (int)(1500 * sin(2 * M_PI * (period - 1000) / 4000.0)) + noise(index, 40);
+        if (period < 1000)
+            v = 2048 - 200 + noise(index, 40);
+        break;
+    case 3: /* one period spike, then clean step */
+        v = (period < EDGE_PERIOD && period != SPIKE_PERIOD) ? 1000 : 3000;
+        break;
+    case 4: /* never crosses */
+        v = 1000 + noise(index, 40);
+        break;
+    }
+    if (wave_falling)
+        v = 4096 - v;
+    return (v < 0) ? 0 : (v > 0xfff) ? 0xfff : v;
+}
+
+static int wave_kind = 0;
+
+static uint16_t wave(uint32_t index) {
+    uint32_t period = index / wave_channels;
+    /* other channels cross the level all the time, they must not trigger */
+    if (index % wave_channels != (uint32_t)wave_slot)
+        return (period & 1) ? 0xfff : 0;
+    return level_at(period, index, wave_kind);
+}
+
+static inline int is_awd(int trigger) {
+    return trigger == ADC_TRIGGER_AWD_HI || trigger == ADC_TRIGGER_AWD_LO;
+}
+
+/* What check_trigger() should find: the first period past TRIG_LEVEL
+ * after the level has left hysteresis band on the other side, also when
+ * one step crosses the whole band; watchdog needs no arming
+ */
+static int64_t reference_trigger(int trigger, int level, int hysteresis) {
+    int armed = 0;  /* 1 - was below band, 2 - was above it */
+    int64_t p;
+    if (is_awd(trigger))
+        armed = (trigger == ADC_TRIGGER_AWD_HI) ? 1 : 2;
+    for (p = 0; p < 100000; p++) {
+        int v = wave(p * wave_channels + wave_slot);
+        if ((armed == 1 && v > level) || (armed == 2 && v < level))
+            return p;
+        if (is_awd(trigger))
+            continue;
+        if (v < level - hysteresis && trigger != ADC_TRIGGER_FALLING)
+            armed = 1;
+        else if (v > level + hysteresis && trigger != ADC_TRIGGER_RISING)
+            armed = 2;
+    }
+    return -1;
+}
+
+static const int channel_counts[] = {1, 3, 4};
+static const int32_t offsets[] = {-100, 0, 37};
+static const int sweep_triggers[] = {
+    ADC_TRIGGER_RISING, ADC_TRIGGER_FALLING, ADC_TRIGGER_THRESHOLD,
+    ADC_TRIGGER_AWD_HI, ADC_TRIGGER_AWD_LO
+};
+static const char *trigger_names[] = {
+    [ADC_TRIGGER_RISING] = "rising", [ADC_TRIGGER_FALLING] = "falling",
+    [ADC_TRIGGER_THRESHOLD] = "threshold", [ADC_TRIGGER_AWD_HI] = "awd_hi",
+    [ADC_TRIGGER_AWD_LO] = "awd_lo"
+};
+
+static void setup(int trigger, int channels, uint8_t frequency, int32_t offset) {
+    wave_channels = channels;
+    wave_slot = wave_channels - 1;
+    wave_falling = (trigger == ADC_TRIGGER_FALLING || trigger == ADC_TRIGGER_AWD_LO);
+    regs.cmd = ADC_CMD_ONCE;
+    regs.bits = ADC_BITS_HI;
+    regs.channels = (1 << wave_channels) - 1;
+    regs.frequency = frequency;
+    regs.period = 0;
+    regs.samples = 0;
+    regs.trigger = trigger;
+    regs.trig_channel = wave_slot;
+    regs.trig_level = 2048;
+    regs.trig_hysteresis = 0;
+    regs.trig_offset = (uint32_t)offset;
+}
+
+/* late watchdog interrupt: ADC interrupt waits until the block with
+ * `hold_adc_sample` has been looked through
+ */
+static uint32_t hold_adc_sample = 0;
+
+static void hold_adc(void) {
+    if (host_irq_held[HOST_IRQ_ADC] && (int32_t)(adc_rx_total - sim_rx_origin - hold_adc_sample) > 0) {
+        host_irq_held[HOST_IRQ_ADC] = 0;
+        host_dispatch();
+    }
+}
+
+static const struct {
+    const char *name;
+    int channels;
+    uint8_t frequency;
+    int late;  /* interrupt comes after the spike block is looked through */
+} awd_cases[] = {
+    {"spike",       1, ADC_FREQUENCY_200KHZ, 0},
+    {"spike",       4, ADC_FREQUENCY_200KHZ, 0},
+    {"spike",       1, ADC_FREQUENCY_MAX,    0},  /* interleaved, both ADCs watch */
+    {"late spike",  1, ADC_FREQUENCY_200KHZ, 1},
+    {"late spike",  3, ADC_FREQUENCY_200KHZ, 1},
+    {"late spike",  4, ADC_FREQUENCY_200KHZ, 1},
+    {"late spike",  1, ADC_FREQUENCY_MAX,    1},
+};
+
+static uint32_t frequency_hz(uint8_t frequency) {
+    return (frequency == ADC_FREQUENCY_MAX) ? 857143 : 200000;  /* of each ADC, as in README table */
+}
+
+static const int load_triggers[] = {ADC_TRIGGER_RISING, ADC_TRIGGER_THRESHOLD, ADC_TRIGGER_AWD_HI};
+static const int load_channels[] = {1, 2, 4, 8};
+
+int main(int argc, char **argv) {
+    static const char *kinds[] = {"step", "ramp", "sine"};
+    uint32_t ms = 100;
+    int failed = 0, runs = 0;
+    int hysteresis, kind, opt;
+    unsigned t, c, o;
+
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        if (opt != 't') {
+            fprintf(stderr, "usage: %s [-t ms]\n", argv[0]);
+            return 2;
+        }
+        ms = strtoul(optarg, NULL, 0);
+    }
+
+    sim_init();
+    sim_signal = wave;
+    sim_usb_packets_ms = 0;
+    printf("trigger    wave  hyst chans offset  expected  found  position  first  irqs  errors\n");
+    for (t = 0; t < sizeof(sweep_triggers) / sizeof(sweep_triggers[0]); t++) {
+        int trigger = sweep_triggers[t];
+        for (kind = 0; kind < 3; kind++) {
+            if (is_awd(trigger) && kind == 1) /* starts beyond the level */
+                continue;
+            for (hysteresis = 0; hysteresis <= 64; hysteresis += 64) {
+                if (is_awd(trigger) && hysteresis)
+                    continue;
+                for (c = 0; c < sizeof(channel_counts) / sizeof(channel_counts[0]); c++) {
+                    for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+                        int64_t expected;
+                        int ok;
+                        wave_kind = kind;
+                        setup(trigger, channel_counts[c], ADC_FREQUENCY_200KHZ, offsets[o]);
+                        regs.trig_hysteresis = hysteresis;
+                        expected = reference_trigger(trigger, 2048, hysteresis);
+                        host_adc_awd_irqs = 0;
+                        sim_restart();
+                        sim_run(100 * SIM_PS_PER_MS);
+                        ok = sim_rx.triggers == 1 && sim_rx.checked &&
+                             sim_rx.trig_period == expected &&
+                             sim_rx.trig_position == -offsets[o] &&
+                             sim_rx.first_period == expected + offsets[o] &&
+                             !sim_rx.mismatches && !sim_rx.lost && !sim_rx.reordered &&
+                             host_adc_awd_irqs == (is_awd(trigger) ? 1U : 0U);
+                        runs++;
+                        if (!ok)
+                            failed++;
+                        printf("%-10s %-5s %4d %5d %6d %9lld %6lld %9d %6lld %5u %7s\n",
+                               trigger_names[trigger], kinds[kind], hysteresis, wave_channels, offsets[o],
+                               (long long)expected, (long long)sim_rx.trig_period, sim_rx.trig_position,
+                               (long long)sim_rx.first_period, host_adc_awd_irqs, ok ? "0" : "FAIL");
+                    }
+                }
+            }
+        }
+    }
+
+    /* a spike is found where it is if the interrupt comes in time; if it
+     * comes too late, watchdog is re-armed and finds the step
+     */
+    printf("\ntrigger    wave        chans  frequency  expected  found  irqs  errors\n");
+    for (t = ADC_TRIGGER_AWD_HI; t <= ADC_TRIGGER_AWD_LO; t++) {
+        for (c = 0; c < sizeof(awd_cases) / sizeof(awd_cases[0]); c++) {
+            int64_t expected = awd_cases[c].late ? EDGE_PERIOD : SPIKE_PERIOD;
+            uint32_t irqs = awd_cases[c].late ? 2 : 1;
+            int ok;
+            wave_kind = 3;
+            setup(t, awd_cases[c].channels, awd_cases[c].frequency, 0);
+            host_adc_awd_irqs = 0;
+            hold_adc_sample = SPIKE_PERIOD * wave_channels + wave_slot;
+            host_irq_held[HOST_IRQ_ADC] = awd_cases[c].late;
+            sim_tick = hold_adc;
+            sim_restart();
+            sim_run(100 * SIM_PS_PER_MS);
+            sim_tick = NULL;
+            host_irq_held[HOST_IRQ_ADC] = 0;
+            ok = sim_rx.triggers == 1 && sim_rx.checked && sim_rx.trig_period == expected &&
+                 sim_rx.first_period == expected && host_adc_awd_irqs == irqs &&
+                 !sim_rx.mismatches && !sim_rx.lost && !sim_rx.reordered;
+            runs++;
+            if (!ok)
+                failed++;
+            printf("%-10s %-11s %5d %10d %9lld %6lld %5u %7s\n",
+                   trigger_names[t], awd_cases[c].name, wave_channels, frequency_hz(awd_cases[c].frequency),
+                   (long long)expected, (long long)sim_rx.trig_period, host_adc_awd_irqs, ok ? "0" : "FAIL");
+        }
+    }
+
+    /* armed, level never crosses: software triggers look through every
+     * block, watchdog doesn't interrupt at all
+     */
+    printf("\ntrigger    chans  frequency  DMA blocks  irqs  ns/block\n");
+    wave_kind = 4;
+    for (c = 0; c < sizeof(load_channels) / sizeof(load_channels[0]); c++) {
+        for (t = 0; t < sizeof(load_triggers) / sizeof(load_triggers[0]); t++) {
+            uint32_t blocks;
+            setup(load_triggers[t], load_channels[c], ADC_FREQUENCY_MAX, 0);
+            host_adc_awd_irqs = 0;
+            sim_restart();
+            blocks = dma_irqs;
+            sim_cpu_ns = 0;
+            sim_run(ms * SIM_PS_PER_MS);
+            blocks = dma_irqs - blocks;
+            if (sim_rx.triggers || host_adc_awd_irqs)
+                failed++;
+            printf("%-10s %5d %10d %11u %5u %9.0f\n", trigger_names[load_triggers[t]],
+                   wave_channels, frequency_hz(ADC_FREQUENCY_MAX), blocks, host_adc_awd_irqs,
+                   blocks ? (double)sim_cpu_ns / blocks : 0.0);
+        }
+    }
+
+    regs.trigger = ADC_TRIGGER_NONE;
+    regs.trig_offset = regs.trig_hysteresis = 0;
+    if (failed)
+        printf("%d of %d captures with wrong trigger position\n", failed, runs);
+    return failed ? 1 : 0;
+}